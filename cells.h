@@ -0,0 +1,43 @@
+#ifndef TOM_CELLS_H
+#define TOM_CELLS_H
+
+/* What can be in a cell. Everything but EMPTY is solid, as a cell only holds one thing.
+
+   slide says what a droplet does when it's resting on the cell and could go either way:
+
+	SLIDE_RANDOM	left or right at random
+	SLIDE_BIAS		red droplets move red cells, blue ones blue (-1 left, +1 right)
+	SLIDE_STICK		stays put
+
+   The droplet kernel is built from this table, at compile time, so a material costs a
+   compare only if it's not SLIDE_RANDOM. Add new materials before WALL; the palette only
+   has room for PALETTE_SIZE cells. POOL_RED and POOL_BLUE are droplets that have settled
+   into a pool (see collapse_pools); they look the same, and stay last.
+
+	CELL(name,		classic colour,		night colour,		slide,			red,blue) */
+#define CELLS(CELL)\
+	CELL(EMPTY,		RGB(0,0,0),			RGB(0,0,40),		SLIDE_RANDOM,	0,0)\
+	CELL(YELLOW,	RGB(200,200,0),		RGB(120,80,40),		SLIDE_RANDOM,	0,0)\
+	CELL(GREEN,		RGB(0,255,0),		RGB(0,160,80),		SLIDE_BIAS,		-1,+1)\
+	CELL(MAGENTA,	RGB(255,0,255),		RGB(160,60,160),	SLIDE_BIAS,		+1,-1)\
+	CELL(ORANGE,	RGB(255,128,0),		RGB(170,90,20),		SLIDE_STICK,	0,0)\
+	CELL(WALL,		RGB(255,255,255),	RGB(90,90,110),		SLIDE_RANDOM,	0,0)\
+	CELL(RED,		RGB(255,0,0),		RGB(255,120,80),	SLIDE_RANDOM,	0,0)\
+	CELL(BLUE,		RGB(0,0,255),		RGB(80,200,255),	SLIDE_RANDOM,	0,0)\
+	CELL(POOL_RED,	RGB(255,0,0),		RGB(255,120,80),	SLIDE_RANDOM,	0,0)\
+	CELL(POOL_BLUE,	RGB(0,0,255),		RGB(80,200,255),	SLIDE_RANDOM,	0,0)
+
+enum {
+	SLIDE_RANDOM,
+	SLIDE_BIAS,
+	SLIDE_STICK,
+};
+
+#define CELL_ENUM(NAME,CLASSIC,NIGHT,SLIDE,RED,BLUE) CELL_##NAME,
+enum {
+	CELLS(CELL_ENUM)
+	NUM_CELLS
+};
+#undef CELL_ENUM
+
+#endif
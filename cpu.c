@@ -0,0 +1,165 @@
+/* What the CPU can do. Looked at once, the first time anyone asks; after that it's just
+   a compare. -cpu NAME on the command line stops anything using more than NAME, to see
+   how the others do, or to get round a bad one. */
+#include <windows.h>
+#include <intrin.h>
+#include <immintrin.h>
+#include <string.h>
+#include <ctype.h>
+#include "debug.h"
+#include "cpu.h"
+
+static const char *const level_names[NUM_CPU_LEVELS]={"C","SSE2","SSSE3","SSE4.1","AVX2","AVX-512"};
+
+/* Best level the CPU can do, -1 until it's been looked at; and best one allowed. Both are
+   the same for every thread, so it doesn't matter which thread fills them in. */
+static int detected=-1;
+static int limit=NUM_CPU_LEVELS-1;
+
+/*
+	detect
+
+	Returns the highest CPU_xxx the CPU, and for AVX2 and AVX-512 the OS, can run.
+*/
+static int detect(void) {
+	int regs[4],max_leaf,ecx1;
+	DWORD xcr0;
+
+	__cpuid(regs,0);
+	max_leaf=regs[0];
+	if(max_leaf<1) {
+		return CPU_C;
+	}
+	__cpuid(regs,1);
+	ecx1=regs[2];
+	if(!(regs[3]&(1<<26))) {
+		return CPU_C;
+	}
+	if(!(ecx1&(1<<9))) {
+		return CPU_SSE2;
+	}
+	if(!(ecx1&(1<<19))) {
+		return CPU_SSSE3;
+	}
+	/* The wider registers need the OS to save them */
+	if(!(ecx1&(1<<27))||max_leaf<7) {
+		return CPU_SSE41;
+	}
+	xcr0=(DWORD)_xgetbv(0);				/* the bits that matter are all in the bottom byte */
+	__cpuidex(regs,7,0);
+	if((xcr0&6)!=6||!(regs[1]&(1<<5))) {
+		return CPU_SSE41;
+	}
+	/* Opmask and the top halves of all 32 ZMM registers too */
+	if((xcr0&0xE6)!=0xE6||!(regs[1]&(1<<16))||!(regs[1]&(1<<30))) {
+		return CPU_AVX2;
+	}
+	return CPU_AVX512;
+}
+
+/* Returns the highest CPU_xxx the CPU can run, whatever -cpu says. */
+int cpu_detected(void) {
+	if(detected<0) {
+		detected=detect();
+		dprintf("cpu: %s\n",level_names[detected]);
+	}
+	return detected;
+}
+
+/*
+	cpu_has
+
+	Returns non-0 if the given CPU_xxx can be used: the CPU can run it, and -cpu doesn't
+	rule it out.
+*/
+int cpu_has(int level) {
+	return level>=0&&level<=limit&&level<=cpu_detected();
+}
+
+/* Returns the highest CPU_xxx that can be used. */
+int cpu_best(void) {
+	return min(limit,cpu_detected());
+}
+
+const char *cpu_name(int level) {
+	return level>=0&&level<NUM_CPU_LEVELS?level_names[level]:"?";
+}
+
+/*
+	cpu_find
+
+	Returns the CPU_xxx with the given name, ignoring case and punctuation, so "avx512"
+	and "sse41" do; or -1 if there isn't one.
+*/
+int cpu_find(const char *name) {
+	int i;
+
+	for(i=0;i<NUM_CPU_LEVELS;i++) {
+		const char *a=name,*b=level_names[i];
+
+		for(;;) {
+			while(*a&&!isalnum((unsigned char)*a)) {
+				a++;
+			}
+			while(*b&&!isalnum((unsigned char)*b)) {
+				b++;
+			}
+			if(!*a||!*b||tolower((unsigned char)*a)!=tolower((unsigned char)*b)) {
+				break;
+			}
+			a++;
+			b++;
+		}
+		if(!*a&&!*b) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+	cpu_set_limit
+
+	Stops anything using more than the given CPU_xxx from then on.
+
+	Return: non-0 if OK, 0 if the CPU can't run it anyway.
+*/
+int cpu_set_limit(int level) {
+	if(level<0||level>cpu_detected()) {
+		return 0;
+	}
+	limit=level;
+	dprintf("cpu: limited to %s\n",level_names[limit]);
+	return 1;
+}
+
+/*
+	cpu_option
+
+	Looks for -cpu NAME on a command line, and if it's there, stops anything using more
+	than that from then on.
+
+	Return: non-0 if OK (including if there's no -cpu), 0 if NAME isn't a CPU_xxx or the
+	CPU can't run it.
+*/
+int cpu_option(const char *cmd_line) {
+	const char *p;
+	char name[16];
+	int n=0;
+
+	for(p=cmd_line;(p=strstr(p,"-cpu"))!=0;p+=4) {
+		if((p==cmd_line||isspace((unsigned char)p[-1]))&&isspace((unsigned char)p[4])) {
+			break;
+		}
+	}
+	if(!p) {
+		return 1;
+	}
+	for(p+=4;isspace((unsigned char)*p);p++) {
+	}
+	while(*p&&!isspace((unsigned char)*p)&&n<(int)sizeof(name)-1) {
+		name[n++]=*p++;
+	}
+	name[n]=0;
+	return cpu_set_limit(cpu_find(name));
+}
@@ -0,0 +1,24 @@
+#ifndef TOM_CPU_H
+#define TOM_CPU_H
+
+/* Levels of instruction set, each including the ones before. Anything with a choice of
+   ways of doing something picks the highest one cpu_has says yes to. */
+enum {
+	CPU_C,								/* plain C; always available */
+	CPU_SSE2,
+	CPU_SSSE3,							/* pshufb */
+	CPU_SSE41,
+	CPU_AVX2,
+	CPU_AVX512,							/* F and BW */
+	NUM_CPU_LEVELS
+};
+
+int cpu_has(int level);
+int cpu_best(void);
+int cpu_detected(void);
+const char *cpu_name(int level);
+int cpu_find(const char *name);
+int cpu_set_limit(int level);
+int cpu_option(const char *cmd_line);
+
+#endif
@@ -0,0 +1,2199 @@
+/* Simulation engine. Owns the landscape, the droplets and the back buffer, and runs the
+   physics on its own thread. The UI thread sends it commands, and shows the frames it
+   produces whenever it's ready. */
+#include <process.h>
+#include <windows.h>
+#include <mmsystem.h>
+#include <ddraw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <malloc.h>
+#include <psapi.h>
+#include "debug.h"
+#include "resource.h"
+#include "strings.h"
+#include "land.h"
+#include "engine.h"
+
+/* Frames are published no more often than this while it's running. At high tick rates,
+   and in turbo mode especially, copying every tick's frame would take longer than the
+   ticks do. */
+#define DISPLAY_HZ (60)
+
+/* The second word of a droplet: byte 0 is the type, byte 1 the gate it's on (0 for none). */
+#define DROP_TYPE(P) (((BYTE *)((P)+1))[0])
+#define DROP_GATE(P) (((BYTE *)((P)+1))[1])
+
+/* Map droplet type to droplet cell. Type 0 is red, 1 blue, as per CELLS. */
+static const BYTE droplet_cells[2]={CELL_RED,CELL_BLUE};
+
+/* Rows of wall above the back buffer, so a droplet on the top row can look up without
+   checking it's on the top row */
+#define GUARD_ROWS (1)
+
+/* LAYOUT_TILES: tiles are TILE_W x TILE_H cells, a cache line, stored one after another
+   a row of tiles at a time. A cell index is then bit fields: from the top, tile row, tile
+   column, row in tile, column in tile. */
+#define TILE_W_BITS (3)
+#define TILE_H_BITS (3)
+#define TILE_W (1<<TILE_W_BITS)
+#define TILE_H (1<<TILE_H_BITS)
+
+/* Pools: droplets are looked at to see if they can go in one every this many ticks */
+#define POOL_TICKS (16)
+#define IS_POOLED(CELL) ((CELL)>=CELL_POOL_RED)
+
+/* Pressure moves water every this many ticks; see apply_pressure */
+#define PRESSURE_TICKS (8)
+/* Water of any kind, pooled or not */
+#define IS_WET(CELL) ((CELL)>=CELL_RED)
+/* Entry in bodies for a cell with no water in it */
+#define DRY (~0u)
+
+/* With row_order, droplets are sorted every this many ticks; see sort_drops */
+#define SORT_TICKS (64)
+
+/* Mapped storage: bands are about this many bytes of grid each */
+#define BAND_BYTES (1<<20)
+/* Where the droplets are is looked at every this many ticks; see update_bands */
+#define MAP_TICKS (64)
+/* A band with no droplets in or next to it for this many looks in a row is let go */
+#define BAND_QUIET (4)
+/* Most ranges of memory a band covers: grid, gate map, back buffer, landscape */
+#define BAND_RANGES (4)
+
+/* A range of memory, as PrefetchVirtualMemory wants them */
+typedef struct map_range_t {
+	void *addr;
+	SIZE_T size;
+}map_range_t;
+
+/* PrefetchVirtualMemory is only there from Windows 8, so it's looked up */
+typedef BOOL (WINAPI *prefetch_fn_t)(HANDLE process,ULONG_PTR num_ranges,map_range_t *ranges,ULONG flags);
+
+/*
+drop_key
+
+  Zobrist key of a droplet of a type (0 red, 1 blue) in a cell. There are too many cells
+  for a table of random keys, so it's a hash of the two instead: splitmix64's finisher.
+*/
+static __forceinline ULONGLONG drop_key(unsigned cell,unsigned type) {
+	ULONGLONG k=((ULONGLONG)cell<<1|type)+0x9E3779B97F4A7C15ULL;
+
+	k=(k^k>>30)*0xBF58476D1CE4E5B9ULL;
+	k=(k^k>>27)*0x94D049BB133111EBULL;
+	return k^k>>31;
+}
+
+/* Draw and update droplets, 1 byte/cell */
+static void draw_all_droplets(int mask,void *ve,DDSURFACEDESC *ds);
+static void update_all_droplets(int no_era,void *ve,DDSURFACEDESC *ds);
+
+#ifdef _DEBUG
+static void log_droplets(engine_t *e,char *file,char *mode) {
+	FILE *h;
+
+	h=fopen(file,mode);
+	if(h) {
+		unsigned i;
+
+		fprintf(h,"There are %u droplets.\n",e->num_drops);
+		fprintf(h,"Stride is %u, layout %d.\n",e->stride,e->layout);
+		fprintf(h,"Hash is %08X%08X at tick %u.\n",(unsigned)(e->hash>>32),(unsigned)e->hash,e->ticks);
+		for(i=0;i<e->num_drops;i++) {
+			int x,y;
+
+			engine_cell_xy(e,e->drops[i*2],&x,&y);
+			fprintf(h,"#%u: dw1=0x%08X dw2=0x%08X (X=%d, Y=%d)\n",i,e->drops[i*2],e->drops[i*2+1],x,y);
+		}
+		fclose(h);
+	}
+}
+#endif
+
+/*
+engine_bucket_size
+
+  Returns the size of bucket needed for a given number of droplets.
+*/
+int engine_bucket_size(unsigned num_drops) {
+	/* Bucket must be big enuogh to contain all droplets */
+	return (int)sqrt(num_drops)+10;
+}
+
+/*
+engine_rand
+
+  Returns the engine's next random number, from 0 to ENGINE_RAND_MAX. It's the same
+  sequence rand() gives, but each engine has its own, so worlds on different threads don't
+  disturb each other, and a seed always makes the same world.
+*/
+static unsigned engine_rand(engine_t *e) {
+	e->rand_state=e->rand_state*214013+2531011;
+	return (e->rand_state>>16)&ENGINE_RAND_MAX;
+}
+
+/*
+cell_at
+
+  Returns the cell index of (x,y), as it's laid out in the grid the droplets move in.
+
+  stride -> cells per row
+  layout -> LAYOUT_xxx
+*/
+static unsigned cell_at(unsigned stride,int layout,int x,int y) {
+	if(layout!=LAYOUT_TILES) {
+		return y*stride+x;
+	}
+	return ((y>>TILE_H_BITS)*stride+(x&~(TILE_W-1)))*TILE_H+((y&(TILE_H-1))<<TILE_W_BITS)+(x&(TILE_W-1));
+}
+
+/* The other way round */
+static void cell_xy(unsigned stride,int layout,unsigned cell,int *x,int *y) {
+	unsigned r;
+
+	if(layout!=LAYOUT_TILES) {
+		*x=cell%stride;
+		*y=cell/stride;
+		return;
+	}
+	r=cell%(stride*TILE_H);
+	*x=(r>>(TILE_W_BITS+TILE_H_BITS)<<TILE_W_BITS)+(r&(TILE_W-1));
+	*y=cell/(stride*TILE_H)*TILE_H+((r>>TILE_W_BITS)&(TILE_H-1));
+}
+
+/*
+engine_cell
+
+  Returns the cell index of (x,y) in the back buffer, the bucket at the top, as droplets
+  and the heat map have them.
+*/
+unsigned engine_cell(const engine_t *e,int x,int y) {
+	return cell_at(e->stride,e->layout,x,y);
+}
+
+/*
+engine_cell_xy
+
+  Gets the position in the back buffer of a cell index, such as a droplet's.
+*/
+void engine_cell_xy(const engine_t *e,unsigned cell,int *x,int *y) {
+	cell_xy(e->stride,e->layout,cell,x,y);
+}
+
+/* XOR of the keys of the droplets in drops (not the pooled ones) */
+static ULONGLONG hash_drops(const engine_t *e) {
+	ULONGLONG hash=0;
+	unsigned i;
+
+	for(i=0;i<e->num_drops;i++) {
+		hash^=drop_key(e->drops[i*2],DROP_TYPE(&e->drops[i*2]));
+	}
+	return hash;
+}
+
+/*
+set_drops
+
+  Sets the number of droplets. Existing droplets are removed and a fresh
+  set is created.
+
+  num_drops -> number of droplets
+*/
+static void set_drops(engine_t *e,unsigned num_drops) {
+	free(e->drops);
+	/* Any pools were taken out of the old ones */
+	e->num_pooled=0;
+	e->num_woken=0;
+	e->wake_all=0;
+	if(!num_drops) {
+		e->num_drops=0;
+		e->drops=0;
+		e->hash=0;
+	} else {
+		unsigned idx;
+		int i,j;
+
+		e->drops=malloc(num_drops*sizeof(unsigned)*2);
+		memset(e->drops,0,num_drops*sizeof(unsigned)*2);
+		e->num_drops=num_drops;
+		/* Generate positions */
+		idx=0;
+		for(i=1;idx<=e->num_drops&&i<e->bucket_size;i++) {
+			for(j=1;idx<e->num_drops&&j<i*2;j++) {
+				unsigned cell;
+
+				cell=(e->area_width/2-i)+j;								/* X position */
+				cell+=(e->bucket_size-i)*e->stride;						/* Y position */
+				/* That's as rows. X can run off the end of one when the bucket's wider
+				   than the area, so it's converted afterwards, as it stands. */
+				e->drops[idx*2]=cell_at(e->stride,e->layout,cell%e->stride,cell/e->stride);
+				DROP_TYPE(&e->drops[idx*2])=engine_rand(e)>=ENGINE_RAND_MAX/2;	/* droplet type */
+				idx++;
+			}
+		}
+		e->hash=hash_drops(e);
+#ifdef _DEBUG
+		log_droplets(e,get_string(IDS_DROPLETDATAFILE),"wt");
+#endif
+	}
+}
+
+/*
+sort_drops
+
+  Puts the droplets in order of row, bottom row first, and otherwise as they were. Each
+  tick then goes through the grid from bottom to top, a few rows at a time, rather than
+  all over it; a big world's grid is far bigger than the cache, and droplets that have
+  been moving a while are in no order at all. It's a counting sort, so one look at each
+  droplet to count the rows and one to move it.
+
+  Droplets still move one at a time, each seeing where the ones before went, but in a
+  different order, so the water doesn't go quite where it would have. Bottom first is the
+  order they start in (see set_drops), so droplets falling together fall as one.
+*/
+static void sort_drops(engine_t *e) {
+	unsigned rows=e->area_height+e->bucket_size,*start,*sorted,*p,i;
+	int x,y;
+
+	if(!e->num_drops) {
+		return;
+	}
+	start=calloc(rows+1,sizeof(unsigned));
+	/* Room for the pooled ones as well, for when they wake */
+	sorted=malloc((e->num_drops+e->num_pooled)*sizeof(unsigned)*2);
+	if(!start||!sorted) {
+		free(start);
+		free(sorted);
+		return;
+	}
+	for(i=0,p=e->drops;i<e->num_drops;i++,p+=2) {
+		cell_xy(e->stride,e->layout,p[0],&x,&y);
+		start[rows-y]++;
+	}
+	for(i=1;i<rows;i++) {
+		start[i]+=start[i-1];
+	}
+	for(i=0,p=e->drops;i<e->num_drops;i++,p+=2) {
+		unsigned *q;
+
+		cell_xy(e->stride,e->layout,p[0],&x,&y);
+		q=&sorted[start[rows-1-y]++*2];
+		q[0]=p[0];
+		q[1]=p[1];
+	}
+	free(e->drops);
+	e->drops=sorted;
+	free(start);
+}
+
+/*
+grid_stride
+
+  Returns the number of cells in a row of the back buffer, for a given area width.
+
+  layout -> LAYOUT_xxx. Anything but LAYOUT_ROWS wants a power of two: LAYOUT_POW2 has a
+  kernel for each, and LAYOUT_TILES finds neighbours by masking.
+*/
+static unsigned grid_stride(int width,int layout) {
+	unsigned stride=16;
+
+	if(layout!=LAYOUT_ROWS) {
+		while(stride<(unsigned)width) {
+			stride*=2;
+		}
+		return stride;
+	}
+	/* Multiple of 16, so rows are 16-byte aligned */
+	return (width+15)&~15;
+}
+
+/* Returns the surface the droplets are in: the tiles, or the back buffer. */
+static DDSURFACEDESC *grid_of(engine_t *e) {
+	return e->layout==LAYOUT_TILES?&e->tiles:&e->back;
+}
+
+/*
+tile_rect
+
+  Copies part of a surface laid out in rows to the same part of one in tiles.
+
+  r -> part to copy, in cells
+*/
+static void tile_rect(const engine_t *e,DDSURFACEDESC *tiles,const DDSURFACEDESC *rows,const RECT *r) {
+	int x,y,n;
+
+	for(y=r->top;y<r->bottom;y++) {
+		const BYTE *s=(const BYTE *)rows->lpSurface+y*rows->lPitch;
+
+		for(x=r->left;x<r->right;x+=n) {
+			n=min(TILE_W-(x&(TILE_W-1)),r->right-x);
+			memcpy((BYTE *)tiles->lpSurface+cell_at(e->stride,LAYOUT_TILES,x,y),s+x,n);
+		}
+	}
+}
+
+/*
+detile_rect
+
+  The other way round: copies part of the tiles to rows.
+
+  rows -> where (0,0) would go
+  pitch -> bytes per row there
+  r -> part to copy, in cells
+*/
+static void detile_rect(const engine_t *e,BYTE *rows,int pitch,const RECT *r) {
+	int x,y,n;
+
+	for(y=r->top;y<r->bottom;y++) {
+		BYTE *d=rows+y*pitch;
+
+		for(x=r->left;x<r->right;x+=n) {
+			n=min(TILE_W-(x&(TILE_W-1)),r->right-x);
+			memcpy(d+x,(const BYTE *)e->tiles.lpSurface+cell_at(e->stride,LAYOUT_TILES,x,y),n);
+		}
+	}
+}
+
+/* Fills in the random table. The same table does for any size. */
+static void init_dir_tbl(engine_t *e) {
+	int i,n_l=0,n_r=0;
+
+	for(i=0;i<RND_TBL_SIZE;i++) {
+		e->dir_tbl[i]=((float)engine_rand(e)/ENGINE_RAND_MAX)>0.5?-1:+1;
+		if((signed)e->dir_tbl[i]<0) {
+			n_l++;
+		} else {
+			n_r++;
+		}
+	}
+	dprintf("dir_tbl: %d elements: %d left, %d right\n",RND_TBL_SIZE,n_l,n_r);
+}
+
+/* Draw bucket and frame */
+static void do_bucket(engine_t *e) {
+	int i,cx,cy;
+
+	cx=e->area_width/2;
+	for(i=1;i<=e->bucket_size;i++) {
+		int dx;
+
+		cy=e->bucket_size-i;
+		dx=max(i,e->bucket_neck_size);
+		/* With lots of droplets, the top of the bucket is wider than the area. There
+		   must still be a wall each side, or droplets walk off the edge. */
+		land_hline(&e->back,CELL_WALL,cy,0,max(cx-dx,0));
+		land_hline(&e->back,CELL_WALL,cy,min(cx+dx,e->area_width-1),e->area_width-1);
+	}
+}
+
+/*
+copy_land
+
+  Copies landscape to back buffer, below the bucket, and on to the tiles if that's where
+  the droplets are.
+
+  r -> area of landscape to copy, or NULL for all of it
+*/
+static void copy_land(engine_t *e,const RECT *r) {
+	RECT all;
+	int y,n;
+
+	if(!r) {
+		SetRect(&all,0,0,e->area_width,e->area_height);
+		r=&all;
+	}
+	n=r->right-r->left;
+	for(y=r->top;y<r->bottom;y++) {
+		memcpy((BYTE *)e->back.lpSurface+(y+e->bucket_size)*e->back.lPitch+r->left,
+			(BYTE *)e->land.lpSurface+y*e->land.lPitch+r->left,n);
+	}
+	if(e->layout==LAYOUT_TILES) {
+		RECT b=*r;
+
+		OffsetRect(&b,0,e->bucket_size);
+		tile_rect(e,&e->tiles,&e->back,&b);
+	}
+}
+
+/*
+clear_gates
+
+  Removes all the gates, and their counts.
+*/
+static void clear_gates(engine_t *e) {
+	unsigned i;
+
+	if(e->gate_map.lpSurface) {
+		memset(e->gate_map.lpSurface,0,(size_t)e->gate_map.lPitch*e->gate_map.dwHeight);
+	}
+	if(e->gate_tiles.lpSurface) {
+		memset(e->gate_tiles.lpSurface,0,(size_t)e->gate_tiles.lPitch*e->gate_tiles.dwHeight);
+	}
+	for(i=0;i<e->num_drops;i++) {
+		DROP_GATE(&e->drops[i*2])=0;
+	}
+	memset(e->gate_counts,0,sizeof e->gate_counts);
+	memset(e->gate_sampled,0,sizeof e->gate_sampled);
+	memset(&e->gate_stats,0,sizeof e->gate_stats);
+	e->gate_sample_tick=e->ticks;
+}
+
+/*
+add_gate
+
+  Draws a gate onto the gate map, as a 1-cell line. It's 8-connected, and droplets only
+  ever move across or down, so they can't get past without stepping on it.
+
+  s -> ends of the line, in landscape coordinates (the bucket is above y=0)
+*/
+static void add_gate(engine_t *e,const stroke_t *s) {
+	RECT clip;
+	int bs=e->bucket_size;
+
+	if(e->gate_stats.num_gates==MAX_GATES) {
+		return;
+	}
+	SetRect(&clip,0,0,e->area_width,e->area_height+bs);
+	land_stroke(&e->gate_map,&clip,++e->gate_stats.num_gates,s->x1,s->y1+bs,s->x2,s->y2+bs,1,0);
+	if(e->layout==LAYOUT_TILES) {
+		tile_rect(e,&e->gate_tiles,&e->gate_map,&clip);
+	}
+}
+
+/*
+sample_gates
+
+  Adds the crossings since the last sample to the gate time series.
+*/
+static void sample_gates(engine_t *e) {
+	gate_stats_t *g=&e->gate_stats;
+	int i,j;
+
+	if(g->num_samples==GATE_SAMPLES) {
+		memmove(g->samples[0],g->samples[1],sizeof g->samples[0]*(GATE_SAMPLES-1));
+		g->num_samples--;
+	}
+	for(i=0;i<MAX_GATES;i++) {
+		for(j=0;j<2;j++) {
+			g->samples[g->num_samples][i][j]=e->gate_counts[i+1][j]-e->gate_sampled[i+1][j];
+			g->totals[i][j]=e->gate_counts[i+1][j];
+		}
+	}
+	g->num_samples++;
+	memcpy(e->gate_sampled,e->gate_counts,sizeof e->gate_sampled);
+	e->gate_sample_tick=e->ticks;
+}
+
+/*
+set_heat
+
+  Starts counting droplet visits to each cell, with all counts 0, or stops. The map is
+  the same shape as the grid the droplets are in, so it goes if that does.
+
+  ticks -> count every this many ticks, or 0 to stop
+  drops -> count every this many droplets
+*/
+static void set_heat(engine_t *e,int ticks,int drops) {
+	free(e->heat);
+	e->heat=0;
+	e->heat_samples=0;
+	e->heat_first=0;
+	e->heat_rounds=0;
+	if(ticks<=0||!grid_of(e)->lpSurface) {
+		return;
+	}
+	e->heat=calloc((size_t)grid_of(e)->lPitch*grid_of(e)->dwHeight,sizeof(unsigned));
+	if(!e->heat) {
+		dprintf("engine: out of memory for heat map\n");
+		return;
+	}
+	e->heat_ticks=ticks;
+	e->heat_drops=max(drops,1);
+}
+
+/*
+sample_heat
+
+  Counts a visit to the cell of each droplet due to be counted. With heat_drops>1, a
+  different lot are counted each time, and it's a round when each has had a turn. Pooled
+  droplets aren't looked at; they're counted once a round, all at once (see
+  collapse_pools).
+*/
+static void sample_heat(engine_t *e) {
+	unsigned *heat=e->heat,*drops=e->drops,j,step=e->heat_drops;
+
+	for(j=e->heat_first;j<e->num_drops;j+=step) {
+		heat[drops[j*2]]++;
+	}
+	e->heat_first=(e->heat_first+1)%step;
+	if(!e->heat_first) {
+		e->heat_rounds++;
+	}
+	e->heat_samples++;
+}
+
+/* Returns the gate map the droplets' cell indices go with. */
+static BYTE *gates_of(engine_t *e) {
+	return e->layout==LAYOUT_TILES?e->gate_tiles.lpSurface:e->gate_map.lpSurface;
+}
+
+/*
+near_cells
+
+  Gets the cells round one, as the kernels see them: left, right, below and above. On the
+  top row, there's nothing above, which the kernels take as solid.
+
+  Return: how many there are, 3 or 4.
+*/
+static int near_cells(const engine_t *e,unsigned cell,unsigned *near) {
+	unsigned mx,my;
+
+	if(e->layout!=LAYOUT_TILES) {
+		near[0]=cell-1;
+		near[1]=cell+1;
+		near[2]=cell+e->stride;
+		near[3]=cell-e->stride;
+		return cell>=e->stride?4:3;
+	}
+	mx=((e->stride/TILE_W-1)<<(TILE_W_BITS+TILE_H_BITS))|(TILE_W-1);
+	my=~mx;
+	near[0]=(((cell&mx)-1)&mx)|(cell&my);
+	near[1]=(((cell|my)+1)&mx)|(cell&my);
+	near[2]=(((cell|mx)+TILE_W)&my)|(cell&mx);
+	near[3]=(((cell&my)-TILE_W)&my)|(cell&mx);
+	return cell&my?4:3;
+}
+
+/*
+wake_pools
+
+  Notes that a cell next to a pooled one has been emptied. Called by the kernels; the
+  pooled cells wake at the end of the tick (see update_pools). If there's no room to note
+  it, every pool wakes instead, which is slow but loses nothing.
+*/
+static void wake_pools(engine_t *e,unsigned cell) {
+	if(e->num_woken==e->max_woken) {
+		unsigned n=e->max_woken?e->max_woken*2:256;
+		unsigned *p=realloc(e->woken,n*sizeof(unsigned));
+
+		if(!p) {
+			e->wake_all=1;
+			return;
+		}
+		e->woken=p;
+		e->max_woken=n;
+	}
+	e->woken[e->num_woken++]=cell;
+}
+
+/*
+expand_cell
+
+  Turns a pooled cell back into a droplet, on the end of drops. Anything else is left
+  alone.
+*/
+static void expand_cell(engine_t *e,unsigned cell) {
+	BYTE *grid=grid_of(e)->lpSurface;
+	unsigned *p;
+
+	if(!IS_POOLED(grid[cell])) {
+		return;
+	}
+	p=&e->drops[e->num_drops++*2];
+	p[0]=cell;
+	p[1]=0;
+	DROP_TYPE(p)=(BYTE)(grid[cell]-CELL_POOL_RED);
+	DROP_GATE(p)=gates_of(e)[cell];
+	grid[cell]=droplet_cells[DROP_TYPE(p)];
+	if(e->heat) {
+		/* See collapse_pools */
+		e->heat[cell]+=e->heat_rounds;
+	}
+	e->num_pooled--;
+}
+
+/*
+expand_pools
+
+  Wakes every pooled droplet in r, or all of them. Pools are only in the grid, so this is
+  a look at every cell; it's for when the landscape changes, which is that much work
+  anyway.
+
+  r -> part of the back buffer, or NULL for all of it
+*/
+static void expand_pools(engine_t *e,const RECT *r) {
+	RECT all,c;
+	int x,y;
+
+	if(!e->num_pooled||!grid_of(e)->lpSurface) {
+		return;
+	}
+	SetRect(&all,0,0,e->area_width,e->area_height+e->bucket_size);
+	if(!r) {
+		r=&all;
+	}
+	if(!IntersectRect(&c,r,&all)) {
+		return;
+	}
+	for(y=c.top;y<c.bottom;y++) {
+		for(x=c.left;x<c.right;x++) {
+			expand_cell(e,engine_cell(e,x,y));
+		}
+	}
+}
+
+/*
+collapse_pools
+
+  Takes droplets that can't move out of drops, and leaves them in the grid as pooled cells.
+  A droplet that's just stepped onto a gate hasn't been counted yet, so it waits.
+*/
+static void collapse_pools(engine_t *e) {
+	BYTE *grid=grid_of(e)->lpSurface,*gates=gates_of(e);
+	unsigned *p,*dest,i,near[4];
+	int k,n;
+
+	/* Mark them all before any are taken out, so each sees the others as they were */
+	for(i=0,p=e->drops;i<e->num_drops;i++,p+=2) {
+		n=near_cells(e,p[0],near);
+		for(k=0;k<n&&grid[near[k]];k++) {
+		}
+		if(k==n&&DROP_GATE(p)==gates[p[0]]) {
+			grid[p[0]]=(BYTE)(CELL_POOL_RED+DROP_TYPE(p));
+		}
+	}
+	/* Keep the rest in the same order */
+	for(i=0,p=dest=e->drops;i<e->num_drops;i++,p+=2) {
+		if(IS_POOLED(grid[p[0]])) {
+			if(e->heat) {
+				/* It'll be counted once a round for as long as it's pooled, so that's
+				   taken off now and put back when it wakes; see engine_heat. */
+				e->heat[p[0]]-=e->heat_rounds;
+			}
+			e->num_pooled++;
+		} else {
+			dest[0]=p[0];
+			dest[1]=p[1];
+			dest+=2;
+		}
+	}
+	e->num_drops=(unsigned)(dest-e->drops)/2;
+}
+
+/*
+update_pools
+
+  After each tick: wakes pooled droplets next to cells emptied during it, and now and then
+  looks for more to pool.
+*/
+static void update_pools(engine_t *e) {
+	unsigned i,near[4];
+	int k,n;
+
+	if(e->wake_all) {
+		e->wake_all=0;
+		expand_pools(e,0);
+	}
+	for(i=0;i<e->num_woken;i++) {
+		n=near_cells(e,e->woken[i],near);
+		for(k=0;k<n;k++) {
+			expand_cell(e,near[k]);
+		}
+	}
+	e->num_woken=0;
+	if(e->ticks%POOL_TICKS==0) {
+		collapse_pools(e);
+	}
+}
+
+/*
+engine_heat
+
+  Returns how many times the heat map has counted water in a cell, pooled or not.
+*/
+unsigned engine_heat(engine_t *e,int x,int y) {
+	unsigned cell=engine_cell(e,x,y);
+
+	if(!e->heat) {
+		return 0;
+	}
+	return e->heat[cell]+(IS_POOLED(((BYTE *)grid_of(e)->lpSurface)[cell])?e->heat_rounds:0);
+}
+
+/*
+find_body
+
+  Finds the body of water a cell is in. Each wet cell in bodies points at another in the
+  same body, ending at the body's first; the cells passed on the way are pointed further
+  along, so next time's quicker.
+
+  i -> index into bodies of a wet cell
+
+  Return: index of the body's first cell.
+*/
+static unsigned find_body(unsigned *bodies,unsigned i) {
+	while(bodies[i]!=i) {
+		bodies[i]=bodies[bodies[i]];
+		i=bodies[i];
+	}
+	return i;
+}
+
+/* Makes two wet cells' bodies one, whose first cell is the first of either. */
+static void join_bodies(unsigned *bodies,unsigned i,unsigned j) {
+	i=find_body(bodies,i);
+	j=find_body(bodies,j);
+	if(i<j) {
+		bodies[j]=i;
+	} else {
+		bodies[i]=j;
+	}
+}
+
+/*
+add_level
+
+  Adds an end to tops or gaps, making room as needed. If there's no room, it's left out,
+  and that's one move fewer.
+*/
+static void add_level(level_t **levels,unsigned *num,unsigned *max,unsigned body,
+	unsigned rank,unsigned what)
+{
+	if(*num==*max) {
+		unsigned n=*max?*max*2:256;
+		level_t *p=realloc(*levels,n*sizeof(level_t));
+
+		if(!p) {
+			return;
+		}
+		*levels=p;
+		*max=n;
+	}
+	(*levels)[*num].body=body;
+	(*levels)[*num].rank=rank;
+	(*levels)[*num].what=what;
+	++*num;
+}
+
+/* qsort callback: level_ts by body, then by rank. what decides ties, so it's the same
+   every time. */
+static int compare_levels(const void *va,const void *vb) {
+	const level_t *a=va,*b=vb;
+
+	if(a->body!=b->body) {
+		return a->body<b->body?-1:1;
+	}
+	if(a->rank!=b->rank) {
+		return a->rank<b->rank?-1:1;
+	}
+	return a->what<b->what?-1:a->what>b->what;
+}
+
+/*
+apply_pressure
+
+  Levels out each body of water in the area. Tops are droplets with nothing above them
+  and something below and either side, which only pressure could move (one with a space
+  to the side goes there by itself, like the bits of a falling stream); gaps are empty
+  cells with something below and water next to them, left, right or below. In each body,
+  the highest top goes to the lowest gap, then the next highest to the next lowest, and
+  so on while the gap's lower than the top. Every move is downhill, so it can't go round
+  in circles, and after a few goes the level's as even as droplets allow.
+
+  A new body for each go, rather than keeping one up to date: droplets move every tick,
+  and a union-find can join bodies but not split them. It's one look at each cell every
+  PRESSURE_TICKS ticks.
+*/
+static void apply_pressure(engine_t *e) {
+	BYTE *grid=grid_of(e)->lpSurface,*gates=e->gate_stats.num_gates?gates_of(e):0;
+	int w=e->area_width,ht=e->area_height,bs=e->bucket_size,x,y,k,m;
+	unsigned *bodies,*p,i,t,g,cell,num_tops=0,num_gaps=0,num_cands,near[3];
+	size_t size=(size_t)w*ht;
+
+	if(size>e->max_bodies) {
+		free(e->bodies);
+		e->bodies=malloc(size*sizeof(unsigned));
+		e->max_bodies=e->bodies?size:0;
+		if(!e->bodies) {
+			dprintf("engine: out of memory for pressure\n");
+			return;
+		}
+	}
+	bodies=e->bodies;
+	/* Join each wet cell to those left of it and above it. Gaps are noted on the way, but
+	   which bodies they're next to isn't known until the end. */
+	for(y=0,i=0;y<ht;y++) {
+		for(x=0;x<w;x++,i++) {
+			cell=cell_at(e->stride,e->layout,x,bs+y);
+			if(IS_WET(grid[cell])) {
+				bodies[i]=i;
+				if(x>0&&bodies[i-1]!=DRY) {
+					join_bodies(bodies,i-1,i);
+				}
+				if(y>0&&bodies[i-w]!=DRY) {
+					join_bodies(bodies,i-w,i);
+				}
+			} else {
+				bodies[i]=DRY;
+				if(!grid[cell]&&y+1<ht&&x>0&&x+1<w) {
+					BYTE below=grid[cell_at(e->stride,e->layout,x,bs+y+1)];
+
+					if(below&&(IS_WET(below)|IS_WET(grid[cell_at(e->stride,e->layout,x-1,bs+y)])|
+						IS_WET(grid[cell_at(e->stride,e->layout,x+1,bs+y)])))
+					{
+						add_level(&e->gaps,&num_gaps,&e->max_gaps,i,ht-1-y,cell);
+					}
+				}
+			}
+		}
+	}
+	/* A gap between two bodies is a gap for each */
+	num_cands=num_gaps;
+	for(g=0;g<num_cands;g++) {
+		i=e->gaps[g].body;
+		near[0]=i+w;
+		near[1]=i-1;
+		near[2]=i+1;
+		m=0;
+		for(k=0;k<3;k++) {
+			if(bodies[near[k]]!=DRY) {
+				unsigned body=find_body(bodies,near[k]);
+
+				if(!m) {
+					e->gaps[g].body=body;
+					m++;
+				} else if(body!=e->gaps[g].body&&(m==1||body!=e->gaps[num_gaps-1].body)) {
+					add_level(&e->gaps,&num_gaps,&e->max_gaps,body,e->gaps[g].rank,e->gaps[g].what);
+					m++;
+				}
+			}
+		}
+	}
+	for(i=0,p=e->drops;i<e->num_drops;i++,p+=2) {
+		cell_xy(e->stride,e->layout,p[0],&x,&y);
+		y-=bs;
+		/* Not the top row, whose above is the bucket */
+		if(y>0&&y+1<ht&&!grid[cell_at(e->stride,e->layout,x,bs+y-1)]&&
+			grid[cell_at(e->stride,e->layout,x,bs+y+1)]&&
+			grid[cell_at(e->stride,e->layout,x-1,bs+y)]&&
+			grid[cell_at(e->stride,e->layout,x+1,bs+y)])
+		{
+			add_level(&e->tops,&num_tops,&e->max_tops,find_body(bodies,y*w+x),y,i);
+		}
+	}
+	qsort(e->tops,num_tops,sizeof(level_t),compare_levels);
+	qsort(e->gaps,num_gaps,sizeof(level_t),compare_levels);
+	for(t=g=0;t<num_tops&&g<num_gaps;) {
+		level_t *top=&e->tops[t],*gap=&e->gaps[g];
+
+		if(top->body!=gap->body) {
+			if(top->body<gap->body) {
+				t++;
+			} else {
+				g++;
+			}
+		} else if((unsigned)ht-1-gap->rank<=top->rank) {
+			/* Nowhere lower for the rest of this body */
+			for(;t<num_tops&&e->tops[t].body==top->body;t++) {
+			}
+		} else if(grid[gap->what]) {
+			/* Filled from a body on the other side */
+			g++;
+		} else {
+			p=&e->drops[top->what*2];
+			grid[p[0]]=CELL_EMPTY;
+			if(e->pools) {
+				wake_pools(e,p[0]);
+			}
+			if(gates&&gates[gap->what]!=DROP_GATE(p)) {
+				DROP_GATE(p)=gates[gap->what];
+				e->gate_counts[gates[gap->what]][DROP_TYPE(p)]++;
+			}
+			grid[gap->what]=droplet_cells[DROP_TYPE(p)];
+			e->hash^=drop_key(p[0],DROP_TYPE(p))^drop_key(gap->what,DROP_TYPE(p));
+			p[0]=gap->what;
+			e->pressure_moves++;
+			e->moved++;
+			t++;
+			g++;
+		}
+	}
+}
+
+/* Turns pressure on or off. Off, the memory it uses goes. */
+static void set_pressure(engine_t *e,int pressure) {
+	e->pressure=pressure;
+	if(!pressure) {
+		free(e->bodies);
+		free(e->tops);
+		free(e->gaps);
+		e->bodies=0;
+		e->tops=e->gaps=0;
+		e->max_bodies=0;
+		e->max_tops=e->max_gaps=0;
+	}
+}
+
+/*
+engine_hash
+
+  Works out the hash of the water from scratch, as e->hash should be: the droplets, and
+  what's pooled in the grid. For checking the one the ticks keep up to date; it has to
+  look at every cell.
+*/
+ULONGLONG engine_hash(engine_t *e) {
+	const DDSURFACEDESC *grid=grid_of(e);
+	const BYTE *g=grid->lpSurface;
+	size_t cell,cells=(size_t)grid->lPitch*grid->dwHeight;
+	ULONGLONG hash;
+
+	if(!e->valid) {
+		return 0;
+	}
+	hash=hash_drops(e);
+	for(cell=0;cell<cells;cell++) {
+		if(IS_POOLED(g[cell])) {
+			hash^=drop_key((unsigned)cell,g[cell]==CELL_POOL_BLUE);
+		}
+	}
+	return hash;
+}
+
+/*
+engine_settled
+
+  Says whether the water's stopped: nothing's moved for IDLE_TICKS ticks, so the engine
+  won't tick again until a command changes something.
+
+  Return: the first tick nothing moved in, or 0 if it's still going.
+*/
+unsigned engine_settled(const engine_t *e) {
+	return e->still_ticks>=IDLE_TICKS?e->ticks-e->still_ticks+1:0;
+}
+
+/*
+alloc_cells
+
+  Allocates a surface of cells (see land_alloc_cells), in a file if the world's mapped.
+*/
+static int alloc_cells(const engine_t *e,DDSURFACEDESC *ds,int w,int h) {
+	if(e->map_dir) {
+		return land_alloc_mapped(ds,w,h,e->map_dir);
+	}
+	return land_alloc_cells(ds,w,h);
+}
+
+/*
+set_bands
+
+  Divides freshly allocated buffers into bands, for mapped storage, all of them in RAM to
+  start with, as they've just been written. Without mapped storage, or the memory to keep
+  track, there are none.
+*/
+static void set_bands(engine_t *e) {
+	unsigned rows=e->area_height+e->bucket_size;
+
+	free(e->band_quiet);
+	e->band_quiet=0;
+	e->num_bands=0;
+	if(!e->map_dir) {
+		return;
+	}
+	/* Whole tiles, so a band is the same cells in any layout */
+	e->band_rows=max(BAND_BYTES/e->stride&~(TILE_H-1),TILE_H);
+	e->band_quiet=calloc((rows+e->band_rows-1)/e->band_rows,2);
+	if(e->band_quiet) {
+		e->num_bands=(rows+e->band_rows-1)/e->band_rows;
+	}
+}
+
+/*
+add_range
+
+  Adds size bytes of a surface, from offset, to a list of ranges, as far as the surface
+  goes.
+
+  Return: number of ranges added, 0 or 1.
+*/
+static int add_range(map_range_t *r,const DDSURFACEDESC *ds,size_t offset,size_t size) {
+	size_t all=(size_t)ds->lPitch*ds->dwHeight;
+
+	if(!ds->lpSurface||offset>=all) {
+		return 0;
+	}
+	r->addr=(BYTE *)ds->lpSurface+offset;
+	r->size=min(size,all-offset);
+	return 1;
+}
+
+/*
+band_ranges
+
+  Gets the memory a band covers. Cell indices go down the world a band at a time in any
+  layout, and the gate map is the grid's shape, so that's the same cells of each. Then
+  there's the back buffer, if the droplets are in the tiles, and the landscape the band
+  goes over.
+
+  r -> BAND_RANGES ranges to fill in
+
+  Return: number of ranges filled in.
+*/
+static int band_ranges(engine_t *e,unsigned b,map_range_t *r) {
+	size_t cells=(size_t)e->stride*e->band_rows;
+	int n=0,y1=(int)((b+1)*e->band_rows)-e->bucket_size,y0=max(y1-(int)e->band_rows,0);
+
+	n+=add_range(r+n,grid_of(e),b*cells,cells);
+	n+=add_range(r+n,e->layout==LAYOUT_TILES?&e->gate_tiles:&e->gate_map,b*cells,cells);
+	if(e->layout==LAYOUT_TILES) {
+		n+=add_range(r+n,&e->back,(size_t)b*e->band_rows*e->back.lPitch,(size_t)e->band_rows*e->back.lPitch);
+	}
+	if(y1>0) {
+		n+=add_range(r+n,&e->land,(size_t)y0*e->land.lPitch,(size_t)(y1-y0)*e->land.lPitch);
+	}
+	return n;
+}
+
+/*
+update_bands
+
+  Looks at where the droplets are, for mapped storage. A band that was let go and now has
+  droplets in or next to it is asked for all at once, rather than a page fault at a time
+  as they get to it. One that's had none for BAND_QUIET looks is let go: VirtualUnlock on
+  memory that isn't locked takes it out of the working set, so Windows can write it back
+  to the file and use the RAM for something else, and it comes back if anything touches
+  it. Pooled droplets don't touch anything until they're woken, so a band of them counts
+  as quiet. Without PrefetchVirtualMemory (before Windows 8), bands come back a fault at
+  a time.
+*/
+static void update_bands(engine_t *e) {
+	unsigned b,i,n=e->num_bands,cells=e->stride*e->band_rows;
+	BYTE *quiet=e->band_quiet,*full=e->band_quiet+n;
+	map_range_t r[BAND_RANGES];
+	prefetch_fn_t prefetch=0;
+	int k,m,looked=0;
+
+	memset(full,0,n);
+	for(i=0;i<e->num_drops;i++) {
+		full[e->drops[i*2]/cells]=1;
+	}
+	for(b=0;b<n;b++) {
+		if(full[b]||(b>0&&full[b-1])||(b+1<n&&full[b+1])) {
+			if(quiet[b]>=BAND_QUIET) {
+				if(!looked) {
+					prefetch=(prefetch_fn_t)GetProcAddress(GetModuleHandle("kernel32.dll"),"PrefetchVirtualMemory");
+					looked=1;
+				}
+				if(prefetch) {
+					m=band_ranges(e,b,r);
+					(*prefetch)(GetCurrentProcess(),m,r,0);
+					e->prefetches++;
+				}
+			}
+			quiet[b]=0;
+		} else if(quiet[b]<BAND_QUIET&&++quiet[b]==BAND_QUIET) {
+			m=band_ranges(e,b,r);
+			for(k=0;k<m;k++) {
+				VirtualUnlock(r[k].addr,r[k].size);
+			}
+			e->evictions++;
+		}
+	}
+}
+
+/*
+engine_map_stats
+
+  Gets how mapped storage is getting on. Sim thread only, or before it's started.
+*/
+void engine_map_stats(const engine_t *e,map_stats_t *s) {
+	PROCESS_MEMORY_COUNTERS pmc;
+	IO_COUNTERS io;
+	unsigned b;
+
+	memset(s,0,sizeof(*s));
+	if(!e->map_dir) {
+		return;
+	}
+	s->mapped=1;
+	s->num_bands=e->num_bands;
+	for(b=0;b<e->num_bands;b++) {
+		s->quiet_bands+=e->band_quiet[b]>=BAND_QUIET;
+	}
+	s->prefetches=e->prefetches;
+	s->evictions=e->evictions;
+	pmc.cb=sizeof(pmc);
+	if(GetProcessMemoryInfo(GetCurrentProcess(),&pmc,sizeof(pmc))) {
+		s->page_faults=pmc.PageFaultCount;
+	}
+	if(GetProcessIoCounters(GetCurrentProcess(),&io)) {
+		s->read_bytes=io.ReadTransferCount;
+		s->write_bytes=io.WriteTransferCount;
+	}
+}
+
+/* Frees a back buffer allocated by alloc_back. */
+static void free_back(DDSURFACEDESC *back) {
+	if(back->lpSurface) {
+		back->lpSurface=(BYTE *)back->lpSurface-back->lPitch*GUARD_ROWS;
+	}
+	land_free(back);
+}
+
+/*
+alloc_back
+
+  (Re)allocates the back buffer, and draws the bucket on it. The droplets aren't on it,
+  so it'll need the landscape copying and the droplets drawing. Above the top row are
+  GUARD_ROWS rows of wall, outside the surface proper. For LAYOUT_TILES, the tiles are
+  allocated too; then the back buffer is just landscape and bucket, and the droplets are
+  only in the tiles. The gate and heat maps go with it, so any gates are removed, and the
+  heat map starts again. With mapped storage, all but the heat map are files, and the
+  bands start again too.
+
+  Return: non-0 if OK.
+*/
+static int alloc_back(engine_t *e) {
+	int rows=e->area_height+e->bucket_size;
+
+	free_back(&e->back);
+	land_free(&e->gate_map);
+	land_free(&e->tiles);
+	land_free(&e->gate_tiles);
+	/* Rows are exactly stride cells, so a droplet's cell index is its offset. */
+	e->stride=grid_stride(e->area_width,e->layout);
+	if(!alloc_cells(e,&e->back,e->stride,rows+GUARD_ROWS)||!alloc_cells(e,&e->gate_map,e->stride,rows)||
+		(e->layout==LAYOUT_TILES&&
+		(!alloc_cells(e,&e->tiles,e->stride*TILE_H,(rows+TILE_H-1)/TILE_H)||
+		!alloc_cells(e,&e->gate_tiles,e->stride*TILE_H,(rows+TILE_H-1)/TILE_H))))
+	{
+		/* Not moved past the guard rows yet */
+		land_free(&e->back);
+		return 0;
+	}
+	if(e->tiles.lpSurface) {
+		/* Whatever's in the spare rows at the bottom, droplets can't get to */
+		memset(e->tiles.lpSurface,0,(size_t)e->tiles.lPitch*e->tiles.dwHeight);
+	}
+	memset(e->back.lpSurface,CELL_WALL,(size_t)e->back.lPitch*GUARD_ROWS);
+	e->back.lpSurface=(BYTE *)e->back.lpSurface+e->back.lPitch*GUARD_ROWS;
+	e->back.dwHeight-=GUARD_ROWS;
+	e->back.dwWidth=e->gate_map.dwWidth=e->area_width;
+	memset(e->back.lpSurface,0,(size_t)e->back.lPitch*e->back.dwHeight);
+	clear_gates(e);
+	if(e->heat) {
+		set_heat(e,e->heat_ticks,e->heat_drops);
+	}
+	do_bucket(e);
+	if(e->tiles.lpSurface) {
+		RECT r;
+
+		SetRect(&r,0,0,e->area_width,e->bucket_size);
+		tile_rect(e,&e->tiles,&e->back,&r);
+	}
+	set_bands(e);
+	e->land_changed=1;
+	return 1;
+}
+
+/*
+reset_buffers
+
+  (Re)allocates landscape and back buffer for the current size, with an empty landscape
+  and a fresh set of droplets.
+*/
+static void reset_buffers(engine_t *e) {
+	land_free(&e->land);
+	e->valid=alloc_cells(e,&e->land,e->area_width,e->area_height)&&alloc_back(e);
+	if(!e->valid) {
+		dprintf("engine: out of memory for %d x %d area\n",e->area_width,e->area_height);
+		return;
+	}
+	land_reset(&e->land,CELL_EMPTY,CELL_WALL,e->bucket_neck_size);
+	e->reset_drops=1;
+}
+
+/*
+move_drops
+
+  Moves the droplets to match a resized landscape, in one pass, and draws them on the new
+  back buffer. Droplets in the bucket, or the neck, keep their place relative to the middle,
+  as the bucket does; the rest go wherever their bit of landscape went. Any that end up
+  outside the area, or on top of anything, are removed.
+
+  old_w,old_h -> size of area before
+  old_stride,old_layout -> how the cells were laid out before
+  contents -> RESIZE_xxx
+*/
+static void move_drops(engine_t *e,int old_w,int old_h,unsigned old_stride,int old_layout,int contents) {
+	unsigned *src=e->drops,*dest=e->drops,i,n=0;
+	int bs=e->bucket_size;
+	int x,y,nx,ny,shift,ox=0,oy=0;
+	BYTE *grid=grid_of(e)->lpSurface,*p;
+
+	shift=e->area_width/2-old_w/2;
+	if(contents==RESIZE_CENTRE) {
+		ox=(e->area_width-old_w)/2;
+		oy=(e->area_height-old_h)/2;
+	}
+	for(i=0;i<e->num_drops;i++,src+=2) {
+		cell_xy(old_stride,old_layout,src[0],&x,&y);
+		if(y<=bs) {
+			/* Bucket, or top edge of landscape */
+			nx=x+shift;
+			ny=y;
+		} else if(contents==RESIZE_SCALE) {
+			nx=1+land_scale_coord(x-1,old_w-2,e->area_width-2);
+			ny=bs+1+land_scale_coord(y-bs-1,old_h-2,e->area_height-2);
+		} else {
+			nx=x+ox;
+			ny=y+oy;
+		}
+		/* Droplets are never on the bottom row; they go back to the top instead. */
+		if(nx<0||nx>=e->area_width||ny<0||ny>=e->area_height+bs-1) {
+			continue;
+		}
+		p=grid+engine_cell(e,nx,ny);
+		if(*p) {
+			continue;
+		}
+		*p=droplet_cells[DROP_TYPE(src)];
+		dest[0]=(unsigned)(p-grid);
+		dest[1]=src[1];
+		dest+=2;
+		n++;
+	}
+	dprintf("move_drops: %u of %u droplets kept\n",n,e->num_drops);
+	e->num_drops=n;
+	e->hash=hash_drops(e);
+}
+
+/*
+resize
+
+  Changes the size of the area. Unless the contents are being discarded, the landscape is
+  copied or resampled into the new area, and the droplets are moved to match. The new
+  buffers are allocated while the old ones are still there; if they can't be, the world
+  stays as it was, at the old size.
+
+  width,height -> new size
+  layout -> LAYOUT_xxx for the new buffers
+  contents -> RESIZE_xxx
+
+  Return: non-0 if OK.
+*/
+static int resize(engine_t *e,int width,int height,int layout,int contents) {
+	int old_w=e->area_width,old_h=e->area_height,old_layout=e->layout;
+	unsigned old_stride=e->stride;
+	DDSURFACEDESC old_land,old_back,old_gate_map,old_tiles,old_gate_tiles;
+	RECT inner,old_inner;
+
+	e->area_width=width;
+	e->area_height=height;
+	e->layout=layout;
+	if(!e->valid) {
+		/* Buffers get allocated at this size when there's storage for them */
+		return 0;
+	}
+	/* alloc_back would free these, so take them out of its way until the new ones are in */
+	old_land=e->land;
+	old_back=e->back;
+	old_gate_map=e->gate_map;
+	old_tiles=e->tiles;
+	old_gate_tiles=e->gate_tiles;
+	e->land.lpSurface=e->back.lpSurface=e->gate_map.lpSurface=0;
+	e->tiles.lpSurface=e->gate_tiles.lpSurface=0;
+	if(!alloc_cells(e,&e->land,width,height)||!alloc_back(e)) {
+		dprintf("engine: out of memory for %d x %d area\n",width,height);
+		land_free(&e->land);
+		land_free(&e->gate_map);
+		land_free(&e->tiles);
+		land_free(&e->gate_tiles);
+		e->area_width=old_w;
+		e->area_height=old_h;
+		e->layout=old_layout;
+		e->stride=old_stride;
+		e->land=old_land;
+		e->back=old_back;
+		e->gate_map=old_gate_map;
+		e->tiles=old_tiles;
+		e->gate_tiles=old_gate_tiles;
+		return 0;
+	}
+	land_reset(&e->land,CELL_EMPTY,CELL_WALL,e->bucket_neck_size);
+	if(contents==RESIZE_DISCARD) {
+		e->reset_drops=1;
+	} else {
+		/* Copy the inside only; the border is drawn afresh. */
+		SetRect(&inner,1,1,width-1,height-1);
+		SetRect(&old_inner,1,1,old_w-1,old_h-1);
+		switch(contents) {
+		case RESIZE_PRESERVE:
+			land_copy(&e->land,&inner,1,1,&old_land,&old_inner);
+			break;
+		case RESIZE_CENTRE:
+			land_copy(&e->land,&inner,1+(width-old_w)/2,1+(height-old_h)/2,&old_land,&old_inner);
+			break;
+		case RESIZE_SCALE:
+			land_scale(&e->land,&inner,&old_land,&old_inner);
+			break;
+		}
+		SetRectEmpty(&e->land_dirty);
+		if(!e->reset_drops) {
+			/* Back buffer has to be complete before droplets can be put on it. */
+			copy_land(e,0);
+			e->land_changed=0;
+			move_drops(e,old_w,old_h,old_stride,old_layout,contents);
+			e->back_changed=1;
+		}
+	}
+	land_free(&old_land);
+	free_back(&old_back);
+	land_free(&old_gate_map);
+	land_free(&old_tiles);
+	land_free(&old_gate_tiles);
+	return 1;
+}
+
+/*
+do_command
+
+  Carries out a command from the UI.
+*/
+static void do_command(engine_t *e,const cmd_t *c) {
+	/* Anything that changes the world might set water moving, so ticks start again.
+	   Looking at it another way doesn't. */
+	if(c->type!=CMD_VIEW&&c->type!=CMD_RATE&&c->type!=CMD_HEAT&&c->type!=CMD_LOG_DROPLETS) {
+		e->still_ticks=0;
+	}
+	switch(c->type) {
+	case CMD_STROKE:
+		if(e->valid) {
+			const stroke_t *s=&c->u.stroke;
+			RECT clip;
+
+			/* Leave the border alone. */
+			SetRect(&clip,1,1,e->area_width-1,e->area_height-1);
+			if(s->flood) {
+				land_flood(&e->land,&clip,s->cell,s->x1,s->y1,&e->land_dirty);
+			} else {
+				land_stroke(&e->land,&clip,s->cell,s->x1,s->y1,s->x2,s->y2,s->size,&e->land_dirty);
+			}
+		}
+		break;
+	case CMD_FILL:
+		if(e->valid) {
+			land_reset(&e->land,c->u.fill,CELL_WALL,e->bucket_neck_size);
+			e->land_changed=1;
+		}
+		break;
+	case CMD_RESET:
+		e->reset_drops=1;
+		break;
+	case CMD_PAUSE:
+		e->paused=c->u.paused;
+		break;
+	case CMD_RATE:
+		e->tick_hz=c->u.hz;
+		pace_set_rate(&e->pace,e->tick_hz);
+		pace_restart(&e->pace);
+		break;
+	case CMD_RESIZE:
+		expand_pools(e,0);
+		resize(e,c->u.size.width,c->u.size.height,e->layout,c->u.size.contents);
+		break;
+	case CMD_LAYOUT:
+		if(c->u.layout!=e->layout) {
+			expand_pools(e,0);
+			/* Same size, new layout */
+			resize(e,e->area_width,e->area_height,c->u.layout,RESIZE_PRESERVE);
+		}
+		break;
+	case CMD_GATE:
+		if(e->valid) {
+			/* Droplets that find themselves on it count once, as they would if they'd
+			   stepped onto it */
+			expand_pools(e,0);
+			add_gate(e,&c->u.stroke);
+		}
+		break;
+	case CMD_CLEAR_GATES:
+		clear_gates(e);
+		break;
+	case CMD_HEAT:
+		set_heat(e,c->u.heat.ticks,c->u.heat.drops);
+		break;
+	case CMD_POOLS:
+		e->pools=c->u.pools;
+		if(!e->pools) {
+			expand_pools(e,0);
+		}
+		break;
+	case CMD_PRESSURE:
+		set_pressure(e,c->u.pressure);
+		break;
+	case CMD_ROW_ORDER:
+		e->row_order=c->u.row_order;
+		break;
+	case CMD_VIEW:
+		e->view=c->u.view;
+		/* Whatever's there now will do, even if it's paused */
+		e->back_changed=1;
+		break;
+	case CMD_LOG_DROPLETS:
+#ifdef _DEBUG
+		log_droplets(e,get_string(IDS_DROPLETDATAFILE),"wt");
+#endif
+		break;
+	case CMD_QUIT:
+		e->quit=1;
+		break;
+	}
+}
+
+static pace_time_t qpc_now(void *ctx) {
+	LARGE_INTEGER t;
+
+	(void)ctx;
+	QueryPerformanceCounter(&t);
+	return t.QuadPart;
+}
+
+/*
+qpc_sleep_until
+
+  The sim thread's pace_clock_t sleep. Waits on the wake event, so a command cuts it
+  short. WaitForSingleObject only goes to the millisecond (and only that with
+  timeBeginPeriod(1)), so it waits until the deadline is less than a couple of
+  milliseconds off, then polls for the rest.
+*/
+static int qpc_sleep_until(void *ve,pace_time_t when) {
+	engine_t *e=ve;
+	pace_time_t left;
+	DWORD ms;
+
+	for(;;) {
+		left=when-qpc_now(0);
+		if(left<=0) {
+			return 0;
+		}
+		ms=(DWORD)(left*1000/e->pace.clock.freq);
+		if(WaitForSingleObject(e->wake,ms>1?ms-1:0)==WAIT_OBJECT_0) {
+			return 1;
+		}
+		if(ms<=1) {
+			SwitchToThread();
+		}
+	}
+}
+
+/*
+engine_create
+
+  Creates an engine, with an empty landscape. The engine doesn't care what the display's
+  pixel format is; frames are cells (CELL_xxx), and the UI renders them.
+
+  width -> width of area
+  height -> height of area
+  num_drops -> number of droplets. This is fixed, as the bucket size depends on it.
+  seed -> starting point for the engine's random numbers, which decide droplet types
+  and which way droplets go
+
+  Return: the engine, or NULL if there wasn't enough memory.
+*/
+engine_t *engine_create(int width,int height,unsigned num_drops,unsigned seed) {
+	engine_t *e=calloc(1,sizeof(engine_t));
+
+	if(!e) {
+		return 0;
+	}
+	e->area_width=width;
+	e->area_height=height;
+	e->bucket_size=engine_bucket_size(num_drops);
+	e->bucket_neck_size=5;
+	e->rand_state=seed;
+	e->paused=1;
+	e->tick_hz=100;
+	{
+		pace_clock_t clock;
+		LARGE_INTEGER freq;
+
+		QueryPerformanceFrequency(&freq);
+		clock.now=qpc_now;
+		clock.sleep_until=qpc_sleep_until;
+		clock.freq=freq.QuadPart;
+		clock.ctx=e;
+		pace_init(&e->pace,&clock,e->tick_hz);
+	}
+	SetRectEmpty(&e->land_dirty);
+	SetRectEmpty(&e->view);
+	InitializeCriticalSection(&e->lock);
+	e->wake=CreateEvent(0,FALSE,FALSE,0);
+	e->frame_event=CreateEvent(0,FALSE,FALSE,0);
+	e->write_frame=0;
+	e->ready_frame=1;
+	e->read_frame=2;
+	e->stride=grid_stride(width,e->layout);
+	init_dir_tbl(e);
+	e->total_drops=num_drops;
+	set_drops(e,num_drops);
+	reset_buffers(e);
+	if(!e->valid) {
+		engine_destroy(e);
+		return 0;
+	}
+	return e;
+}
+
+/*
+engine_destroy
+
+  Stops the sim thread, if it's running, and frees everything.
+*/
+void engine_destroy(engine_t *e) {
+	int i;
+
+	if(!e) {
+		return;
+	}
+	engine_stop(e);
+	set_drops(e,0);
+	land_free(&e->land);
+	free_back(&e->back);
+	land_free(&e->gate_map);
+	land_free(&e->tiles);
+	land_free(&e->gate_tiles);
+	free(e->heat);
+	free(e->woken);
+	free(e->band_quiet);
+	free(e->map_dir);
+	set_pressure(e,0);
+	for(i=0;i<3;i++) {
+		_aligned_free(e->frames[i].bits);
+	}
+	free(e->queue.cmds);
+	free(e->run.cmds);
+	CloseHandle(e->wake);
+	CloseHandle(e->frame_event);
+	DeleteCriticalSection(&e->lock);
+	free(e);
+}
+
+/*
+engine_map
+
+  Keeps the world in files, or in ordinary memory; the contents stay as they are. Not
+  while the sim thread's running.
+
+  dir -> folder for the files; 0 or "" for ordinary memory
+
+  Return: non-0 if that's done, and the world is valid afterwards.
+*/
+int engine_map(engine_t *e,const char *dir) {
+	char *copy=0,*old=e->map_dir;
+
+	if(dir&&!dir[0]) {
+		dir=0;
+	}
+	if(dir?e->map_dir&&strcmp(dir,e->map_dir)==0:!e->map_dir) {
+		return e->valid;
+	}
+	if(dir&&!(copy=_strdup(dir))) {
+		return 0;
+	}
+	e->map_dir=copy;
+	if(e->valid) {
+		expand_pools(e,0);
+		/* Same size, new storage; or, if there's no room for it, the old storage */
+		if(!resize(e,e->area_width,e->area_height,e->layout,RESIZE_PRESERVE)) {
+			e->map_dir=old;
+			free(copy);
+			return 0;
+		}
+	} else {
+		/* What didn't fit in memory might in files */
+		reset_buffers(e);
+	}
+	free(old);
+	return e->valid;
+}
+
+/*
+engine_post
+
+  Queues a command for the engine. Commands are carried out in order, between ticks.
+  May be called from any thread.
+*/
+void engine_post(engine_t *e,const cmd_t *cmd) {
+	EnterCriticalSection(&e->lock);
+	if(e->queue.num==e->queue.max) {
+		int n=e->queue.max?e->queue.max*2:256;
+		cmd_t *p=realloc(e->queue.cmds,n*sizeof(cmd_t));
+
+		if(p) {
+			e->queue.cmds=p;
+			e->queue.max=n;
+		}
+	}
+	if(e->queue.num<e->queue.max) {
+		e->queue.cmds[e->queue.num++]=*cmd;
+	}
+	LeaveCriticalSection(&e->lock);
+	SetEvent(e->wake);
+}
+
+/*
+engine_update
+
+  Carries out any queued commands, brings the back buffer up to date, and (optionally)
+  moves the droplets on one tick. This is what the sim thread calls in a loop; without a
+  sim thread, it can be called directly, as the headless driver does.
+
+  tick -> non-0 to do a tick; ignored if paused
+
+  Return: non-0 if the back buffer changed.
+*/
+int engine_update(engine_t *e,int tick) {
+	cmd_queue_t q;
+	int i,no_era=0,changed;
+
+	/* Commands since last time, all in one batch */
+	EnterCriticalSection(&e->lock);
+	q=e->queue;
+	e->queue=e->run;
+	e->queue.num=0;
+	LeaveCriticalSection(&e->lock);
+	for(i=0;i<q.num;i++) {
+		do_command(e,&q.cmds[i]);
+	}
+	e->run=q;
+	if(!e->valid) {
+		return 0;
+	}
+	changed=e->back_changed;
+	e->back_changed=0;
+	/* Pooled droplets in the way of what's about to change go back to being droplets
+	   first, while the grid still says where they are. */
+	if(e->land_changed||e->reset_drops) {
+		expand_pools(e,0);
+	} else if(!IsRectEmpty(&e->land_dirty)) {
+		RECT r=e->land_dirty;
+
+		/* And the ones round the edge, which might be able to move now */
+		OffsetRect(&r,0,e->bucket_size);
+		InflateRect(&r,1,1);
+		expand_pools(e,&r);
+	}
+	if(e->land_changed) {
+		copy_land(e,0);
+		e->land_changed=0;
+		SetRectEmpty(&e->land_dirty);
+		no_era=1;
+	} else if(!IsRectEmpty(&e->land_dirty)) {
+		/* Only copy the bit that was drawn on */
+		copy_land(e,&e->land_dirty);
+		SetRectEmpty(&e->land_dirty);
+		no_era=1;
+	}
+	if(e->reset_drops) {
+		/* Don't erase if no_era! */
+		if(!no_era) {
+			draw_all_droplets(0,e,grid_of(e));
+		}
+		set_drops(e,e->total_drops);
+		e->reset_drops=0;
+		no_era=1;
+	}
+	if(e->paused||!tick||engine_settled(e)) {
+		/* If no_era is true, the droplets have been erased already and must
+		   be redrawn. */
+		if(no_era) {
+			draw_all_droplets(-1,e,grid_of(e));
+		}
+		return no_era||changed;
+	}
+	update_all_droplets(no_era,e,grid_of(e));
+	e->ticks++;
+	if(e->pressure&&e->ticks%PRESSURE_TICKS==0) {
+		apply_pressure(e);
+	}
+	if(e->pools) {
+		update_pools(e);
+	}
+	if(e->row_order&&e->ticks%SORT_TICKS==0) {
+		sort_drops(e);
+	}
+	if(e->num_bands&&e->ticks%MAP_TICKS==0) {
+		update_bands(e);
+	}
+	e->still_ticks=e->moved?0:e->still_ticks+1;
+	if(e->gate_stats.num_gates&&e->ticks-e->gate_sample_tick>=GATE_SAMPLE_TICKS) {
+		sample_gates(e);
+	}
+	if(e->heat&&e->ticks%e->heat_ticks==0) {
+		sample_heat(e);
+	}
+	return 1;
+}
+
+/*
+engine_publish
+
+  Copies the part of the back buffer in view into the next frame of the triple buffer,
+  and makes that the latest frame. With LAYOUT_TILES, it's the tiles that have the
+  droplets, so that part of them is put back into rows instead. The frame the UI is
+  showing is never touched, and the UI never waits. Only the view is copied, so a big
+  world seen through a small window costs no more than a small one.
+*/
+void engine_publish(engine_t *e) {
+	frame_t *f=&e->frames[e->write_frame];
+	RECT all,v;
+	size_t size;
+	int y,pitch;
+
+	if(!e->valid) {
+		return;
+	}
+	SetRect(&all,0,0,e->back.dwWidth,e->back.dwHeight);
+	if(IsRectEmpty(&e->view)||!IntersectRect(&v,&e->view,&all)) {
+		v=all;
+	}
+	pitch=(v.right-v.left+15)&~15;
+	size=(size_t)pitch*(v.bottom-v.top);
+	if(f->size<size) {
+		_aligned_free(f->bits);
+		f->bits=_aligned_malloc(size,16);
+		f->size=f->bits?size:0;
+		if(!f->bits) {
+			return;
+		}
+	}
+	f->width=e->back.dwWidth;
+	f->height=e->back.dwHeight;
+	f->view=v;
+	f->pitch=pitch;
+	f->tick=e->ticks;
+	pace_get_stats(&e->pace,&f->stats);
+	f->num_drops=e->num_drops;
+	f->gates=e->gate_stats;
+	f->settled=engine_settled(e);
+	f->hash=e->hash;
+	engine_map_stats(e,&f->map);
+	if(e->layout==LAYOUT_TILES) {
+		detile_rect(e,f->bits-v.top*pitch-v.left,pitch,&v);
+	} else {
+		for(y=v.top;y<v.bottom;y++) {
+			memcpy(f->bits+(y-v.top)*pitch,(BYTE *)e->back.lpSurface+y*e->back.lPitch+v.left,v.right-v.left);
+		}
+	}
+	e->write_frame=InterlockedExchange(&e->ready_frame,e->write_frame|FRAME_FRESH)&FRAME_INDEX;
+	SetEvent(e->frame_event);
+}
+
+/*
+engine_frame
+
+  Gets the latest frame, for the UI thread. The frame stays valid until the next call.
+
+  Return: the frame, or NULL if there's been no new one since last time.
+*/
+const frame_t *engine_frame(engine_t *e) {
+	if(!(e->ready_frame&FRAME_FRESH)) {
+		return 0;
+	}
+	e->read_frame=InterlockedExchange(&e->ready_frame,e->read_frame)&FRAME_INDEX;
+	return &e->frames[e->read_frame];
+}
+
+static unsigned __stdcall sim_thread(void *ve) {
+	engine_t *e=ve;
+	int running,was_running=0,unshown=0;
+	pace_time_t now,show_period=e->pace.clock.freq/DISPLAY_HZ,next_show=0;
+
+	/* Millisecond waits, for qpc_sleep_until */
+	timeBeginPeriod(1);
+	for(;;) {
+		int due=!e->paused&&e->valid&&!engine_settled(e)&&pace_due(&e->pace);
+
+		if(engine_update(e,due)) {
+			unshown=1;
+		}
+		if(e->quit) {
+			break;
+		}
+		running=!e->paused&&e->valid&&!engine_settled(e);
+		/* While it's running, there'll be another tick along shortly, so a frame can wait
+		   until it's time to show one. Otherwise, show it now, so drawing appears. */
+		if(unshown) {
+			now=qpc_now(0);
+			if(!running||now>=next_show) {
+				engine_publish(e);
+				unshown=0;
+				next_show+=show_period;
+				if(next_show<=now) {
+					next_show=now+show_period;
+				}
+			}
+		}
+		if(running&&!was_running) {
+			/* Time spent paused isn't lateness */
+			pace_restart(&e->pace);
+		}
+		was_running=running;
+		if(running) {
+			pace_wait(&e->pace);
+		} else {
+			WaitForSingleObject(e->wake,INFINITE);
+		}
+	}
+	timeEndPeriod(1);
+	return 0;
+}
+
+/*
+engine_start
+
+  Starts the sim thread.
+
+  Return: non-0 if OK.
+*/
+int engine_start(engine_t *e) {
+	e->quit=0;
+	e->thread=(HANDLE)_beginthreadex(0,0,sim_thread,e,0,0);
+	return e->thread!=0;
+}
+
+/*
+engine_stop
+
+  Stops the sim thread, and waits for it to finish. Any queued commands are carried out
+  first.
+*/
+void engine_stop(engine_t *e) {
+	cmd_t c;
+
+	if(!e->thread) {
+		return;
+	}
+	c.type=CMD_QUIT;
+	engine_post(e,&c);
+	WaitForSingleObject(e->thread,INFINITE);
+	CloseHandle(e->thread);
+	e->thread=0;
+}
+
+/* Same signature as a dx_with_lock callback function. */
+static void draw_all_droplets(int mask,void *ve,DDSURFACEDESC *ds) {
+	engine_t *e=ve;
+	unsigned *p,j;
+	BYTE *grid;
+
+	grid=ds->lpSurface;
+	p=e->drops;
+	for(j=0;j<e->num_drops;j++,p+=2) {
+		grid[*p]=(BYTE)(droplet_cells[DROP_TYPE(p)]&((unsigned)mask));
+	}
+}
+
+/* One arm of the choice of which way a droplet goes when it's resting on something and
+   could go either way. There's one for each cell in CELLS, but the condition is constant
+   false for SLIDE_RANDOM cells, so only the others make any code. */
+#define RESTING_ON(NAME,CLASSIC,NIGHT,SLIDE,RED,BLUE)\
+	else if((SLIDE)!=SLIDE_RANDOM&&below==CELL_##NAME) {\
+		if((SLIDE)==SLIDE_BIAS) {\
+			t_p+=type?(BLUE):(RED);\
+		}\
+	}
+
+/*
+move_droplets
+
+  Moves each droplet one step. Plain C whatever the CPU: each droplet sees where the
+  ones before it went, so there's no doing several side by side without changing where
+  the water goes.
+
+  It's inlined into update_all_droplets once with the stride as a variable, and once for
+  each power of two with it as a constant, so above and below are fixed offsets and
+  there's one register more to go round.
+
+  grid -> back buffer
+  stride -> cells per row
+  guarded -> non-0 to rely on the guard row above the top (see alloc_back) rather than
+  checking, and to only look for droplets falling into the hole when they move down
+*/
+static __forceinline void move_droplets(engine_t *e,BYTE *grid,unsigned stride,int guarded) {
+	BYTE lval,rval;
+	unsigned max,t_p,info,type,*p,j,n,r_idx,moved=0;
+	ULONGLONG hash=0;
+	const unsigned *dir_tbl;
+	BYTE *tptr,*gates;
+	int pools=e->pools;
+	/* Counted here rather than in e, so storing a count can't be taken to change e */
+	unsigned counts[MAX_GATES+1][2];
+
+	n=e->num_drops;
+	/* Locals, so writing to the grid can't be taken to change them */
+	dir_tbl=e->dir_tbl;
+	r_idx=e->dir_idx;
+	/* Gate map, only if there are gates; it's one more byte per droplet to look at. */
+	gates=e->gate_stats.num_gates?e->gate_map.lpSurface:0;
+	memset(counts,0,sizeof counts);
+	/* -1 -- droplets go back to top upon falling into the hole rather than falling
+	   below it. */
+	max=(e->area_height+e->bucket_size-1)*stride;
+	p=e->drops;
+	for(j=0;j<n;j++,p+=2) {
+		BYTE below;
+
+		t_p=*p;
+		/* Both bytes at once: little endian, so DROP_TYPE is the bottom byte and DROP_GATE
+		   the next, and the rest is 0. */
+		info=p[1];
+		type=info&0xFF;
+		tptr=grid+t_p;
+		*tptr=CELL_EMPTY;
+		/* where now */
+		below=tptr[stride];
+		if(below==CELL_EMPTY) {
+			t_p+=stride;
+			/* Only a droplet moving down can reach the hole. If there's one where it'd come
+			   out at the top, it waits. */
+			if(guarded&&t_p>=max) {
+				t_p-=max;
+				if(grid[t_p]) {
+					t_p=*p;
+				}
+			}
+		} else {
+			lval=tptr[-1];
+			rval=tptr[1];
+			if(!lval) {				/* can move left */
+				if(!rval) {			/* can move left or right */
+					__pragma(warning(push)) __pragma(warning(disable:4127))
+					if(0) {
+					}
+					CELLS(RESTING_ON)
+					else {
+						t_p+=dir_tbl[r_idx++];
+						r_idx&=RND_TBL_IDX_MASK;
+					}
+					__pragma(warning(pop))
+				} else {
+					t_p--;			/* can move left only */
+				}
+			} else {				/* cannot move left */
+				if(!rval) {			/* can move right only */
+					t_p++;
+				} else {			/* can move up only */
+					if((guarded||t_p>=stride)&&!tptr[-(int)stride]) {
+						t_p-=stride;
+					}
+				}
+			}
+		}
+		if(!guarded&&t_p>=max) {
+			t_p-=max;
+			if(grid[t_p]) {
+				t_p=*p;
+			}
+		}
+		/* Anything pooled next to where it was might be able to move now. There's always
+		   a row above, if only the guard row. */
+		if(pools&&t_p!=*p&&(IS_POOLED(tptr[-1])|IS_POOLED(tptr[1])|
+			IS_POOLED(tptr[-(int)stride])|IS_POOLED(tptr[stride])))
+		{
+			wake_pools(e,*p);
+		}
+		/* Count it on the way onto a gate. Moving along one doesn't count again; leaving
+		   counts against gate 0, which saves a test. */
+		if(gates&&gates[t_p]!=info>>8) {
+			DROP_GATE(p)=gates[t_p];
+			counts[gates[t_p]][type]++;
+		}
+		/* draw */
+		grid[t_p]=droplet_cells[type];
+		/* Only a droplet that's moved changes the hash. Most of a big world's droplets
+		   haven't, so skipping them makes the hash next to free. */
+		if(t_p!=*p) {
+			moved++;
+			hash^=drop_key(*p,type)^drop_key(t_p,type);
+		}
+		*p=t_p;
+	}
+	e->dir_idx=r_idx;
+	e->moved=moved;
+	e->hash^=hash;
+	if(gates) {
+		for(j=1;j<=MAX_GATES;j++) {
+			e->gate_counts[j][0]+=counts[j][0];
+			e->gate_counts[j][1]+=counts[j][1];
+		}
+	}
+}
+
+/* RESTING_ON for move_droplets_tiled, which can't just add to the cell index */
+#define RESTING_ON_TILED(NAME,CLASSIC,NIGHT,SLIDE,RED,BLUE)\
+	else if((SLIDE)!=SLIDE_RANDOM&&below==CELL_##NAME) {\
+		if((SLIDE)==SLIDE_BIAS) {\
+			dx=type?(BLUE):(RED);\
+		}\
+	}
+
+/*
+move_droplets_tiled
+
+  move_droplets for LAYOUT_TILES. Going by whole tiles, x and y are spread out over the
+  cell index, x in the bits of mx and y in the rest; adding 1 to one of them with the
+  other's bits set carries straight across, so each neighbour's still just a few
+  instructions. In return, the rows above and below are in the same cache line most of the
+  time, instead of a stride away.
+
+  grid -> tiles
+*/
+static void move_droplets_tiled(engine_t *e,BYTE *grid) {
+	BYTE lval,rval;
+	unsigned last,t_p,info,type,*p,j,n,r_idx,mx,my,l_p,r_p,moved=0;
+	ULONGLONG hash=0;
+	const unsigned *dir_tbl;
+	BYTE *gates;
+	unsigned counts[MAX_GATES+1][2];
+	int pools=e->pools;
+
+	n=e->num_drops;
+	dir_tbl=e->dir_tbl;
+	r_idx=e->dir_idx;
+	gates=e->gate_stats.num_gates?e->gate_tiles.lpSurface:0;
+	memset(counts,0,sizeof counts);
+	mx=((e->stride/TILE_W-1)<<(TILE_W_BITS+TILE_H_BITS))|(TILE_W-1);
+	my=~mx;
+	/* y bits of the bottom row, the hole's */
+	last=cell_at(e->stride,LAYOUT_TILES,0,e->area_height+e->bucket_size-1);
+	p=e->drops;
+	for(j=0;j<n;j++,p+=2) {
+		BYTE below;
+		unsigned d_p;
+
+		t_p=*p;
+		info=p[1];
+		type=info&0xFF;
+		grid[t_p]=CELL_EMPTY;
+		/* where now */
+		d_p=(((t_p|mx)+TILE_W)&my)|(t_p&mx);
+		below=grid[d_p];
+		if(below==CELL_EMPTY) {
+			t_p=d_p;
+			if((t_p&my)>=last) {
+				t_p&=mx;
+				if(grid[t_p]) {
+					t_p=*p;
+				}
+			}
+		} else {
+			l_p=(((t_p&mx)-1)&mx)|(t_p&my);
+			r_p=(((t_p|my)+1)&mx)|(t_p&my);
+			lval=grid[l_p];
+			rval=grid[r_p];
+			if(!lval) {				/* can move left */
+				if(!rval) {			/* can move left or right */
+					int dx=0;
+
+					__pragma(warning(push)) __pragma(warning(disable:4127))
+					if(0) {
+					}
+					CELLS(RESTING_ON_TILED)
+					else {
+						dx=(int)dir_tbl[r_idx++];
+						r_idx&=RND_TBL_IDX_MASK;
+					}
+					__pragma(warning(pop))
+					if(dx<0) {
+						t_p=l_p;
+					} else if(dx>0) {
+						t_p=r_p;
+					}
+				} else {
+					t_p=l_p;		/* can move left only */
+				}
+			} else {				/* cannot move left */
+				if(!rval) {			/* can move right only */
+					t_p=r_p;
+				} else if(t_p&my) {	/* can move up only, if not at the top */
+					unsigned u_p=(((t_p&my)-TILE_W)&my)|(t_p&mx);
+
+					if(!grid[u_p]) {
+						t_p=u_p;
+					}
+				}
+			}
+		}
+		if(pools&&t_p!=*p) {
+			unsigned o=*p;
+
+			if(IS_POOLED(grid[(((o&mx)-1)&mx)|(o&my)])|IS_POOLED(grid[(((o|my)+1)&mx)|(o&my)])|
+				IS_POOLED(grid[(((o|mx)+TILE_W)&my)|(o&mx)])|
+				((o&my)&&IS_POOLED(grid[(((o&my)-TILE_W)&my)|(o&mx)])))
+			{
+				wake_pools(e,o);
+			}
+		}
+		if(gates&&gates[t_p]!=info>>8) {
+			DROP_GATE(p)=gates[t_p];
+			counts[gates[t_p]][type]++;
+		}
+		/* draw */
+		grid[t_p]=droplet_cells[type];
+		/* Only a droplet that's moved changes the hash. Most of a big world's droplets
+		   haven't, so skipping them makes the hash next to free. */
+		if(t_p!=*p) {
+			moved++;
+			hash^=drop_key(*p,type)^drop_key(t_p,type);
+		}
+		*p=t_p;
+	}
+	e->dir_idx=r_idx;
+	e->moved=moved;
+	e->hash^=hash;
+	if(gates) {
+		for(j=1;j<=MAX_GATES;j++) {
+			e->gate_counts[j][0]+=counts[j][0];
+			e->gate_counts[j][1]+=counts[j][1];
+		}
+	}
+}
+
+/* One case of update_all_droplets' choice of kernel */
+#define POW2_KERNEL(BITS)\
+	case 1<<(BITS):\
+		move_droplets(e,grid,1<<(BITS),1);\
+		break;
+
+/* Same signature as a dx_with_lock callback function. */
+static void update_all_droplets(int no_era,void *ve,DDSURFACEDESC *ds) {
+	engine_t *e=ve;
+	unsigned *p,j;
+	BYTE *grid;
+
+	/* If the landscape was erased, the old droplets are no longer in place.
+	   This is unfortunate because they must be there. This redraws them. */
+	grid=ds->lpSurface;
+	if(no_era) {
+		p=e->drops;
+		for(j=0;j<e->num_drops;j++,p+=2) {
+			grid[*p]=droplet_cells[DROP_TYPE(p)];
+		}
+	}
+	if(e->layout==LAYOUT_TILES) {
+		move_droplets_tiled(e,grid);
+		return;
+	}
+	switch(e->layout==LAYOUT_POW2?e->stride:0) {
+	POW2_KERNEL(4) POW2_KERNEL(5) POW2_KERNEL(6) POW2_KERNEL(7) POW2_KERNEL(8)
+	POW2_KERNEL(9) POW2_KERNEL(10) POW2_KERNEL(11) POW2_KERNEL(12) POW2_KERNEL(13)
+	POW2_KERNEL(14)
+	default:
+		move_droplets(e,grid,e->stride,0);
+		break;
+	}
+}
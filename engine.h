@@ -0,0 +1,284 @@
+#ifndef TOM_ENGINE_H
+#define TOM_ENGINE_H
+
+#include <windows.h>
+#include <ddraw.h>
+#include "land.h"
+#include "pace.h"
+
+/* Command types. Commands are how the UI thread asks the engine to do things. */
+enum {
+	CMD_STROKE,							/* draw a brush stroke, or flood fill */
+	CMD_FILL,							/* fill inside the border with a cell; CELL_EMPTY erases */
+	CMD_RESET,							/* fresh set of droplets */
+	CMD_PAUSE,							/* pause or run */
+	CMD_RATE,							/* new tick rate; 0 for turbo, as fast as it'll go */
+	CMD_RESIZE,							/* new area size; what happens to the contents is up to RESIZE_xxx */
+	CMD_VIEW,							/* new part of the world for frames to show */
+	CMD_LAYOUT,							/* lay cells out another way (LAYOUT_xxx); as a resize */
+	CMD_GATE,							/* add a gate, to count droplets crossing a line */
+	CMD_CLEAR_GATES,					/* remove all gates */
+	CMD_HEAT,							/* start counting visits to each cell afresh, or stop */
+	CMD_POOLS,							/* turn pools on or off */
+	CMD_PRESSURE,						/* turn pressure on or off */
+	CMD_ROW_ORDER,						/* keep droplets in row order, or don't */
+	CMD_LOG_DROPLETS,					/* write droplet data to file (debug build only) */
+	CMD_QUIT,							/* sim thread should finish */
+};
+
+/* How the cells the droplets move in are laid out in memory. It makes no difference to
+   where the water goes. */
+enum {
+	LAYOUT_ROWS,						/* a row after another, as few cells apart as will do */
+	LAYOUT_POW2,						/* the same, a power of two cells apart; a kernel for each */
+	LAYOUT_TILES,						/* 8 x 8 tiles, so the rows above and below are close by */
+};
+
+/* What CMD_RESIZE does with the landscape and droplets. Droplets that end up outside the
+   area, or on top of something, are removed. */
+enum {
+	RESIZE_DISCARD,						/* empty landscape, fresh droplets */
+	RESIZE_PRESERVE,					/* keep it all where it is, from the top left */
+	RESIZE_CENTRE,						/* keep it all, centred in the new area */
+	RESIZE_SCALE,						/* stretch it all to fit the new area */
+};
+
+typedef struct cmd_t {
+	int type;							/* CMD_xxx */
+	union {
+		stroke_t stroke;				/* CMD_STROKE; CMD_GATE, ends of line only */
+		int fill;						/* CMD_FILL: CELL_xxx */
+		int paused;						/* CMD_PAUSE */
+		double hz;						/* CMD_RATE: ticks per second */
+		struct {
+			int width,height;
+			int contents;				/* RESIZE_xxx */
+		}size;							/* CMD_RESIZE */
+		RECT view;						/* CMD_VIEW: in cells, including bucket; empty for all of it */
+		int layout;						/* CMD_LAYOUT: LAYOUT_xxx */
+		struct {
+			int ticks;					/* count every this many ticks; 0 to stop */
+			int drops;					/* count every this many droplets each time */
+		}heat;							/* CMD_HEAT */
+		int pools;						/* CMD_POOLS */
+		int pressure;					/* CMD_PRESSURE */
+		int row_order;					/* CMD_ROW_ORDER */
+	}u;
+}cmd_t;
+
+/* Gates. A gate is a line; each time a droplet steps onto it, that counts as one crossing.
+   Gates are numbered from 1, in the order they're added. */
+#define MAX_GATES (8)
+/* Ticks per sample, for the time series */
+#define GATE_SAMPLE_TICKS (100)
+/* Number of samples kept */
+#define GATE_SAMPLES (64)
+
+typedef struct gate_stats_t {
+	int num_gates;
+	unsigned totals[MAX_GATES][2];					/* red, blue crossings since gate was added */
+	int num_samples;								/* samples filled in, up to GATE_SAMPLES */
+	unsigned samples[GATE_SAMPLES][MAX_GATES][2];	/* crossings per GATE_SAMPLE_TICKS, oldest first */
+}gate_stats_t;
+
+typedef struct cmd_queue_t {
+	cmd_t *cmds;
+	int num,max;
+}cmd_queue_t;
+
+/* How a world kept in files (see engine_map) is getting on. Page faults and I/O are the
+   whole process's, since it started, so they're for comparing one time with another. */
+typedef struct map_stats_t {
+	int mapped;							/* world is in files */
+	unsigned num_bands;					/* bands of rows it's looked at in */
+	unsigned quiet_bands;				/* bands let go, as of now */
+	unsigned prefetches;				/* bands asked for again, so far */
+	unsigned evictions;					/* bands let go, so far */
+	unsigned page_faults;				/* soft and hard */
+	ULONGLONG read_bytes,write_bytes;	/* file I/O */
+}map_stats_t;
+
+/* A finished frame: the part of the back buffer the UI is showing, as it was at the end
+   of a tick. One byte per cell (CELL_xxx); the UI turns that into colours. */
+typedef struct frame_t {
+	int width,height;					/* size of whole world in cells, including bucket */
+	RECT view;							/* part of the world that's in bits */
+	int pitch;
+	unsigned tick;						/* number of ticks done when frame was made */
+	pace_stats_t stats;					/* timing, as of when frame was made */
+	unsigned num_drops;					/* droplets moved each tick (pooled ones aren't), as of then */
+	gate_stats_t gates;					/* gate counts, as of when frame was made */
+	unsigned settled;					/* tick nothing's moved since, if it's stopped; see IDLE_TICKS */
+	map_stats_t map;					/* storage, if the world's in files */
+	ULONGLONG hash;						/* hash of the water when frame was made; see engine_t */
+	BYTE *bits;
+	size_t size;						/* bytes allocated at bits */
+}frame_t;
+
+/* Random table, of which way droplets go when they could go either: -1 or +1, i.e., one
+   cell left or right. Saves calling for a random number each time. */
+/* Size of indices, in bits */
+#define RND_TBL_BITS (13)
+/* Size of random table, in entries */
+#define RND_TBL_SIZE (1<<RND_TBL_BITS)
+/* Mask random table index with this value to clamp to valid range (with wrap) */
+#define RND_TBL_IDX_MASK ((1<<RND_TBL_BITS)-1)
+/* Largest number engine_rand returns */
+#define ENGINE_RAND_MAX (0x7FFF)
+
+/* One end of a move made by pressure: a droplet on top of a body of water, or a gap round
+   its edge that a droplet could rest in. */
+typedef struct level_t {
+	unsigned body;						/* body it's in or next to, by its first cell */
+	unsigned rank;						/* order to use them in: highest droplets, lowest gaps first */
+	unsigned what;						/* droplet index, or cell index */
+}level_t;
+
+/* Once nothing's moved for this many ticks in a row, nothing will, so the engine stops
+   ticking (and making frames) until a command changes something. It's more than enough
+   for pools and pressure to have had a go. */
+#define IDLE_TICKS (32)
+
+/* ready_frame is the index of the latest frame, with FRAME_FRESH set if the UI hasn't
+   had it yet. */
+#define FRAME_INDEX (3)
+#define FRAME_FRESH (4)
+
+/* Everything to do with the simulation. Once the sim thread is running, the UI thread
+   only talks to it through engine_post and engine_frame; everything else belongs to the
+   sim thread. There's nothing outside it, so any number of engines can run at once, each
+   on its own thread. */
+typedef struct engine_t {
+	int area_width;						/* width of "play" area */
+	int area_height;					/* height of "play" area */
+	int bucket_size;					/* bucket width and height */
+	int bucket_neck_size;				/* bucket's neck size */
+	int paused;							/* whether water is paused or not */
+	double tick_hz;						/* ticks per second; 0 for turbo */
+	pace_t pace;						/* decides when ticks are due */
+	unsigned ticks;						/* number of ticks done */
+	unsigned moved;						/* droplets moved in the last tick, pressure's included */
+	unsigned still_ticks;				/* ticks in a row nothing's moved in */
+
+	/* Buffers. These are ordinary memory (or files; see mapped storage), one byte per cell
+	   (CELL_xxx), whatever the display's pixel format. */
+	int valid;							/* buffers allocated */
+	DDSURFACEDESC land;					/* landscape */
+	DDSURFACEDESC back;					/* landscape plus droplets plus bucket; this is what's shown */
+	DDSURFACEDESC tiles;				/* LAYOUT_TILES: the same, tiled, and the droplets are only here */
+	int land_changed;					/* whole landscape needs copying to back buffer */
+	int back_changed;					/* back buffer redrawn some other way, and wants publishing */
+	RECT land_dirty;					/* part of landscape needing copying to back buffer */
+	RECT view;							/* part of back buffer frames show; see CMD_VIEW */
+	int reset_drops;					/* droplets to be reset ASAP */
+
+	/* Random numbers. Each engine has its own, so one world doesn't disturb another's. */
+	unsigned rand_state;				/* see engine_rand */
+	unsigned dir_tbl[RND_TBL_SIZE];		/* random table */
+	unsigned dir_idx;					/* next entry of dir_tbl to use */
+
+	/* Droplet data */
+	unsigned stride;					/* cells per row of back buffer; depends only on area_width and layout */
+	int layout;							/* LAYOUT_xxx */
+	unsigned num_drops;					/* number of droplets*/
+	unsigned total_drops;				/* number of droplets after a reset; resizing may lose some */
+	unsigned *drops;					/* droplet data, 2 unsigneds per droplet: cell index (see engine_cell); type, last gate */
+	int row_order;						/* every so often, put drops in order of row, bottom first; see sort_drops */
+	/* Zobrist hash of the water: the XOR of a key for each droplet's cell and type, pooled
+	   or not. Each move XORs the old key out and the new one in, so it's up to date every
+	   tick for next to nothing, and two runs that should be the same can be checked a tick
+	   at a time. Cells are by index, so only runs with the same layout and width compare. */
+	ULONGLONG hash;
+
+	/* Gates. The map is the same shape as the back buffer, and gate_tiles as the tiles, so
+	   a droplet's cell index finds its gate too. */
+	DDSURFACEDESC gate_map;				/* gate number of each cell, 0 for none */
+	DDSURFACEDESC gate_tiles;			/* LAYOUT_TILES: the same, tiled */
+	unsigned gate_counts[MAX_GATES+1][2];	/* crossings so far, by gate and droplet type; [0] unused */
+	unsigned gate_sampled[MAX_GATES+1][2];	/* gate_counts as of last sample */
+	unsigned gate_sample_tick;			/* tick of last sample */
+	gate_stats_t gate_stats;			/* what frames get */
+
+	/* Heat map: how often droplets have been seen in each cell, for seeing where water goes.
+	   It's only there while it's wanted, and then only looked at every heat_ticks ticks, so
+	   it costs nothing when it's off and little when it's on. */
+	unsigned *heat;						/* visits to each cell, by cell index, less pooled time; NULL if off */
+	int heat_ticks;						/* count every this many ticks */
+	int heat_drops;						/* count every this many droplets */
+	int heat_first;						/* droplet to start at next time, so each gets a turn */
+	unsigned heat_samples;				/* number of times counted */
+	unsigned heat_rounds;				/* number of times every droplet has been counted */
+
+	/* Pools. A droplet with something in all four cells round it can't move, and can't
+	   until one of them empties, so it's taken out of drops and left in the grid as
+	   CELL_POOL_xxx, where it costs nothing per tick. Each time a droplet moves, it looks
+	   for pooled cells next to the one it left; those wake up at the end of the tick, and
+	   go back on the end of drops. */
+	int pools;							/* pools on */
+	unsigned num_pooled;				/* droplets in pools, as well as num_drops */
+	unsigned *woken;					/* cells emptied next to pooled cells this tick */
+	unsigned num_woken,max_woken;
+	int wake_all;						/* woken was full and couldn't grow, so all pools wake instead */
+
+	/* Pressure. Left alone, water pushed up a column only rises a droplet a tick, so a
+	   U-tube takes thousands of ticks to level out. With pressure on, every so often the
+	   water in the area is sorted into bodies of touching cells, with a union-find, and
+	   droplets go straight from the top of each body to the lowest gaps round its edge,
+	   for as long as those are lower. The bucket's left out, so the neck still decides
+	   how fast water comes in. */
+	int pressure;						/* pressure on */
+	unsigned *bodies;					/* union-find over the area's cells, row by row; see find_body */
+	size_t max_bodies;					/* cells allocated at bodies */
+	level_t *tops,*gaps;				/* ends of the moves, while working them out */
+	unsigned max_tops,max_gaps;
+	unsigned pressure_moves;			/* droplets moved by pressure so far */
+
+	/* Mapped storage. The landscape, back buffer, tiles and gate maps can be views of
+	   temporary files instead of ordinary memory, so a world can be bigger than RAM: it
+	   then slows down as Windows pages it in and out, rather than not fitting at all. To
+	   help Windows along, every so often the world's looked at in bands of rows; bands
+	   with droplets in or next to them are asked for ahead of time if they've been let go,
+	   and bands that have had none for a while are let go. See update_bands. */
+	char *map_dir;						/* folder for the files; 0 for ordinary memory */
+	unsigned band_rows;					/* rows per band; a whole number of tiles */
+	unsigned num_bands;
+	BYTE *band_quiet;					/* looks each band's had no droplets for, up to BAND_QUIET; then
+										   num_bands more, for update_bands */
+	unsigned prefetches,evictions;		/* bands asked for again and let go so far */
+
+	/* Commands from the UI. The UI adds to queue; the sim thread swaps it with run and
+	   works through that, so lock is only held for a moment either side. */
+	CRITICAL_SECTION lock;
+	cmd_queue_t queue;
+	cmd_queue_t run;
+	HANDLE wake;						/* set when a command is posted */
+
+	/* Triple buffered output */
+	frame_t frames[3];
+	int write_frame;					/* frame the sim thread is filling in */
+	int read_frame;						/* frame the UI thread is showing */
+	volatile LONG ready_frame;			/* latest finished frame, see FRAME_FRESH */
+	HANDLE frame_event;					/* set when a frame is finished */
+
+	HANDLE thread;
+	int quit;
+}engine_t;
+
+int engine_bucket_size(unsigned num_drops);
+engine_t *engine_create(int width,int height,unsigned num_drops,unsigned seed);
+void engine_destroy(engine_t *e);
+unsigned engine_cell(const engine_t *e,int x,int y);
+void engine_cell_xy(const engine_t *e,unsigned cell,int *x,int *y);
+unsigned engine_heat(engine_t *e,int x,int y);
+unsigned engine_settled(const engine_t *e);
+ULONGLONG engine_hash(engine_t *e);
+int engine_map(engine_t *e,const char *dir);
+void engine_map_stats(const engine_t *e,map_stats_t *s);
+void engine_post(engine_t *e,const cmd_t *cmd);
+int engine_update(engine_t *e,int tick);
+void engine_publish(engine_t *e);
+const frame_t *engine_frame(engine_t *e);
+int engine_start(engine_t *e);
+void engine_stop(engine_t *e);
+
+#endif
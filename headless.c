@@ -0,0 +1,1466 @@
+/* Headless driver. Runs things with no window and no DirectDraw, writing results as text.
+
+	waterworks -bench <name> [options]
+	waterworks -sweep <spec file> [-jobs N] [-o FILE]		(see sweep.c)
+
+   Options:
+
+	-size WxH		area size (default depends on benchmark)
+	-bpp N			bits per pixel: 8, 16 or 32 (default depends on benchmark)
+	-reps N			number of repetitions (default 5)
+	-ticks N		ticks per repetition for turbo, or before resizing (default 1000)
+	-drops N		number of droplets, for turbo (default 100000, as the GUI)
+	-every N		ticks between heat counts, or hash checks (default 10)
+	-step N			heat: count every Nth droplet each time (default 1)
+	-image FILE		heat: write heat map to FILE (default heat.bmp)
+	-neck N			world: bucket neck size (default 5, as the GUI)
+	-seed N			random number seed, for the water (default 1)
+	-land NAME		world: landscape, empty, shelves or vessels (default shelves)
+	-jobs N			sweep: number of worlds at once (default one per CPU)
+	-mapped DIR		keep worlds in temporary files in DIR rather than in memory (default
+					memory; mapped: the temporary folder)
+	-cpu NAME		use nothing past instruction set NAME: C, SSE2, SSSE3, SSE4.1, AVX2
+					or AVX-512 (default whatever the CPU has)
+	-o FILE			write results to FILE rather than stdout
+*/
+#include <windows.h>
+#include <ddraw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <malloc.h>
+#include "debug.h"
+#include "cpu.h"
+#include "land.h"
+#include "engine.h"
+#include "render.h"
+#include "headless.h"
+#include "sweep.h"
+
+#define MAX_ARGS (64)
+
+typedef struct {
+	int argc;
+	char *argv[MAX_ARGS];
+	char *args;							/* storage for argv strings */
+
+	/* Options */
+	int width,height;					/* 0 if not specified */
+	int bpp;							/* bits per pixel; 0 if not specified */
+	int reps;
+	int ticks;
+	unsigned drops;
+	int every;							/* -every: ticks between heat counts, or hash checks */
+	int step;							/* -step: count every this many droplets, for heat */
+	const char *image;
+	int neck;
+	unsigned seed;
+	int land;							/* SWEEP_LAND_xxx, or -1 if not a good one */
+	const char *map_dir;				/* keep worlds in files here (see engine_map); 0 for memory */
+	FILE *out;
+}headless_t;
+
+typedef struct {
+	const char *name;
+	int (*func)(headless_t *h);
+	const char *what;
+}bench_t;
+
+static int bench_fill(headless_t *h);
+static int bench_flood(headless_t *h);
+static int bench_turbo(headless_t *h);
+static int bench_resize(headless_t *h);
+static int bench_render(headless_t *h);
+static int bench_zoom(headless_t *h);
+static int bench_publish(headless_t *h);
+static int bench_gates(headless_t *h);
+static int bench_heat(headless_t *h);
+static int bench_world(headless_t *h);
+static int bench_layout(headless_t *h);
+static int bench_pools(headless_t *h);
+static int bench_pressure(headless_t *h);
+static int bench_order(headless_t *h);
+static int bench_mapped(headless_t *h);
+static int bench_hash(headless_t *h);
+
+static const bench_t benches[]={
+	{"fill",bench_fill,"Erase and Fill of the whole landscape"},
+	{"flood",bench_flood,"Flood fill of a big enclosed region"},
+	{"turbo",bench_turbo,"The simulation, ticking as fast as it'll go"},
+	{"resize",bench_resize,"Resizing a populated world, keeping the contents"},
+	{"render",bench_render,"Turning cells into the display format, each way the CPU can"},
+	{"zoom",bench_zoom,"Rendering a window's worth of view at each zoom from 1x to 8x"},
+	{"publish",bench_publish,"Making frames of a big world, whole and through a window"},
+	{"gates",bench_gates,"The simulation with and without gates; prints what the gates count"},
+	{"heat",bench_heat,"The simulation with and without a heat map, then writes the map"},
+	{"world",bench_world,"One world, as -sweep runs each, with -seed, -neck and -land"},
+	{"layout",bench_layout,"The simulation with each way of laying out the cells, 1K to 16K wide"},
+	{"pools",bench_pools,"The simulation with and without settled water kept as pools"},
+	{"pressure",bench_pressure,"A U-tube filling, with and without pressure; prints the levels"},
+	{"order",bench_order,"The simulation with droplets in any order, and kept in row order"},
+	{"mapped",bench_mapped,"The simulation with the world in memory, then in files; -mapped DIR"},
+	{"hash",bench_hash,"Hashes of the water as it goes, checking runs that should agree do"},
+	{0},
+};
+
+/*
+	split_args
+
+	Splits a command line into arguments, in place. Double quotes group words.
+*/
+static void split_args(headless_t *h,const char *cmd_line) {
+	char *p,*q;
+
+	h->argc=0;
+	h->args=_strdup(cmd_line?cmd_line:"");
+	if(!h->args) {
+		return;
+	}
+	p=h->args;
+	for(;;) {
+		while(*p&&isspace((unsigned char)*p)) {
+			p++;
+		}
+		if(!*p||h->argc==MAX_ARGS) {
+			break;
+		}
+		h->argv[h->argc++]=q=p;
+		while(*p&&!isspace((unsigned char)*p)) {
+			if(*p=='"') {
+				for(p++;*p&&*p!='"';) {
+					*q++=*p++;
+				}
+				if(*p) {
+					p++;
+				}
+			} else {
+				*q++=*p++;
+			}
+		}
+		if(*p) {
+			p++;
+		}
+		*q=0;
+	}
+}
+
+/*
+	headless_wanted
+
+	Returns non-0 if the command line asks for something headless.
+*/
+int headless_wanted(const char *cmd_line) {
+	headless_t h;
+	int r;
+
+	split_args(&h,cmd_line);
+	r=h.argc>0&&(strcmp(h.argv[0],"-bench")==0||strcmp(h.argv[0],"-sweep")==0);
+	free(h.args);
+	return r;
+}
+
+static double now(void) {
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+
+	if(!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);
+	}
+	QueryPerformanceCounter(&t);
+	return t.QuadPart/(double)freq.QuadPart;
+}
+
+/* Fills in the usual pixel format for the given depth. */
+static void make_pf(DDPIXELFORMAT *pf,int bpp) {
+	memset(pf,0,sizeof(*pf));
+	pf->dwSize=sizeof(*pf);
+	pf->dwFlags=DDPF_RGB;
+	pf->dwRGBBitCount=bpp;
+	switch(bpp) {
+	case 16:
+		pf->dwRBitMask=0xF800;
+		pf->dwGBitMask=0x07E0;
+		pf->dwBBitMask=0x001F;
+		break;
+	case 32:
+		pf->dwRBitMask=0xFF0000;
+		pf->dwGBitMask=0x00FF00;
+		pf->dwBBitMask=0x0000FF;
+		break;
+	}
+}
+
+/*
+	make_surface
+
+	Allocates a chunk of ordinary memory to draw on, in the usual pixel format for the given
+	depth. Returns 0 if there's not enough memory. Free with land_free.
+*/
+static int make_surface(DDSURFACEDESC *ds,int w,int h,int bpp) {
+	DDPIXELFORMAT pf;
+
+	make_pf(&pf,bpp);
+	return land_alloc(ds,w,h,&pf);
+}
+
+/* White, as used for the border */
+static DWORD white_of(const DDSURFACEDESC *ds) {
+	const DDPIXELFORMAT *pf=&ds->ddpfPixelFormat;
+
+	return pf->dwRGBBitCount==8?0xFF:pf->dwRBitMask|pf->dwGBitMask|pf->dwBBitMask;
+}
+
+/*
+	report
+
+	Prints min/mean time of a set of runs that each touched the given number of bytes.
+*/
+static void report(headless_t *h,const char *what,const double *times,int n,double bytes) {
+	double best=times[0],total=0;
+	int i;
+
+	for(i=0;i<n;i++) {
+		best=min(best,times[i]);
+		total+=times[i];
+	}
+	fprintf(h->out,"%-12s best %9.3f ms  mean %9.3f ms  %8.2f GB/s\n",
+		what,best*1000,total/n*1000,bytes/best/1e9);
+}
+
+/* Whole landscape erase and fill. The default 8K x 8K is as big as the GUI is
+   realistically going to get. */
+static int bench_fill(headless_t *h) {
+	DDSURFACEDESC ds;
+	double *erase,*fill,t,bytes;
+	DWORD yellow;
+	int i,w,ht,bpp;
+
+	w=h->width?h->width:8192;
+	ht=h->height?h->height:8192;
+	bpp=h->bpp?h->bpp:32;
+	if(!make_surface(&ds,w,ht,bpp)) {
+		fprintf(h->out,"fill: couldn't allocate %d x %d at %dbpp\n",w,ht,bpp);
+		return 1;
+	}
+	erase=malloc(h->reps*sizeof(double));
+	fill=malloc(h->reps*sizeof(double));
+	yellow=bpp==8?CELL_YELLOW:land_colour(&ds.ddpfPixelFormat,RGB(200,200,0));
+	fprintf(h->out,"fill: %d x %d, %dbpp, %d reps\n",w,ht,bpp,h->reps);
+	/* Touch it all once first so page faults aren't counted */
+	land_reset(&ds,0,white_of(&ds),5);
+	for(i=0;i<h->reps;i++) {
+		t=now();
+		land_reset(&ds,0,white_of(&ds),5);
+		erase[i]=now()-t;
+		t=now();
+		land_reset(&ds,yellow,white_of(&ds),5);
+		fill[i]=now()-t;
+	}
+	bytes=(double)w*ht*(bpp/8);
+	report(h,"erase",erase,h->reps,bytes);
+	report(h,"fill",fill,h->reps,bytes);
+	free(erase);
+	free(fill);
+	land_free(&ds);
+	return 0;
+}
+
+/* Flood fill of a big basin with shelves sticking out of alternate sides, so it's all one
+   region but the spans aren't all full width. Defaults to 16K x 16K at 8bpp, so it fits
+   in a 32-bit process. */
+static int bench_flood(headless_t *h) {
+	DDSURFACEDESC ds;
+	double *times,bytes;
+	DWORD yellow,green;
+	RECT clip,dirty;
+	int i,y,w,ht,bpp;
+
+	w=h->width?h->width:16384;
+	ht=h->height?h->height:16384;
+	bpp=h->bpp?h->bpp:8;
+	if(!make_surface(&ds,w,ht,bpp)) {
+		fprintf(h->out,"flood: couldn't allocate %d x %d at %dbpp\n",w,ht,bpp);
+		return 1;
+	}
+	times=malloc(h->reps*sizeof(double));
+	yellow=bpp==8?CELL_YELLOW:land_colour(&ds.ddpfPixelFormat,RGB(200,200,0));
+	green=bpp==8?CELL_GREEN:land_colour(&ds.ddpfPixelFormat,RGB(0,255,0));
+	SetRect(&clip,1,1,w-1,ht-1);
+	fprintf(h->out,"flood: %d x %d, %dbpp, %d reps\n",w,ht,bpp,h->reps);
+	for(i=0;i<h->reps;i++) {
+		double t;
+
+		land_reset(&ds,0,white_of(&ds),5);
+		for(y=64;y<ht-64;y+=64) {
+			if((y/64)&1) {
+				land_stroke(&ds,&clip,yellow,0,y,w*3/4,y+16,5,0);
+			} else {
+				land_stroke(&ds,&clip,yellow,w/4,y+16,w,y,5,0);
+			}
+		}
+		SetRectEmpty(&dirty);
+		t=now();
+		land_flood(&ds,&clip,green,w/2,ht-2,&dirty);
+		times[i]=now()-t;
+	}
+	bytes=(double)w*ht*(bpp/8);
+	report(h,"flood",times,h->reps,bytes);
+	fprintf(h->out,"dirty: (%ld,%ld)-(%ld,%ld)\n",dirty.left,dirty.top,dirty.right,dirty.bottom);
+	free(times);
+	land_free(&ds);
+	return 0;
+}
+
+/*
+	start_engine
+
+	Creates an engine (without a sim thread) with shelves for the water to run down, and
+	gets it going. Returns 0, having said why, if that's not possible. With -mapped, the
+	engine starts small and in files, then grows, so the world never has to fit in
+	memory.
+*/
+static engine_t *start_engine(headless_t *h,const char *what,int w,int ht) {
+	engine_t *e;
+	cmd_t c;
+	int ok;
+
+	e=engine_create(h->map_dir?640:w,h->map_dir?400:ht,h->drops,h->seed);
+	if(e&&h->map_dir) {
+		ok=engine_map(e,h->map_dir);
+		if(ok) {
+			c.type=CMD_RESIZE;
+			c.u.size.width=w;
+			c.u.size.height=ht;
+			c.u.size.contents=RESIZE_DISCARD;
+			engine_post(e,&c);
+			engine_update(e,0);
+			ok=e->valid;
+		}
+		if(!ok) {
+			engine_destroy(e);
+			e=0;
+		}
+	}
+	if(!e) {
+		fprintf(h->out,"%s: couldn't create %d x %d engine\n",what,w,ht);
+		return 0;
+	}
+	sweep_draw_land(e,SWEEP_LAND_SHELVES);
+	c.type=CMD_PAUSE;
+	c.u.paused=0;
+	engine_post(e,&c);
+	engine_update(e,0);
+	return e;
+}
+
+/* The simulation in turbo mode: ticks back to back, with no sim thread and no display.
+   Defaults to the GUI's starting size. Each rep is reported as it finishes, so long runs
+   show how it's getting on. If the water stops, so does the engine, and that's the last
+   rep. */
+static int bench_turbo(headless_t *h) {
+	engine_t *e;
+	double *times,best,total;
+	int i,j,w,ht,n;
+
+	w=h->width?h->width:640;
+	ht=h->height?h->height:400;
+	e=start_engine(h,"turbo",w,ht);
+	if(!e) {
+		return 1;
+	}
+	times=malloc(h->reps*sizeof(double));
+	fprintf(h->out,"turbo: %d x %d, %u droplets, %d reps of %d ticks\n",w,ht,
+		e->num_drops,h->reps,h->ticks);
+	for(i=n=0;i<h->reps&&!engine_settled(e);i++,n++) {
+		double t=now();
+
+		for(j=0;j<h->ticks&&!engine_settled(e);j++) {
+			engine_update(e,1);
+		}
+		times[i]=now()-t;
+		if(j<h->ticks) {
+			/* Part of a rep is no use for comparing */
+			break;
+		}
+		fprintf(h->out,"rep %-8d %9.0f ticks/s  %9.1fM droplets/s\n",i+1,h->ticks/times[i],
+			h->ticks*(double)e->num_drops/times[i]/1e6);
+		fflush(h->out);
+	}
+	if(engine_settled(e)) {
+		fprintf(h->out,"converged at tick %u\n",engine_settled(e));
+	}
+	if(n) {
+		best=times[0];
+		total=0;
+		for(i=0;i<n;i++) {
+			best=min(best,times[i]);
+			total+=times[i];
+		}
+		fprintf(h->out,"best         %9.0f ticks/s  %9.1fM droplets/s\n",h->ticks/best,
+			h->ticks*(double)e->num_drops/best/1e6);
+		fprintf(h->out,"mean         %9.0f ticks/s  %9.1fM droplets/s\n",h->ticks*n/total,
+			h->ticks*(double)e->num_drops*n/total/1e6);
+	}
+	free(times);
+	engine_destroy(e);
+	return 0;
+}
+
+/* Resizing a populated world, each way that keeps the contents: shrink by an eighth, then
+   grow back. Defaults to 8K x 8K. */
+static int bench_resize(headless_t *h) {
+	static const struct {
+		int contents;
+		const char *name;
+	}modes[]={
+		{RESIZE_PRESERVE,"preserve"},
+		{RESIZE_CENTRE,"centre"},
+		{RESIZE_SCALE,"scale"},
+	};
+	engine_t *e;
+	double *shrink,*grow,bytes;
+	char what[50];
+	int i,m,w,ht;
+	cmd_t c;
+
+	w=h->width?h->width:8192;
+	ht=h->height?h->height:8192;
+	e=start_engine(h,"resize",w,ht);
+	if(!e) {
+		return 1;
+	}
+	/* Let the water get going */
+	for(i=0;i<h->ticks;i++) {
+		engine_update(e,1);
+	}
+	shrink=malloc(h->reps*sizeof(double));
+	grow=malloc(h->reps*sizeof(double));
+	fprintf(h->out,"resize: %d x %d <-> %d x %d, %u droplets after %d ticks, %d reps\n",
+		w,ht,w-w/8,ht-ht/8,e->num_drops,h->ticks,h->reps);
+	bytes=(double)w*ht;
+	c.type=CMD_RESIZE;
+	for(m=0;m<sizeof(modes)/sizeof(modes[0]);m++) {
+		c.u.size.contents=modes[m].contents;
+		for(i=0;i<h->reps;i++) {
+			double t;
+
+			c.u.size.width=w-w/8;
+			c.u.size.height=ht-ht/8;
+			t=now();
+			engine_post(e,&c);
+			engine_update(e,0);
+			shrink[i]=now()-t;
+			c.u.size.width=w;
+			c.u.size.height=ht;
+			t=now();
+			engine_post(e,&c);
+			engine_update(e,0);
+			grow[i]=now()-t;
+			if(!e->valid) {
+				fprintf(h->out,"resize: ran out of memory\n");
+				m=sizeof(modes)/sizeof(modes[0]);
+				break;
+			}
+		}
+		if(i==h->reps) {
+			_snprintf(what,sizeof(what),"%s-",modes[m].name);
+			report(h,what,shrink,h->reps,bytes);
+			_snprintf(what,sizeof(what),"%s+",modes[m].name);
+			report(h,what,grow,h->reps,bytes);
+			fprintf(h->out,"%u droplets left\n",e->num_drops);
+		}
+	}
+	free(shrink);
+	free(grow);
+	engine_destroy(e);
+	return 0;
+}
+
+/* colours -- colour of each cell (CELL_xxx order), as the GUI's classic scheme has them */
+#define CLASSIC_COLOUR(NAME,CLASSIC,NIGHT,SLIDE,RED,BLUE) CLASSIC,
+static const COLORREF colours[NUM_CELLS]={
+	CELLS(CLASSIC_COLOUR)
+};
+
+/* Rendering a whole frame of cells to the display format, with each renderer the CPU can
+   run, checked against plain C. Defaults to 4K x 4K at 32bpp; bytes are bytes written. */
+static int bench_render(headless_t *h) {
+	DDSURFACEDESC cells,ref,ds;
+	palette_t pal;
+	double *times;
+	int i,r,y,w,ht,bpp,best;
+
+	w=h->width?h->width:4096;
+	ht=h->height?h->height:4096;
+	bpp=h->bpp?h->bpp:32;
+	if(!render_supports(bpp)) {
+		fprintf(h->out,"render: can't render at %dbpp\n",bpp);
+		return 1;
+	}
+	cells.lpSurface=ref.lpSurface=ds.lpSurface=0;
+	if(!land_alloc_cells(&cells,w,ht)||!make_surface(&ref,w,ht,bpp)||!make_surface(&ds,w,ht,bpp)) {
+		fprintf(h->out,"render: couldn't allocate %d x %d at %dbpp\n",w,ht,bpp);
+		land_free(&cells);
+		land_free(&ref);
+		return 1;
+	}
+	/* Noise, so there's nothing to be gained from runs */
+	for(y=0;y<ht;y++) {
+		BYTE *row=(BYTE *)cells.lpSurface+y*cells.lPitch;
+		int x;
+
+		for(x=0;x<w;x++) {
+			row[x]=(BYTE)(rand()%NUM_CELLS);
+		}
+	}
+	render_palette(&pal,&ds.ddpfPixelFormat,colours,NUM_CELLS);
+	best=render_get();
+	render_set(RENDER_C);
+	render_rows(ref.lpSurface,ref.lPitch,cells.lpSurface,cells.lPitch,w,ht,&pal);
+	times=malloc(h->reps*sizeof(double));
+	fprintf(h->out,"render: %d x %d, %dbpp, %d reps\n",w,ht,bpp,h->reps);
+	for(r=0;r<NUM_RENDERERS;r++) {
+		if(!render_set(r)) {
+			fprintf(h->out,"%-12s not supported by this CPU, or ruled out by -cpu\n",render_name(r));
+			continue;
+		}
+		for(i=0;i<h->reps;i++) {
+			double t=now();
+
+			render_rows(ds.lpSurface,ds.lPitch,cells.lpSurface,cells.lPitch,w,ht,&pal);
+			times[i]=now()-t;
+		}
+		report(h,render_name(r),times,h->reps,(double)w*ht*(bpp/8));
+		for(y=0;y<ht;y++) {
+			if(memcmp((BYTE *)ds.lpSurface+y*ds.lPitch,(BYTE *)ref.lpSurface+y*ref.lPitch,w*(bpp/8))!=0) {
+				fprintf(h->out,"%-12s doesn't match C at row %d!\n",render_name(r),y);
+				break;
+			}
+		}
+	}
+	render_set(best);
+	free(times);
+	land_free(&cells);
+	land_free(&ref);
+	land_free(&ds);
+	return 0;
+}
+
+/* Rendering a zoomed view, as the GUI does for each frame, at 1x to 8x with plain C and
+   with the best renderer, checked against doing it the obvious way. The size is that of
+   the window, 1920 x 1080 at 32bpp by default; bytes are bytes written. */
+static int bench_zoom(headless_t *h) {
+	DDSURFACEDESC cells,big,ref,ds;
+	palette_t pal;
+	double *times;
+	char what[50];
+	int i,k,r,x,y,w,ht,bpp,best,ok=1;
+
+	w=h->width?h->width:1920;
+	ht=h->height?h->height:1080;
+	bpp=h->bpp?h->bpp:32;
+	if(!render_supports(bpp)) {
+		fprintf(h->out,"zoom: can't render at %dbpp\n",bpp);
+		return 1;
+	}
+	/* Enough cells for 1x; the zoomed views use the top left of them */
+	cells.lpSurface=big.lpSurface=ref.lpSurface=ds.lpSurface=0;
+	if(!land_alloc_cells(&cells,w,ht)||!land_alloc_cells(&big,w,ht)||
+		!make_surface(&ref,w,ht,bpp)||!make_surface(&ds,w,ht,bpp)) {
+		fprintf(h->out,"zoom: couldn't allocate %d x %d at %dbpp\n",w,ht,bpp);
+		land_free(&cells);
+		land_free(&big);
+		land_free(&ref);
+		return 1;
+	}
+	for(y=0;y<ht;y++) {
+		BYTE *row=(BYTE *)cells.lpSurface+y*cells.lPitch;
+
+		for(x=0;x<w;x++) {
+			row[x]=(BYTE)(rand()%NUM_CELLS);
+		}
+	}
+	render_palette(&pal,&ds.ddpfPixelFormat,colours,NUM_CELLS);
+	best=render_get();
+	times=malloc(h->reps*sizeof(double));
+	fprintf(h->out,"zoom: %d x %d, %dbpp, %d reps\n",w,ht,bpp,h->reps);
+	for(k=1;k<=8&&ok;k++) {
+		/* The obvious way: zoom the cells one by one, then render at 1x */
+		for(y=0;y<ht;y++) {
+			BYTE *d=(BYTE *)big.lpSurface+y*big.lPitch;
+			const BYTE *s=(const BYTE *)cells.lpSurface+(y/k)*cells.lPitch;
+
+			for(x=0;x<w;x++) {
+				d[x]=s[x/k];
+			}
+		}
+		render_set(RENDER_C);
+		render_rows(ref.lpSurface,ref.lPitch,big.lpSurface,big.lPitch,w,ht,&pal);
+		for(r=RENDER_C;r<=best;r+=best-RENDER_C) {
+			render_set(r);
+			for(i=0;i<h->reps;i++) {
+				double t=now();
+
+				ok=render_zoom(ds.lpSurface,ds.lPitch,w,ht,cells.lpSurface,cells.lPitch,k,k,&pal);
+				times[i]=now()-t;
+			}
+			if(!ok) {
+				fprintf(h->out,"zoom: ran out of memory\n");
+				break;
+			}
+			_snprintf(what,sizeof(what),"%dx %s",k,render_name(r));
+			report(h,what,times,h->reps,(double)w*ht*(bpp/8));
+			for(y=0;y<ht;y++) {
+				if(memcmp((BYTE *)ds.lpSurface+y*ds.lPitch,(BYTE *)ref.lpSurface+y*ref.lPitch,w*(bpp/8))!=0) {
+					fprintf(h->out,"%-12s doesn't match at row %d!\n",what,y);
+					break;
+				}
+			}
+			if(best==RENDER_C) {
+				break;
+			}
+		}
+	}
+	render_set(best);
+	free(times);
+	land_free(&cells);
+	land_free(&big);
+	land_free(&ref);
+	land_free(&ds);
+	return ok?0:1;
+}
+
+/* Making frames of an 8K x 8K world: all of it, then just a 1920 x 1080 window's worth,
+   then the same at 8x zoom, as the GUI would ask for. Bytes are bytes copied. */
+static int bench_publish(headless_t *h) {
+	static const struct {
+		int w,h;
+		const char *name;
+	}views[]={
+		{0,0,"whole"},
+		{1920,1080,"window"},
+		{1920/8,1080/8,"window-8x"},
+	};
+	engine_t *e;
+	const frame_t *f=0;
+	double *times;
+	int i,v,w,ht;
+	cmd_t c;
+
+	w=h->width?h->width:8192;
+	ht=h->height?h->height:8192;
+	e=start_engine(h,"publish",w,ht);
+	if(!e) {
+		return 1;
+	}
+	times=malloc(h->reps*sizeof(double));
+	fprintf(h->out,"publish: %d x %d, %d reps\n",w,ht,h->reps);
+	c.type=CMD_VIEW;
+	for(v=0;v<sizeof(views)/sizeof(views[0]);v++) {
+		/* Somewhere in the middle */
+		SetRect(&c.u.view,w/3,ht/3,w/3+views[v].w,ht/3+views[v].h);
+		engine_post(e,&c);
+		engine_update(e,0);
+		for(i=0;i<h->reps;i++) {
+			double t=now();
+
+			engine_publish(e);
+			times[i]=now()-t;
+			f=engine_frame(e);
+		}
+		report(h,views[v].name,times,h->reps,(double)(f->view.right-f->view.left)*(f->view.bottom-f->view.top));
+	}
+	free(times);
+	engine_destroy(e);
+	return 0;
+}
+
+/*
+	time_ticks
+
+	Runs the engine for h->ticks ticks. Returns how long that took, in seconds.
+*/
+static double time_ticks(headless_t *h,engine_t *e) {
+	double t=now();
+	int i;
+
+	for(i=0;i<h->ticks;i++) {
+		engine_update(e,1);
+	}
+	return now()-t;
+}
+
+/* Clears the gates, then adds the two bench_gates counts with. */
+static void add_gates(engine_t *e,int w,int ht) {
+	cmd_t c;
+
+	memset(&c,0,sizeof(c));
+	c.type=CMD_CLEAR_GATES;
+	engine_post(e,&c);
+	c.type=CMD_GATE;
+	c.u.stroke.x1=1;
+	c.u.stroke.x2=w-2;
+	c.u.stroke.y1=c.u.stroke.y2=1;
+	engine_post(e,&c);
+	c.u.stroke.x1=w/2-e->bucket_neck_size;
+	c.u.stroke.x2=w/2+e->bucket_neck_size;
+	c.u.stroke.y1=c.u.stroke.y2=ht-2;
+	engine_post(e,&c);
+}
+
+/* The simulation with and without two gates: one just below the bucket, which every
+   droplet crosses on its way in, and one over the hole at the bottom, which they cross on
+   their way out. How fast it goes depends on where the water's got to, so it's given a
+   run to settle first, then the two take turns, and it's the mean that's reported. Then
+   the time series from one more run, one line per sample. */
+static int bench_gates(headless_t *h) {
+	engine_t *e;
+	const gate_stats_t *g;
+	double without=0,with=0;
+	int i,j,w,ht;
+	cmd_t c;
+
+	w=h->width?h->width:640;
+	ht=h->height?h->height:400;
+	e=start_engine(h,"gates",w,ht);
+	if(!e) {
+		return 1;
+	}
+	fprintf(h->out,"gates: %d x %d, %u droplets, %d reps of %d ticks each way\n",w,ht,
+		e->num_drops,h->reps,h->ticks);
+	time_ticks(h,e);
+	for(i=0;i<h->reps;i++) {
+		/* Every other rep does it with gates first, so it's even */
+		for(j=0;j<2;j++) {
+			if((i^j)&1) {
+				add_gates(e,w,ht);
+				with+=time_ticks(h,e);
+			} else {
+				c.type=CMD_CLEAR_GATES;
+				engine_post(e,&c);
+				without+=time_ticks(h,e);
+			}
+		}
+	}
+	/* A fresh set for the time series */
+	add_gates(e,w,ht);
+	time_ticks(h,e);
+	g=&e->gate_stats;
+	fprintf(h->out,"no gates     %9.0f ticks/s\n",h->reps*h->ticks/without);
+	fprintf(h->out,"%d gates      %9.0f ticks/s  %+.1f%% time per tick\n",g->num_gates,h->reps*h->ticks/with,
+		(with/without-1)*100);
+	fprintf(h->out,"\n%-12s","sample");
+	for(i=0;i<g->num_gates;i++) {
+		fprintf(h->out,"   gate %d red/blue",i+1);
+	}
+	fprintf(h->out,"\n");
+	for(j=0;j<g->num_samples;j++) {
+		fprintf(h->out,"%-12d",j+1);
+		for(i=0;i<g->num_gates;i++) {
+			fprintf(h->out,"   %8u/%-8u",g->samples[j][i][0],g->samples[j][i][1]);
+		}
+		fprintf(h->out,"\n");
+	}
+	fprintf(h->out,"%-12s","total");
+	for(i=0;i<g->num_gates;i++) {
+		fprintf(h->out,"   %8u/%-8u",g->totals[i][0],g->totals[i][1]);
+	}
+	fprintf(h->out,"\n");
+	engine_destroy(e);
+	return 0;
+}
+
+/*
+	write_heat
+
+	Writes the engine's heat map as a 24-bit BMP, in false colour: black for no visits,
+	then red, yellow and white for the most. The scale is logarithmic, so the quieter
+	places still show up against the bucket, where every droplet starts. Solid cells
+	nothing visited are grey, so the landscape shows too. Returns 0, having said why, if
+	the file couldn't be written.
+*/
+static int write_heat(headless_t *h,engine_t *e,const char *name) {
+	BITMAPFILEHEADER bf;
+	BITMAPINFOHEADER bi;
+	int x,y,w=e->back.dwWidth,ht=e->back.dwHeight,row=(w*3+3)&~3;
+	unsigned most=0;
+	double scale;
+	BYTE *line;
+	FILE *f;
+
+	for(y=0;y<ht;y++) {
+		for(x=0;x<w;x++) {
+			most=max(most,engine_heat(e,x,y));
+		}
+	}
+	scale=most?1/log(1.+most):0;
+	f=fopen(name,"wb");
+	line=calloc(row,1);
+	if(!f||!line) {
+		fprintf(h->out,"heat: couldn't write %s\n",name);
+		if(f) {
+			fclose(f);
+		}
+		free(line);
+		return 0;
+	}
+	memset(&bf,0,sizeof(bf));
+	memset(&bi,0,sizeof(bi));
+	bf.bfType='B'|'M'<<8;
+	bf.bfOffBits=sizeof(bf)+sizeof(bi);
+	bf.bfSize=bf.bfOffBits+row*ht;
+	bi.biSize=sizeof(bi);
+	bi.biWidth=w;
+	bi.biHeight=ht;
+	bi.biPlanes=1;
+	bi.biBitCount=24;
+	bi.biCompression=BI_RGB;
+	fwrite(&bf,sizeof(bf),1,f);
+	fwrite(&bi,sizeof(bi),1,f);
+	/* Bottom up */
+	for(y=ht-1;y>=0;y--) {
+		const BYTE *cells=(const BYTE *)e->back.lpSurface+y*e->back.lPitch;
+
+		for(x=0;x<w;x++) {
+			BYTE *p=line+x*3;
+			unsigned heat=engine_heat(e,x,y);
+
+			if(heat) {
+				double v=log(1.+heat)*scale*3;
+
+				p[2]=(BYTE)(min(v,1)*255);
+				p[1]=(BYTE)(min(max(v-1,0),1)*255);
+				p[0]=(BYTE)(min(max(v-2,0),1)*255);
+			} else if(cells[x]!=CELL_EMPTY&&cells[x]!=CELL_RED&&cells[x]!=CELL_BLUE&&
+				cells[x]!=CELL_POOL_RED&&cells[x]!=CELL_POOL_BLUE)
+			{
+				p[0]=p[1]=p[2]=64;
+			} else {
+				p[0]=p[1]=p[2]=0;
+			}
+		}
+		fwrite(line,row,1,f);
+	}
+	free(line);
+	if(fclose(f)!=0) {
+		fprintf(h->out,"heat: couldn't write %s\n",name);
+		return 0;
+	}
+	fprintf(h->out,"heat: %d x %d map written to %s; most visits to a cell %u\n",w,ht,name,most);
+	return 1;
+}
+
+/* The simulation with no heat map, with one counting every droplet every tick, and with
+   one counting as often as -every and -step say. As with bench_gates, it settles first,
+   then they take turns. Then the sampled heat map from one more run of reps times ticks,
+   as a picture in -image. */
+static int bench_heat(headless_t *h) {
+	static const char *const names[]={"off","every tick","sampled"};
+	engine_t *e;
+	double total[3]={0,0,0};
+	int i,j,w,ht;
+	cmd_t c;
+
+	w=h->width?h->width:640;
+	ht=h->height?h->height:400;
+	e=start_engine(h,"heat",w,ht);
+	if(!e) {
+		return 1;
+	}
+	fprintf(h->out,"heat: %d x %d, %u droplets, %d reps of %d ticks each way; sampled is every %d ticks, every %d droplets\n",
+		w,ht,e->num_drops,h->reps,h->ticks,h->every,h->step);
+	time_ticks(h,e);
+	c.type=CMD_HEAT;
+	for(i=0;i<h->reps;i++) {
+		/* Each rep starts with a different one, so it's even */
+		for(j=0;j<3;j++) {
+			int k=(i+j)%3;
+
+			c.u.heat.ticks=k==0?0:k==1?1:h->every;
+			c.u.heat.drops=k==2?h->step:1;
+			engine_post(e,&c);
+			total[k]+=time_ticks(h,e);
+		}
+	}
+	for(j=0;j<3;j++) {
+		fprintf(h->out,"%-12s %9.0f ticks/s  %+.1f%% time per tick\n",names[j],h->reps*h->ticks/total[j],
+			(total[j]/total[0]-1)*100);
+	}
+	c.u.heat.ticks=h->every;
+	c.u.heat.drops=h->step;
+	engine_post(e,&c);
+	for(i=0;i<h->reps;i++) {
+		time_ticks(h,e);
+	}
+	fprintf(h->out,"heat: counted %u times over %u ticks\n",e->heat_samples,h->reps*h->ticks);
+	i=e->heat&&write_heat(h,e,h->image);
+	engine_destroy(e);
+	return !i;
+}
+
+/* The simulation with each LAYOUT_xxx, at each of a few widths, or just -size. It's
+   worlds from the same seed, so they should all end up the same. */
+static int bench_layout(headless_t *h) {
+	static const char *const names[3]={"rows","power of 2","tiles"};
+	static const int widths[]={1024,4096,16384};
+	engine_t *e[3];
+	int i,r,k,n,w,ht,differ=0;
+
+	n=h->width?1:sizeof widths/sizeof widths[0];
+	ht=h->height?h->height:512;
+	for(i=0;i<n;i++) {
+		double secs[3]={0,0,0};
+		unsigned j;
+
+		w=h->width?h->width:widths[i];
+		for(k=0;k<3;k++) {
+			cmd_t c;
+
+			e[k]=start_engine(h,"layout",w,ht);
+			if(!e[k]) {
+				while(k>0) {
+					engine_destroy(e[--k]);
+				}
+				return 1;
+			}
+			c.type=CMD_LAYOUT;
+			c.u.layout=k;
+			engine_post(e[k],&c);
+			engine_update(e[k],0);
+		}
+		fprintf(h->out,"layout: %d x %d, %u droplets, %d reps of %d ticks each way\n",w,ht,
+			e[0]->num_drops,h->reps,h->ticks);
+		for(k=0;k<3;k++) {
+			time_ticks(h,e[k]);
+		}
+		for(r=0;r<h->reps;r++) {
+			/* Each rep starts with the next one, so it's even */
+			for(k=0;k<3;k++) {
+				secs[(r+k)%3]+=time_ticks(h,e[(r+k)%3]);
+			}
+		}
+		for(k=0;k<3;k++) {
+			fprintf(h->out,"%-12s %9.0f ticks/s  stride %5u  %+.1f%% time per tick\n",names[k],
+				h->reps*h->ticks/secs[k],e[k]->stride,(secs[k]/secs[0]-1)*100);
+		}
+		for(k=1;k<3;k++) {
+			unsigned wrong=0;
+
+			for(j=0;j<e[0]->num_drops&&j<e[k]->num_drops;j++) {
+				int x0,y0,x,y;
+
+				engine_cell_xy(e[0],e[0]->drops[j*2],&x0,&y0);
+				engine_cell_xy(e[k],e[k]->drops[j*2],&x,&y);
+				wrong+=x!=x0||y!=y0;
+			}
+			if(wrong||e[0]->num_drops!=e[k]->num_drops) {
+				fprintf(h->out,"%u droplets aren't where they are with %s!\n",wrong,names[0]);
+				differ=1;
+			}
+		}
+		for(k=0;k<3;k++) {
+			engine_destroy(e[k]);
+		}
+	}
+	return differ;
+}
+
+/* The simulation with and without pools. The first -ticks let the water settle, as
+   nothing's pooled until it has. Pools change the order droplets move in, so the two
+   don't end up quite the same; what has to match is how many there are. */
+static int bench_pools(headless_t *h) {
+	static const char *const names[2]={"no pools","pools"};
+	engine_t *e[2];
+	double secs[2]={0,0};
+	int r,k,w,ht,lost;
+	cmd_t c;
+
+	w=h->width?h->width:1024;
+	ht=h->height?h->height:768;
+	e[0]=start_engine(h,"pools",w,ht);
+	e[1]=e[0]?start_engine(h,"pools",w,ht):0;
+	if(!e[1]) {
+		engine_destroy(e[0]);
+		return 1;
+	}
+	c.type=CMD_POOLS;
+	c.u.pools=1;
+	engine_post(e[1],&c);
+	engine_update(e[1],0);
+	fprintf(h->out,"pools: %d x %d, %u droplets, %d reps of %d ticks each way\n",w,ht,
+		e[0]->num_drops,h->reps,h->ticks);
+	for(k=0;k<2;k++) {
+		time_ticks(h,e[k]);
+	}
+	for(r=0;r<h->reps;r++) {
+		/* Every other rep does pools first, so it's even */
+		for(k=0;k<2;k++) {
+			secs[(r+k)&1]+=time_ticks(h,e[(r+k)&1]);
+		}
+	}
+	for(k=0;k<2;k++) {
+		fprintf(h->out,"%-12s %9.0f ticks/s  %8u moving  %8u pooled  %+.1f%% time per tick\n",
+			names[k],h->reps*h->ticks/secs[k],e[k]->num_drops,e[k]->num_pooled,(secs[k]/secs[0]-1)*100);
+	}
+	lost=e[0]->num_drops!=e[1]->num_drops+e[1]->num_pooled;
+	if(lost) {
+		fprintf(h->out,"Pools have lost droplets!\n");
+	}
+	engine_destroy(e[0]);
+	engine_destroy(e[1]);
+	return lost;
+}
+
+/*
+	arm_levels
+
+	Gets how full each arm of the U-tube in a SWEEP_LAND_VESSELS world is: how many rows,
+	from the bottom up, are more than half water. Counting droplets would say less for the
+	arm the water's falling into, which is full of holes.
+*/
+static void arm_levels(const engine_t *e,const RECT *arms,int *levels) {
+	unsigned i,*rows;
+	int x,y,k;
+
+	rows=calloc(2*e->area_height,sizeof(unsigned));
+	if(!rows) {
+		levels[0]=levels[1]=0;
+		return;
+	}
+	for(i=0;i<e->num_drops;i++) {
+		engine_cell_xy(e,e->drops[i*2],&x,&y);
+		y-=e->bucket_size;
+		for(k=0;k<2;k++) {
+			if(x>=arms[k].left&&x<arms[k].right&&y>=arms[k].top&&y<arms[k].bottom) {
+				rows[k*e->area_height+y]++;
+			}
+		}
+	}
+	for(k=0;k<2;k++) {
+		for(y=arms[k].bottom-1;y>=arms[k].top;y--) {
+			if(rows[k*e->area_height+y]*2<=(unsigned)(arms[k].right-arms[k].left)) {
+				break;
+			}
+		}
+		levels[k]=arms[k].bottom-1-y;
+	}
+	free(rows);
+}
+
+/* A U-tube, filled down one arm from the bucket, with and without pressure. Every tenth of
+   -ticks, a line of how many rows deep each arm is each way; without pressure, the far arm
+   lags a long way behind, and with it, the two should stay level. Then the speed each
+   way. */
+static int bench_pressure(headless_t *h) {
+	static const char *const names[2]={"no pressure","pressure"};
+	engine_t *e[2];
+	double secs[2]={0,0};
+	RECT arms[2];
+	int t,k,w,ht,every,levels[2][2];
+	cmd_t c;
+
+	w=h->width?h->width:640;
+	ht=h->height?h->height:400;
+	for(k=0;k<2;k++) {
+		e[k]=engine_create(w,ht,h->drops,h->seed);
+		if(!e[k]) {
+			fprintf(h->out,"pressure: couldn't create %d x %d engine\n",w,ht);
+			engine_destroy(e[0]);
+			return 1;
+		}
+		sweep_draw_land(e[k],SWEEP_LAND_VESSELS);
+		c.type=CMD_PAUSE;
+		c.u.paused=0;
+		engine_post(e[k],&c);
+		c.type=CMD_PRESSURE;
+		c.u.pressure=k;
+		engine_post(e[k],&c);
+		engine_update(e[k],0);
+	}
+	sweep_vessels(w,ht,arms);
+	every=max(h->ticks/10,1);
+	fprintf(h->out,"pressure: %d x %d, %u droplets, %d ticks\n",w,ht,e[0]->num_drops,h->ticks);
+	fprintf(h->out,"%8s %25s %25s\n","",names[0],names[1]);
+	fprintf(h->out,"%8s %12s %12s %12s %12s\n","tick","left","right","left","right");
+	for(t=0;t<h->ticks;t+=every) {
+		for(k=0;k<2;k++) {
+			double start=now();
+			int i;
+
+			for(i=0;i<every;i++) {
+				engine_update(e[k],1);
+			}
+			secs[k]+=now()-start;
+			arm_levels(e[k],arms,levels[k]);
+		}
+		fprintf(h->out,"%8d %12d %12d %12d %12d\n",t+every,levels[0][0],levels[0][1],
+			levels[1][0],levels[1][1]);
+		fflush(h->out);
+	}
+	for(k=0;k<2;k++) {
+		fprintf(h->out,"%-12s %9.0f ticks/s  %9u moved by pressure\n",names[k],
+			(h->ticks+every-1)/every*every/secs[k],e[k]->pressure_moves);
+	}
+	engine_destroy(e[0]);
+	engine_destroy(e[1]);
+	return 0;
+}
+
+/*
+	touched_per_tick
+
+	Works out how many bytes a tick has to look at, at least: each droplet's 8 bytes, read
+	and written, and each 64-byte line of the grid with a droplet in, or above or below
+	one, read and written. That's if each were only fetched once; how close a tick comes
+	to that is down to the order the droplets are in. Rows layouts only.
+*/
+static double touched_per_tick(const engine_t *e) {
+	unsigned lines,i,k,n=0,stride=e->stride,*bits;
+
+	lines=(unsigned)((e->area_height+e->bucket_size)*stride/64+2);
+	bits=calloc(lines/32+1,sizeof(unsigned));
+	if(!bits) {
+		return 0;
+	}
+	for(i=0;i<e->num_drops;i++) {
+		for(k=0;k<3;k++) {
+			/* One line before the grid, for the guard row */
+			unsigned line=(e->drops[i*2]+k*stride)/64;
+
+			if(!(bits[line/32]&1<<line%32)) {
+				bits[line/32]|=1<<line%32;
+				n++;
+			}
+		}
+	}
+	free(bits);
+	return (e->num_drops*8.+n*64.)*2;
+}
+
+/* The simulation with droplets in whatever order they've got into, and sorted by row every
+   so often (see sort_drops). The first -ticks mix the droplets up, as they are after a
+   long run; then the two take turns. Speed is also given as bytes looked at per second,
+   from touched_per_tick. */
+static int bench_order(headless_t *h) {
+	static const char *const names[2]={"any order","row order"};
+	engine_t *e[2];
+	double secs[2]={0,0},bytes;
+	int r,k,w,ht;
+	cmd_t c;
+
+	w=h->width?h->width:4096;
+	ht=h->height?h->height:4096;
+	e[0]=start_engine(h,"order",w,ht);
+	e[1]=e[0]?start_engine(h,"order",w,ht):0;
+	if(!e[1]) {
+		engine_destroy(e[0]);
+		return 1;
+	}
+	c.type=CMD_ROW_ORDER;
+	c.u.row_order=1;
+	engine_post(e[1],&c);
+	engine_update(e[1],0);
+	fprintf(h->out,"order: %d x %d, %u droplets, %d reps of %d ticks each way\n",w,ht,
+		e[0]->num_drops,h->reps,h->ticks);
+	for(k=0;k<2;k++) {
+		time_ticks(h,e[k]);
+	}
+	for(r=0;r<h->reps;r++) {
+		for(k=0;k<2;k++) {
+			secs[(r+k)&1]+=time_ticks(h,e[(r+k)&1]);
+		}
+	}
+	for(k=0;k<2;k++) {
+		bytes=touched_per_tick(e[k]);
+		fprintf(h->out,"%-12s %9.0f ticks/s  %8.1f MB per tick  %7.2f GB/s  %+.1f%% time per tick\n",
+			names[k],h->reps*h->ticks/secs[k],bytes/1e6,bytes*h->reps*h->ticks/secs[k]/1e9,
+			(secs[k]/secs[0]-1)*100);
+	}
+	engine_destroy(e[0]);
+	engine_destroy(e[1]);
+	return 0;
+}
+
+/* The simulation with the world in ordinary memory, then in files (in -mapped DIR, or the
+   temporary folder), one after the other, so they're not fighting over RAM. Defaults to
+   8K x 8K; make it bigger than RAM to see it slow down rather than stop. If it's too big
+   for memory, that's said, and the files get a go anyway. Each rep of the mapped world
+   says how much paging it did. */
+static int bench_mapped(headless_t *h) {
+	static const char *const names[2]={"memory","mapped"};
+	const char *given=h->map_dir,*dir=given;
+	char temp[MAX_PATH];
+	map_stats_t last,stats;
+	engine_t *e;
+	double secs;
+	int r,k,w,ht;
+
+	w=h->width?h->width:8192;
+	ht=h->height?h->height:8192;
+	if(!dir) {
+		if(!GetTempPath(sizeof(temp),temp)) {
+			fprintf(h->out,"mapped: no temporary folder; use -mapped DIR\n");
+			return 1;
+		}
+		dir=temp;
+	}
+	fprintf(h->out,"mapped: %d x %d, %u droplets, %d reps of %d ticks each way, files in %s\n",
+		w,ht,h->drops,h->reps,h->ticks,dir);
+	for(k=0;k<2;k++) {
+		h->map_dir=k?dir:0;
+		e=start_engine(h,names[k],w,ht);
+		if(!e) {
+			continue;
+		}
+		/* Let the water get going first */
+		time_ticks(h,e);
+		engine_map_stats(e,&last);
+		for(r=0;r<h->reps;r++) {
+			secs=time_ticks(h,e);
+			engine_map_stats(e,&stats);
+			fprintf(h->out,"%-8s %9.0f ticks/s",names[k],h->ticks/secs);
+			if(stats.mapped) {
+				fprintf(h->out,"  %8u faults  %7.1f MB read  %7.1f MB written  %4u/%u bands let go  +%u/-%u",
+					stats.page_faults-last.page_faults,
+					(double)(stats.read_bytes-last.read_bytes)/1e6,
+					(double)(stats.write_bytes-last.write_bytes)/1e6,
+					stats.quiet_bands,stats.num_bands,
+					stats.prefetches-last.prefetches,stats.evictions-last.evictions);
+			}
+			fprintf(h->out,"\n");
+			fflush(h->out);
+			last=stats;
+		}
+		engine_destroy(e);
+	}
+	h->map_dir=given;
+	return 0;
+}
+
+/* The hash of the water (see engine_t), as a log of a run: two engines the same, and one
+   with row order, ticked in step. The first's hash is printed every -every ticks, and
+   checked against one worked out from scratch; the other two are compared with it every
+   tick. Row order moves the droplets in another order, so that one should part company
+   as soon as it first sorts them, which shows the hash catches it. */
+static int bench_hash(headless_t *h) {
+	static const char *const names[2]={"same again","row order"};
+	engine_t *e[3];
+	unsigned parted[3]={0,0,0},wrong=0;
+	int t,k,w,ht;
+	ULONGLONG x;
+	cmd_t c;
+
+	w=h->width?h->width:640;
+	ht=h->height?h->height:400;
+	for(k=0;k<3;k++) {
+		e[k]=start_engine(h,"hash",w,ht);
+		if(!e[k]) {
+			while(k-->0) {
+				engine_destroy(e[k]);
+			}
+			return 1;
+		}
+	}
+	c.type=CMD_ROW_ORDER;
+	c.u.row_order=1;
+	engine_post(e[2],&c);
+	engine_update(e[2],0);
+	fprintf(h->out,"hash: %d x %d, %u droplets, %d ticks\n",w,ht,e[0]->num_drops,h->ticks);
+	fprintf(h->out,"    tick hash\n");
+	for(t=1;t<=h->ticks;t++) {
+		for(k=0;k<3;k++) {
+			engine_update(e[k],1);
+		}
+		for(k=1;k<3;k++) {
+			if(!parted[k]&&e[k]->hash!=e[0]->hash) {
+				parted[k]=t;
+			}
+		}
+		if(t%h->every==0) {
+			x=engine_hash(e[0]);
+			if(!wrong&&x!=e[0]->hash) {
+				wrong=t;
+			}
+			fprintf(h->out,"%8d %08X%08X\n",t,(unsigned)(e[0]->hash>>32),(unsigned)e[0]->hash);
+		}
+	}
+	for(k=1;k<3;k++) {
+		if(parted[k]) {
+			fprintf(h->out,"%-12s differs from tick %u\n",names[k-1],parted[k]);
+		} else {
+			fprintf(h->out,"%-12s agrees for all %d ticks\n",names[k-1],h->ticks);
+		}
+	}
+	if(wrong) {
+		fprintf(h->out,"Hash doesn't match the water at tick %u!\n",wrong);
+	}
+	for(k=0;k<3;k++) {
+		engine_destroy(e[k]);
+	}
+	return wrong||parted[1];
+}
+
+/* One world of a sweep; see sweep.c. -ticks is how long it runs for. */
+static int bench_world(headless_t *h) {
+	sweep_world_t w;
+	char line[256];
+	int r;
+
+	w.width=h->width?h->width:640;
+	w.height=h->height?h->height:400;
+	w.drops=h->drops;
+	w.neck=h->neck;
+	w.seed=h->seed;
+	w.land=h->land;
+	w.ticks=h->ticks;
+	r=sweep_world(&w,line,sizeof(line));
+	fprintf(h->out,"%s\n",line);
+	return r;
+}
+
+static int run_bench(headless_t *h,const char *name) {
+	const bench_t *b;
+
+	if(!name) {
+		name="";
+	}
+	for(b=benches;b->name;b++) {
+		if(strcmp(b->name,name)==0) {
+			fprintf(h->out,"cpu: %s (has %s), render: %s\n",cpu_name(cpu_best()),
+				cpu_name(cpu_detected()),render_name(render_get()));
+			return (*b->func)(h);
+		}
+	}
+	fprintf(h->out,"Unknown benchmark \"%s\". Benchmarks are:\n",name);
+	for(b=benches;b->name;b++) {
+		fprintf(h->out,"\t%-12s%s\n",b->name,b->what);
+	}
+	return 1;
+}
+
+/*
+	open_output
+
+	GUI programs don't normally have anywhere for stdout to go. If it's been redirected,
+	fine; otherwise, try the console of whatever started us.
+*/
+static FILE *open_output(const char *name) {
+	if(name) {
+		return fopen(name,"wt");
+	}
+	if(!GetStdHandle(STD_OUTPUT_HANDLE)&&AttachConsole(ATTACH_PARENT_PROCESS)) {
+		freopen("CONOUT$","wt",stdout);
+	}
+	return stdout;
+}
+
+/*
+	headless_main
+
+	Runs the headless driver.
+
+	cmd_line -> command line, as passed to WinMain
+
+	Return: exit code: 0 if OK, non-0 if something went wrong.
+*/
+int headless_main(const char *cmd_line) {
+	headless_t h;
+	const char *out_name=0,*bench=0,*spec=0,*cpu=0;
+	int i,r,jobs=0;
+
+	split_args(&h,cmd_line);
+	h.width=h.height=0;
+	h.bpp=0;
+	h.reps=5;
+	h.ticks=1000;
+	h.drops=100000;
+	h.every=10;
+	h.step=1;
+	h.image="heat.bmp";
+	h.neck=5;
+	h.seed=1;
+	h.land=SWEEP_LAND_SHELVES;
+	h.map_dir=0;
+	for(i=0;i<h.argc;i++) {
+		const char *a=h.argv[i],*v=i+1<h.argc?h.argv[i+1]:0;
+
+		if(strcmp(a,"-bench")==0&&v) {
+			bench=v;
+			i++;
+		} else if(strcmp(a,"-size")==0&&v) {
+			if(sscanf(v,"%dx%d",&h.width,&h.height)!=2) {
+				h.width=h.height=0;
+			}
+			i++;
+		} else if(strcmp(a,"-bpp")==0&&v) {
+			h.bpp=atoi(v);
+			i++;
+		} else if(strcmp(a,"-reps")==0&&v) {
+			h.reps=max(atoi(v),1);
+			i++;
+		} else if(strcmp(a,"-ticks")==0&&v) {
+			h.ticks=max(atoi(v),1);
+			i++;
+		} else if(strcmp(a,"-drops")==0&&v) {
+			h.drops=strtoul(v,0,0);
+			i++;
+		} else if(strcmp(a,"-every")==0&&v) {
+			h.every=max(atoi(v),1);
+			i++;
+		} else if(strcmp(a,"-step")==0&&v) {
+			h.step=max(atoi(v),1);
+			i++;
+		} else if(strcmp(a,"-image")==0&&v) {
+			h.image=v;
+			i++;
+		} else if(strcmp(a,"-neck")==0&&v) {
+			h.neck=atoi(v);
+			i++;
+		} else if(strcmp(a,"-seed")==0&&v) {
+			h.seed=strtoul(v,0,0);
+			i++;
+		} else if(strcmp(a,"-land")==0&&v) {
+			h.land=sweep_land(v);
+			i++;
+		} else if(strcmp(a,"-sweep")==0&&v) {
+			spec=v;
+			i++;
+		} else if(strcmp(a,"-jobs")==0&&v) {
+			jobs=atoi(v);
+			i++;
+		} else if(strcmp(a,"-mapped")==0&&v) {
+			h.map_dir=v;
+			i++;
+		} else if(strcmp(a,"-cpu")==0&&v) {
+			cpu=v;
+			i++;
+		} else if(strcmp(a,"-o")==0&&v) {
+			out_name=v;
+			i++;
+		}
+	}
+	h.out=open_output(out_name);
+	if(!h.out) {
+		free(h.args);
+		return 1;
+	}
+	if(h.bpp!=0&&h.bpp!=8&&h.bpp!=16&&h.bpp!=32) {
+		fprintf(h.out,"Unsupported bpp: %d\n",h.bpp);
+		r=1;
+	} else if(cpu&&!cpu_set_limit(cpu_find(cpu))) {
+		fprintf(h.out,"-cpu: %s isn't an instruction set this CPU has\n",cpu);
+		r=1;
+	} else if(spec) {
+		r=sweep_main(spec,jobs,h.out);
+	} else {
+		r=run_bench(&h,bench);
+	}
+	fflush(h.out);
+	if(h.out!=stdout) {
+		fclose(h.out);
+	}
+	free(h.args);
+	return r;
+}
@@ -0,0 +1,7 @@
+#ifndef TOM_HEADLESS_H
+#define TOM_HEADLESS_H
+
+int headless_wanted(const char *cmd_line);
+int headless_main(const char *cmd_line);
+
+#endif
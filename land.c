@@ -0,0 +1,873 @@
+/* Landscape rasteriser. Draws straight into locked landscape memory, rather than going via GDI. */
+#include <windows.h>
+#include <ddraw.h>
+#include <math.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <emmintrin.h>
+#include "debug.h"
+#include "land.h"
+
+/*
+	mask_shift
+
+	Returns the position of the lowest set bit in a colour mask, and the number of bits set.
+*/
+static void mask_shift(DWORD mask,int *shift,int *bits) {
+	*shift=0;
+	*bits=0;
+	if(!mask) {
+		return;
+	}
+	while(!(mask&1)) {
+		mask>>=1;
+		++*shift;
+	}
+	while(mask&1) {
+		mask>>=1;
+		++*bits;
+	}
+}
+
+static DWORD scale_component(DWORD mask,int value) {
+	int shift,bits;
+
+	mask_shift(mask,&shift,&bits);
+	return (((DWORD)value*((1<<bits)-1)+127)/255)<<shift;
+}
+
+/*
+	land_colour
+
+	Converts a COLORREF into a value suitable for writing to a surface of the given pixel format.
+
+	pf -> pixel format of surface
+	c -> colour to convert
+
+	Return: value to write.
+*/
+DWORD land_colour(const DDPIXELFORMAT *pf,COLORREF c) {
+	return scale_component(pf->dwRBitMask,GetRValue(c))|
+		scale_component(pf->dwGBitMask,GetGValue(c))|
+		scale_component(pf->dwBBitMask,GetBValue(c));
+}
+
+/*
+	land_alloc
+
+	Fills in a DDSURFACEDESC describing a chunk of ordinary memory, as if it were a locked
+	surface, so everything in here works on it. Pitch is rounded up to 16 bytes. The memory
+	isn't cleared. Free with land_free.
+
+	ds -> DDSURFACEDESC to fill in
+	w,h -> size in pixels
+	pf -> pixel format
+
+	Return: non-0 if OK, 0 if there's not enough memory.
+*/
+int land_alloc(DDSURFACEDESC *ds,int w,int h,const DDPIXELFORMAT *pf) {
+	memset(ds,0,sizeof(*ds));
+	ds->dwSize=sizeof(*ds);
+	ds->dwWidth=w;
+	ds->dwHeight=h;
+	ds->lPitch=(w*(pf->dwRGBBitCount/8)+15)&~15;
+	ds->ddpfPixelFormat=*pf;
+	ds->lpSurface=_aligned_malloc((size_t)ds->lPitch*h,16);
+	return ds->lpSurface!=0;
+}
+
+/*
+	land_alloc_cells
+
+	Same as land_alloc, for a surface of cells (CELL_xxx), one byte each.
+*/
+int land_alloc_cells(DDSURFACEDESC *ds,int w,int h) {
+	DDPIXELFORMAT pf;
+
+	memset(&pf,0,sizeof(pf));
+	pf.dwSize=sizeof(pf);
+	pf.dwFlags=DDPF_PALETTEINDEXED8;
+	pf.dwRGBBitCount=8;
+	return land_alloc(ds,w,h,&pf);
+}
+
+/* Mapped surfaces: the file's handle goes at the start of the view, the surface this far in.
+   dwReserved says which kind a surface is. */
+#define MAPPED_HEADER (16)
+
+/*
+	land_alloc_mapped
+
+	Same as land_alloc_cells, but the memory is a view of a temporary file, so it needn't
+	all fit in RAM: Windows pages it in and out as it's used, and writes it back to the file
+	rather than the page file. The file's deleted when the surface is freed, with land_free.
+
+	dir -> folder for the file
+
+	Return: non-0 if OK, 0 if the file couldn't be made or mapped.
+*/
+int land_alloc_mapped(DDSURFACEDESC *ds,int w,int h,const char *dir) {
+	char name[MAX_PATH];
+	HANDLE file,mapping;
+	ULONGLONG size;
+	BYTE *base=0;
+
+	memset(ds,0,sizeof(*ds));
+	ds->dwSize=sizeof(*ds);
+	ds->dwWidth=w;
+	ds->dwHeight=h;
+	ds->lPitch=(w+15)&~15;
+	ds->ddpfPixelFormat.dwSize=sizeof(ds->ddpfPixelFormat);
+	ds->ddpfPixelFormat.dwFlags=DDPF_PALETTEINDEXED8;
+	ds->ddpfPixelFormat.dwRGBBitCount=8;
+	if(!GetTempFileName(dir,"ww",0,name)) {
+		dprintf("land_alloc_mapped: no temporary file in \"%s\"\n",dir);
+		return 0;
+	}
+	file=CreateFile(name,GENERIC_READ|GENERIC_WRITE,0,0,CREATE_ALWAYS,
+		FILE_ATTRIBUTE_TEMPORARY|FILE_FLAG_DELETE_ON_CLOSE,0);
+	if(file==INVALID_HANDLE_VALUE) {
+		DeleteFile(name);
+		return 0;
+	}
+	size=(ULONGLONG)ds->lPitch*h+MAPPED_HEADER;
+	mapping=CreateFileMapping(file,0,PAGE_READWRITE,(DWORD)(size>>32),(DWORD)size,0);
+	if(mapping) {
+		base=MapViewOfFile(mapping,FILE_MAP_ALL_ACCESS,0,0,(SIZE_T)size);
+		/* The view keeps the mapping going */
+		CloseHandle(mapping);
+	}
+	if(!base) {
+		dprintf("land_alloc_mapped: couldn't map %d x %d\n",w,h);
+		CloseHandle(file);
+		return 0;
+	}
+	*(HANDLE *)base=file;
+	ds->lpSurface=base+MAPPED_HEADER;
+	ds->dwReserved=1;
+	return 1;
+}
+
+void land_free(DDSURFACEDESC *ds) {
+	if(ds->dwReserved&&ds->lpSurface) {
+		BYTE *base=(BYTE *)ds->lpSurface-MAPPED_HEADER;
+		HANDLE file=*(HANDLE *)base;
+
+		UnmapViewOfFile(base);
+		CloseHandle(file);
+	} else {
+		_aligned_free(ds->lpSurface);
+	}
+	ds->lpSurface=0;
+	ds->dwReserved=0;
+}
+
+/*
+	land_union_rect
+
+	Grows a rectangle to include another. Unlike UnionRect, an empty dest is treated as
+	nothing at all, rather than a point at (0,0).
+
+	dest -> rectangle to grow
+	src -> rectangle to include
+*/
+void land_union_rect(RECT *dest,const RECT *src) {
+	if(src->right<=src->left||src->bottom<=src->top) {
+		return;
+	}
+	if(dest->right<=dest->left||dest->bottom<=dest->top) {
+		*dest=*src;
+		return;
+	}
+	dest->left=min(dest->left,src->left);
+	dest->top=min(dest->top,src->top);
+	dest->right=max(dest->right,src->right);
+	dest->bottom=max(dest->bottom,src->bottom);
+}
+
+/* Spans shorter than this many bytes aren't worth setting up SSE for. */
+#define SSE_FILL_MIN (64)
+
+/*
+	fill_bytes
+
+	Fills n bytes at p with a 32-bit pattern, 16 bytes at a time. p must be aligned to
+	the size of the pixels making up the pattern, and n a multiple of it.
+
+	If stream is non-0, uses non-temporal stores, which are better if the data won't be
+	looked at again soon (i.e., the whole landscape is being filled).
+*/
+static void fill_bytes(BYTE *p,DWORD pattern,size_t n,int stream) {
+	__m128i v;
+	BYTE *end=p+n;
+
+	if(!pattern) {
+		memset(p,0,n);
+		return;
+	}
+	/* Head, up to 16-byte alignment. Pattern is made of 2- or 4-byte pixels, and p is
+	   aligned to the pixel size, so the pattern is in the right phase afterwards. */
+	while(((UINT_PTR)p&15)&&p<end) {
+		if(((UINT_PTR)p&3)==0&&end-p>=4) {
+			*(DWORD *)p=pattern;
+			p+=4;
+		} else {
+			*(WORD *)p=(WORD)pattern;
+			p+=2;
+		}
+	}
+	v=_mm_set1_epi32((int)pattern);
+	if(stream) {
+		for(;end-p>=64;p+=64) {
+			_mm_stream_si128((__m128i *)p,v);
+			_mm_stream_si128((__m128i *)(p+16),v);
+			_mm_stream_si128((__m128i *)(p+32),v);
+			_mm_stream_si128((__m128i *)(p+48),v);
+		}
+	} else {
+		for(;end-p>=64;p+=64) {
+			_mm_store_si128((__m128i *)p,v);
+			_mm_store_si128((__m128i *)(p+16),v);
+			_mm_store_si128((__m128i *)(p+32),v);
+			_mm_store_si128((__m128i *)(p+48),v);
+		}
+	}
+	for(;end-p>=16;p+=16) {
+		_mm_store_si128((__m128i *)p,v);
+	}
+	/* Tail */
+	for(;end-p>=4;p+=4) {
+		*(DWORD *)p=pattern;
+	}
+	if(p<end) {
+		*(WORD *)p=(WORD)pattern;
+	}
+}
+
+/*
+	fill_span
+
+	Fills pixels x1 to x2 inclusive of a row.
+*/
+static void fill_span(BYTE *row,int bpp,DWORD colour,int x1,int x2) {
+	int x;
+
+	switch(bpp) {
+	case 1:
+		memset(row+x1,(BYTE)colour,x2-x1+1);
+		break;
+	case 2:
+		if((x2-x1+1)*2>=SSE_FILL_MIN) {
+			fill_bytes(row+x1*2,(colour&0xFFFF)|(colour<<16),(x2-x1+1)*2,0);
+		} else {
+			WORD *p=(WORD *)row;
+
+			for(x=x1;x<=x2;x++) {
+				p[x]=(WORD)colour;
+			}
+		}
+		break;
+	case 4:
+		if((x2-x1+1)*4>=SSE_FILL_MIN) {
+			fill_bytes(row+x1*4,colour,(x2-x1+1)*4,0);
+		} else {
+			DWORD *p=(DWORD *)row;
+
+			for(x=x1;x<=x2;x++) {
+				p[x]=colour;
+			}
+		}
+		break;
+	}
+}
+
+static void put_pixel(BYTE *row,int bpp,DWORD colour,int x) {
+	switch(bpp) {
+	case 1:
+		row[x]=(BYTE)colour;
+		break;
+	case 2:
+		((WORD *)row)[x]=(WORD)colour;
+		break;
+	case 4:
+		((DWORD *)row)[x]=colour;
+		break;
+	}
+}
+
+/* Accumulates the bounds of everything drawn by a single call. */
+typedef struct {
+	int x1,y1,x2,y2;					/* inclusive */
+}bounds_t;
+
+static void bounds_init(bounds_t *b) {
+	b->x1=b->y1=INT_MAX;
+	b->x2=b->y2=INT_MIN;
+}
+
+static void span(DDSURFACEDESC *ds,int bpp,DWORD colour,int y,int x1,int x2,bounds_t *b) {
+	fill_span((BYTE *)ds->lpSurface+y*ds->lPitch,bpp,colour,x1,x2);
+	b->x1=min(b->x1,x1);
+	b->x2=max(b->x2,x2);
+	b->y1=min(b->y1,y);
+	b->y2=max(b->y2,y);
+}
+
+static void bounds_to_dirty(const bounds_t *b,RECT *dirty) {
+	RECT r;
+
+	if(!dirty||b->x1>b->x2) {
+		return;
+	}
+	r.left=b->x1;
+	r.top=b->y1;
+	r.right=b->x2+1;
+	r.bottom=b->y2+1;
+	land_union_rect(dirty,&r);
+}
+
+/*
+	clip_interval
+
+	Narrows [*lo,*hi] to the values of u satisfying k*u>=c. Returns 0 if there are none.
+*/
+static int clip_interval(double k,double c,double *lo,double *hi) {
+	if(k>0) {
+		*lo=max(*lo,c/k);
+	} else if(k<0) {
+		*hi=min(*hi,c/k);
+	} else if(c>0) {
+		return 0;
+	}
+	return *lo<=*hi;
+}
+
+/*
+	thin_line
+
+	1-pixel line, Bresenham style, so that it's 8-connected like the GDI version was.
+*/
+static void thin_line(DDSURFACEDESC *ds,int bpp,const RECT *clip,DWORD colour,int x1,int y1,int x2,int y2,bounds_t *b) {
+	int dx=abs(x2-x1),sx=x1<x2?1:-1;
+	int dy=-abs(y2-y1),sy=y1<y2?1:-1;
+	int err=dx+dy,e2;
+
+	for(;;) {
+		if(x1>=clip->left&&x1<clip->right&&y1>=clip->top&&y1<clip->bottom) {
+			span(ds,bpp,colour,y1,x1,x1,b);
+		}
+		if(x1==x2&&y1==y2) {
+			break;
+		}
+		e2=2*err;
+		if(e2>=dy) {
+			err+=dy;
+			x1+=sx;
+		}
+		if(e2<=dx) {
+			err+=dx;
+			y1+=sy;
+		}
+	}
+}
+
+/*
+	thick_line
+
+	Fills every pixel whose centre is within size/2 of the segment (x1,y1)-(x2,y2). The
+	shape is convex, so each row is a single span; it's worked out as the union of the
+	spans of the two end discs and of the band between them.
+*/
+static void thick_line(DDSURFACEDESC *ds,int bpp,const RECT *clip,DWORD colour,int x1,int y1,int x2,int y2,int size,bounds_t *b) {
+	double r=size*.5;
+	double dx=x2-x1,dy=y2-y1;
+	double len=sqrt(dx*dx+dy*dy);
+	int y,ytop,ybot;
+
+	ytop=(int)ceil(min(y1,y2)-r);
+	ybot=(int)floor(max(y1,y2)+r);
+	ytop=max(ytop,(int)clip->top);
+	ybot=min(ybot,(int)clip->bottom-1);
+	for(y=ytop;y<=ybot;y++) {
+		double lo=1e30,hi=-1e30;
+		double ey;
+		int xl,xr;
+
+		/* End discs */
+		ey=y-y1;
+		if(fabs(ey)<=r) {
+			double half=sqrt(r*r-ey*ey);
+
+			lo=min(lo,x1-half);
+			hi=max(hi,x1+half);
+		}
+		ey=y-y2;
+		if(fabs(ey)<=r) {
+			double half=sqrt(r*r-ey*ey);
+
+			lo=min(lo,x2-half);
+			hi=max(hi,x2+half);
+		}
+		/* Band. u=x-x1; 0<=u*dx+ey*dy<=len^2; |u*dy-ey*dx|<=r*len */
+		if(len>0) {
+			double blo=-1e30,bhi=1e30;
+
+			ey=y-y1;
+			if(clip_interval(dx,-ey*dy,&blo,&bhi)&&
+				clip_interval(-dx,ey*dy-len*len,&blo,&bhi)&&
+				clip_interval(-dy,-r*len-ey*dx,&blo,&bhi)&&
+				clip_interval(dy,-r*len+ey*dx,&blo,&bhi))
+			{
+				lo=min(lo,x1+blo);
+				hi=max(hi,x1+bhi);
+			}
+		}
+		if(lo>hi) {
+			continue;
+		}
+		xl=max((int)ceil(lo),(int)clip->left);
+		xr=min((int)floor(hi),(int)clip->right-1);
+		if(xl<=xr) {
+			span(ds,bpp,colour,y,xl,xr,b);
+		}
+	}
+}
+
+/*
+	land_stroke
+
+	Draws a line of the given thickness with round ends, as a GDI PS_SOLID pen would.
+
+	ds -> locked landscape surface
+	clip -> drawing is restricted to this rectangle (right and bottom exclusive)
+	colour -> value to write, as per land_colour
+	x1,y1 -> start point
+	x2,y2 -> end point
+	size -> thickness in pixels
+	dirty -> if not NULL, grown to include the area drawn
+
+	Return: void
+*/
+void land_stroke(DDSURFACEDESC *ds,const RECT *clip,DWORD colour,int x1,int y1,int x2,int y2,int size,RECT *dirty) {
+	int bpp=ds->ddpfPixelFormat.dwRGBBitCount/8;
+	bounds_t b;
+
+	bounds_init(&b);
+	if(size<=1) {
+		thin_line(ds,bpp,clip,colour,x1,y1,x2,y2,&b);
+	} else {
+		thick_line(ds,bpp,clip,colour,x1,y1,x2,y2,size,&b);
+	}
+	bounds_to_dirty(&b,dirty);
+}
+
+/*
+	land_disc
+
+	Stamps a single dab of the brush. Equivalent to land_stroke with both ends the same.
+*/
+void land_disc(DDSURFACEDESC *ds,const RECT *clip,DWORD colour,int x,int y,int size,RECT *dirty) {
+	land_stroke(ds,clip,colour,x,y,x,y,size,dirty);
+}
+
+/*
+	land_hline
+
+	Draws a horizontal line, clipped to the surface.
+
+	ds -> locked surface
+	colour -> value to write
+	y -> row
+	x1,x2 -> ends of line, inclusive; x1<=x2
+*/
+void land_hline(DDSURFACEDESC *ds,DWORD colour,int y,int x1,int x2) {
+	x1=max(x1,0);
+	x2=min(x2,(int)ds->dwWidth-1);
+	if(y<0||y>=(int)ds->dwHeight||x1>x2) {
+		return;
+	}
+	fill_span((BYTE *)ds->lpSurface+y*ds->lPitch,ds->ddpfPixelFormat.dwRGBBitCount/8,colour,x1,x2);
+}
+
+/*
+	land_reset
+
+	Fills the whole landscape in a single pass: border all round, the neck of the bucket
+	in the top edge, the hole in the bottom edge, and everything inside set to a given
+	colour. Used for both Erase (fill with 0) and Fill.
+
+	ds -> locked landscape surface
+	fill -> value to write inside the border
+	border -> value to write for the border
+	neck_size -> size of bucket's neck, as per stuff_t::bucket_neck_size
+
+	Return: void
+*/
+void land_reset(DDSURFACEDESC *ds,DWORD fill,DWORD border,int neck_size) {
+	int bpp=ds->ddpfPixelFormat.dwRGBBitCount/8;
+	int w=ds->dwWidth,h=ds->dwHeight;
+	int cx=w/2,y;
+	DWORD pattern;
+	BYTE *row;
+
+	if(w<3||h<3) {
+		return;
+	}
+	switch(bpp) {
+	case 1:
+		pattern=(fill&0xFF)*0x01010101;
+		break;
+	case 2:
+		pattern=(fill&0xFFFF)|(fill<<16);
+		break;
+	default:
+		pattern=fill;
+		break;
+	}
+	/* Top edge, with neck */
+	row=ds->lpSurface;
+	fill_span(row,bpp,border,0,w-1);
+	fill_span(row,bpp,0,max(cx-(neck_size-1),0),min(cx+(neck_size-1),w-1));
+	/* Interior */
+	for(y=1;y<h-1;y++) {
+		row+=ds->lPitch;
+		put_pixel(row,bpp,border,0);
+		if(bpp==1) {
+			memset(row+1,(BYTE)fill,w-2);
+		} else {
+			fill_bytes(row+bpp,pattern,(w-2)*bpp,1);
+		}
+		put_pixel(row,bpp,border,w-1);
+	}
+	_mm_sfence();
+	/* Bottom edge, with hole */
+	row+=ds->lPitch;
+	fill_span(row,bpp,border,0,w-1);
+	put_pixel(row,bpp,0,cx);
+}
+
+/*
+	Flood fill.
+
+	This is Heckbert's span-based seed fill (Graphics Gems, 1990), with an explicit stack of
+	spans still to look at. Each entry is a span of the row above or below one that's just
+	been filled, plus the direction it was found in. Runs of matching pixels are found with
+	SSE2 compares, and filled with fill_span.
+*/
+
+typedef struct {
+	int y;								/* row to look at */
+	int x1,x2;							/* parent span, inclusive */
+	int dy;								/* direction from parent */
+}flood_span_t;
+
+typedef struct {
+	flood_span_t *spans;
+	int num,max;
+	int ymin,ymax;
+}flood_stack_t;
+
+static int flood_push(flood_stack_t *st,int y,int x1,int x2,int dy) {
+	if(y+dy<st->ymin||y+dy>st->ymax) {
+		return 1;
+	}
+	if(st->num==st->max) {
+		int n=st->max?st->max*2:1024;
+		flood_span_t *p=realloc(st->spans,n*sizeof(flood_span_t));
+
+		if(!p) {
+			return 0;
+		}
+		st->spans=p;
+		st->max=n;
+	}
+	st->spans[st->num].y=y+dy;
+	st->spans[st->num].x1=x1;
+	st->spans[st->num].x2=x2;
+	st->spans[st->num].dy=dy;
+	st->num++;
+	return 1;
+}
+
+static DWORD get_pixel(const BYTE *row,int bpp,int x) {
+	switch(bpp) {
+	case 1:
+		return row[x];
+	case 2:
+		return ((const WORD *)row)[x];
+	default:
+		return ((const DWORD *)row)[x];
+	}
+}
+
+/* Index of first 0 bit in the bottom 16 bits of mask, which must have one */
+static int first_clear(int mask) {
+	int i;
+
+	for(i=0;mask&1;i++) {
+		mask>>=1;
+	}
+	return i;
+}
+
+/* Index of last 0 bit in the bottom 16 bits of mask, which must have one */
+static int last_clear(int mask) {
+	int i;
+
+	for(i=15;mask&(1<<i);i--) {
+	}
+	return i;
+}
+
+static __m128i pattern_of(int bpp,DWORD value) {
+	switch(bpp) {
+	case 1:
+		return _mm_set1_epi8((char)value);
+	case 2:
+		return _mm_set1_epi16((short)value);
+	default:
+		return _mm_set1_epi32((int)value);
+	}
+}
+
+/*
+	run_right
+
+	Returns the last x in [x,xmax] such that pixels x..that are all equal to value. Pixel x
+	must be equal to value.
+*/
+static int run_right(const BYTE *row,int bpp,DWORD value,int x,int xmax) {
+	int per=16/bpp;
+	__m128i v=pattern_of(bpp,value);
+
+	while(x+per-1<=xmax) {
+		int m=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row+x*bpp)),v));
+
+		if(m!=0xFFFF) {
+			return x+first_clear(m)/bpp-1;
+		}
+		x+=per;
+	}
+	while(x<=xmax&&get_pixel(row,bpp,x)==value) {
+		x++;
+	}
+	return x-1;
+}
+
+/*
+	run_left
+
+	Returns the first x in [xmin,x] such that pixels that..x are all equal to value. Pixel x
+	must be equal to value.
+*/
+static int run_left(const BYTE *row,int bpp,DWORD value,int x,int xmin) {
+	int per=16/bpp;
+	__m128i v=pattern_of(bpp,value);
+
+	while(x-per+1>=xmin) {
+		int m=_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row+(x-per+1)*bpp)),v));
+
+		if(m!=0xFFFF) {
+			return x-per+1+last_clear(m)/bpp+1;
+		}
+		x-=per;
+	}
+	while(x>=xmin&&get_pixel(row,bpp,x)==value) {
+		x--;
+	}
+	return x+1;
+}
+
+/*
+	land_flood
+
+	Flood fills the 4-connected region of pixels that are the same colour as the one at
+	(x,y).
+
+	ds -> locked landscape surface
+	clip -> filling doesn't go outside this rectangle (right and bottom exclusive)
+	colour -> value to write, as per land_colour
+	x,y -> seed point
+	dirty -> if not NULL, grown to include the area filled
+
+	Return: 0 if memory ran out part way through (in which case the fill is incomplete),
+	otherwise non-0.
+*/
+int land_flood(DDSURFACEDESC *ds,const RECT *clip,DWORD colour,int x,int y,RECT *dirty) {
+	int bpp=ds->ddpfPixelFormat.dwRGBBitCount/8;
+	int xmin=clip->left,xmax=clip->right-1;
+	DWORD old;
+	flood_stack_t st;
+	bounds_t b;
+	int ok=1;
+
+	if(x<clip->left||x>=clip->right||y<clip->top||y>=clip->bottom) {
+		return 1;
+	}
+	switch(bpp) {
+	case 1:
+		colour&=0xFF;
+		break;
+	case 2:
+		colour&=0xFFFF;
+		break;
+	}
+	old=get_pixel((BYTE *)ds->lpSurface+y*ds->lPitch,bpp,x);
+	if(old==colour) {
+		return 1;
+	}
+	bounds_init(&b);
+	st.spans=0;
+	st.num=st.max=0;
+	st.ymin=clip->top;
+	st.ymax=clip->bottom-1;
+	/* Seed pixel, looking down then up */
+	ok=flood_push(&st,y,x,x,1)&&flood_push(&st,y+1,x,x,-1);
+	while(ok&&st.num) {
+		flood_span_t sp=st.spans[--st.num];
+		BYTE *row=(BYTE *)ds->lpSurface+sp.y*ds->lPitch;
+		int l,r;
+
+		x=sp.x1;
+		if(get_pixel(row,bpp,x)==old) {
+			/* Run leaks out past the left end of the parent span: look back the other way too */
+			l=run_left(row,bpp,old,x,xmin);
+			if(l<sp.x1) {
+				ok=ok&&flood_push(&st,sp.y,l,sp.x1-1,-sp.dy);
+			}
+		} else {
+			/* Skip to the next matching pixel within the parent span */
+			for(x++;x<=sp.x2&&get_pixel(row,bpp,x)!=old;x++) {
+			}
+			l=x;
+		}
+		while(x<=sp.x2) {
+			r=run_right(row,bpp,old,x,xmax);
+			span(ds,bpp,colour,sp.y,l,r,&b);
+			ok=ok&&flood_push(&st,sp.y,l,r,sp.dy);
+			if(r>sp.x2) {
+				/* Leaks out past the right end, so look back */
+				ok=ok&&flood_push(&st,sp.y,sp.x2+1,r,-sp.dy);
+			}
+			/* r+1 is known not to match */
+			for(x=r+2;x<=sp.x2&&get_pixel(row,bpp,x)!=old;x++) {
+			}
+			l=x;
+		}
+	}
+	free(st.spans);
+	bounds_to_dirty(&b,dirty);
+	return ok;
+}
+
+/*
+	land_copy
+
+	Copies part of one surface to another of the same pixel format, a row at a time.
+
+	dest -> surface to write to
+	clip -> part of dest that may be written to
+	x,y -> where in dest the top left of src_rect goes
+	src -> surface to read from
+	src_rect -> part of src to copy
+*/
+void land_copy(DDSURFACEDESC *dest,const RECT *clip,int x,int y,const DDSURFACEDESC *src,const RECT *src_rect) {
+	int bpp=dest->ddpfPixelFormat.dwRGBBitCount/8;
+	int dx=x-src_rect->left,dy=y-src_rect->top;
+	RECT s,d;
+	int row,n;
+
+	/* Work out where it goes in dest, and clip that to src's bounds as well as clip */
+	d=*src_rect;
+	OffsetRect(&d,dx,dy);
+	SetRect(&s,0,0,src->dwWidth,src->dwHeight);
+	OffsetRect(&s,dx,dy);
+	if(!IntersectRect(&d,&d,&s)||!IntersectRect(&d,&d,clip)) {
+		return;
+	}
+	s=d;
+	OffsetRect(&s,-dx,-dy);
+	n=(d.right-d.left)*bpp;
+	for(row=0;row<d.bottom-d.top;row++) {
+		memcpy((BYTE *)dest->lpSurface+(d.top+row)*dest->lPitch+d.left*bpp,
+			(const BYTE *)src->lpSurface+(s.top+row)*src->lPitch+s.left*bpp,n);
+	}
+}
+
+/*
+	land_scale_coord
+
+	Maps a coordinate in one range to the other, taking the middle of each pixel, as
+	land_scale does.
+
+	i -> coordinate, 0-based within the source range
+	from -> size of source range
+	to -> size of destination range
+*/
+int land_scale_coord(int i,int from,int to) {
+	return (int)(((2*(LONGLONG)i+1)*to)/(2*(LONGLONG)from));
+}
+
+/*
+	land_scale
+
+	Resamples part of one surface into part of another of the same pixel format, nearest
+	neighbour, so no new colours appear. Where successive rows come from the same source
+	row, the previous row is copied rather than resampled again.
+
+	dest -> surface to write to
+	dest_rect -> part of dest to fill; must be within dest
+	src -> surface to read from
+	src_rect -> part of src to read; must be within src
+*/
+void land_scale(DDSURFACEDESC *dest,const RECT *dest_rect,const DDSURFACEDESC *src,const RECT *src_rect) {
+	int bpp=dest->ddpfPixelFormat.dwRGBBitCount/8;
+	int dw=dest_rect->right-dest_rect->left,dh=dest_rect->bottom-dest_rect->top;
+	int sw=src_rect->right-src_rect->left,sh=src_rect->bottom-src_rect->top;
+	int x,y,sy,last_sy=-1;
+	int *xmap;
+	BYTE *d,*last_d=0;
+
+	if(dw<=0||dh<=0||sw<=0||sh<=0) {
+		return;
+	}
+	/* Source column for each dest column */
+	xmap=malloc(dw*sizeof(int));
+	if(!xmap) {
+		return;
+	}
+	for(x=0;x<dw;x++) {
+		xmap[x]=src_rect->left+land_scale_coord(x,dw,sw);
+	}
+	for(y=0;y<dh;y++) {
+		sy=src_rect->top+land_scale_coord(y,dh,sh);
+		d=(BYTE *)dest->lpSurface+(dest_rect->top+y)*dest->lPitch+dest_rect->left*bpp;
+		if(sy==last_sy) {
+			memcpy(d,last_d,dw*bpp);
+		} else {
+			const BYTE *s=(const BYTE *)src->lpSurface+sy*src->lPitch;
+
+			switch(bpp) {
+			case 1:
+				for(x=0;x<dw;x++) {
+					d[x]=s[xmap[x]];
+				}
+				break;
+			case 2:
+				for(x=0;x<dw;x++) {
+					((WORD *)d)[x]=((const WORD *)s)[xmap[x]];
+				}
+				break;
+			case 4:
+				for(x=0;x<dw;x++) {
+					((DWORD *)d)[x]=((const DWORD *)s)[xmap[x]];
+				}
+				break;
+			}
+		}
+		last_sy=sy;
+		last_d=d;
+	}
+	free(xmap);
+}
@@ -0,0 +1,31 @@
+#ifndef TOM_LAND_H
+#define TOM_LAND_H
+
+#include <ddraw.h>
+#include "cells.h"
+
+/* A brush stroke, as queued by the window procedure and drawn by the engine. Coordinates are landscape coordinates. */
+typedef struct stroke_t {
+	int x1,y1;							/* start point */
+	int x2,y2;							/* end point; same as start point for a single dab */
+	int size;							/* brush size in pixels */
+	int cell;							/* brush colour, CELL_xxx */
+	int flood;							/* if non-0, flood fill from (x1,y1) instead */
+}stroke_t;
+
+DWORD land_colour(const DDPIXELFORMAT *pf,COLORREF c);
+int land_alloc(DDSURFACEDESC *ds,int w,int h,const DDPIXELFORMAT *pf);
+int land_alloc_cells(DDSURFACEDESC *ds,int w,int h);
+int land_alloc_mapped(DDSURFACEDESC *ds,int w,int h,const char *dir);
+void land_free(DDSURFACEDESC *ds);
+void land_union_rect(RECT *dest,const RECT *src);
+void land_stroke(DDSURFACEDESC *ds,const RECT *clip,DWORD colour,int x1,int y1,int x2,int y2,int size,RECT *dirty);
+void land_disc(DDSURFACEDESC *ds,const RECT *clip,DWORD colour,int x,int y,int size,RECT *dirty);
+int land_flood(DDSURFACEDESC *ds,const RECT *clip,DWORD colour,int x,int y,RECT *dirty);
+void land_hline(DDSURFACEDESC *ds,DWORD colour,int y,int x1,int x2);
+void land_reset(DDSURFACEDESC *ds,DWORD fill,DWORD border,int neck_size);
+void land_copy(DDSURFACEDESC *dest,const RECT *clip,int x,int y,const DDSURFACEDESC *src,const RECT *src_rect);
+int land_scale_coord(int i,int from,int to);
+void land_scale(DDSURFACEDESC *dest,const RECT *dest_rect,const DDSURFACEDESC *src,const RECT *src_rect);
+
+#endif
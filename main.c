@@ -12,7 +12,13 @@
 #include <math.h>
 #include <stdlib.h>
 #include <time.h>
+#include <ctype.h>
 #include "dx.h"
+#include "land.h"
+#include "engine.h"
+#include "render.h"
+#include "cpu.h"
+#include "headless.h"
 #include "debug.h"
 #include "resource.h"
 #include "strings.h"
@@ -41,6 +47,14 @@
 
 #define CLASS_NAME "wclass_water"
 
+/* Timer used to keep the window up to date while a menu is open or the window is being
+   sized or moved, when the main loop isn't running. */
+#define PRESENT_TIMER (1)
+#define PRESENT_TIMER_MS (15)
+
+/* Timing box shows this many of each gate's latest samples */
+#define GATE_SHOWN_SAMPLES (10)
+
 /* Adds table. See main loop for details. */
 typedef struct {
 	int area_width;						/* width of "play" area */
@@ -49,19 +63,31 @@ typedef struct {
 	int bucket_neck_size;				/* bucket's neck size */
 	int paused;							/* whether water is paused or not */
 	int asm;							/* whether asm lop should be used or not */
-	unsigned update_diff;				/* time (in 1000ths of a second) between updates */
+	engine_t *engine;					/* the simulation, which runs on its own thread */
+	int tick_hz;						/* ticks per second asked for */
+	pace_stats_t stats;					/* engine's timing, as of latest frame */
+	unsigned num_drops;					/* droplets each tick moves on, as of latest frame */
+	gate_stats_t gate_stats;			/* engine's gate counts, as of latest frame */
+	unsigned settled;					/* tick the water stopped at, as of latest frame; 0 if it hasn't */
+	map_stats_t map_stats;				/* engine's storage, as of latest frame */
+	unsigned hash_tick;					/* tick of latest frame */
+	ULONGLONG hash;						/* engine's hash of the water, as of latest frame */
+	stroke_t gates[MAX_GATES];			/* ends of each gate, so they can be drawn */
+	int num_gates;
 
 	/* DirectDraw specifics */
 	int ddraw_valid;					/* whether current ddraw settings valid or not */
 	int ddraw_bad;						/* whether current valid ddraw settings are bad */
 	IDirectDrawSurface2 *primary;		/* surface -- primary (desktop) surface */
-	IDirectDrawSurface2 *land;			/* surface -- landscape */
-	int land_changed;
-	IDirectDrawSurface2 *back;			/* surface -- back (offscreen) surface */
+	IDirectDrawSurface2 *back;			/* surface -- back (offscreen) surface, the view is rendered here */
+	int back_width,back_height;			/* size of back surface; big enough for any window */
 	IDirectDrawClipper *clipper;
 	DDPIXELFORMAT pf;					/* pixel format for primary surface */
 	int dd_bpp;							/* display bytes per pixel */
-	COLORREF *land_backup;
+	palette_t palette;					/* colour of each cell, in the display's format */
+	int colour_scheme;					/* index into schemes[] */
+	const frame_t *frame;				/* latest frame shown, so it can be shown again */
+	RECT frame_view;					/* part of the world frames were last asked to hold */
 
 	/* Window configuration */
 	int window_valid;					/* window size valid or not */
@@ -83,93 +109,62 @@ typedef struct {
 	DWORD lastpoint;					/* last point, in WM_MOUSEMOVE coordinates */
 	int brush_size;						/* brush size in pixels. Erm, sorry!! Logical device units. */
 	int brush_col;						/* brush colour. index into brush_Cols[] etc. above. */
-	int new_num_drops;					/* new number of droplets, to take effect ASAP. If 0, no request for new
-										   droplets has been made. */
+	int flood_tool;						/* if set, clicking flood fills rather than drawing */
+	int gate_tool;						/* if set, dragging adds a gate rather than drawing */
+	int gating;							/* LMB held with gate tool; gate starts at lastpoint */
+	unsigned resize_contents;			/* what resizing does with the contents: IDS_CONTENTS_xxx */
+	int pools;							/* settled water pooled, see CMD_POOLS */
+	int pressure;						/* water levels itself out, see CMD_PRESSURE */
+	int row_order;						/* droplets kept in row order, see CMD_ROW_ORDER */
 	/* Informative messages */
 	char *msg;							/* the text to display */
 	DWORD msg_time;						/* the time at which it should disappear */
-
-	/* Timing */
-	int no_catchup;						/* If true, don't attempt to catch up if it looks as if
-										   updates are lagging behind. */
-
-	/* Droplet data */
-	unsigned pitch;					/* pitch (distance between successive lines) of droplet data */
-	unsigned num_drops;				/* number of droplets*/
-	unsigned *drops;				/* droplet data, 2 unsigneds per droplet. */
-	int droplets_bpp;				/* format of droplet data: 1 (8bpp), 2 (16bpp), 4 (32bpp) */
 }stuff_t;
 
 /*
 	Global variables
 */
 
-/* brush_cols -- map brush type to colour as displayed on screen */
-static COLORREF brush_cols[3]={RGB(200,200,0),RGB(0,255,0),RGB(0,0,0)};
-/* Brush_col_names -- map brush type to entry in string table giving natural language name */
-static unsigned brush_col_names[3]={IDS_BROWN_NAME,IDS_GREEN_NAME,IDS_BLACK_NAME};
-/* brush_accels -- map brush type to accelerator used to select it */
-static unsigned brush_accels[3]={IDA_BRUSHYELLOW,IDA_BRUSHGREEN,IDA_BRUSHBLACK};
-
 /* brush types */
 enum {
-	YELLOW_BRUSH_COLOUR=0,GREEN_BRUSH_COLOUR=1,BLACK_BRUSH_COLOUR=2,
+	YELLOW_BRUSH_COLOUR=0,GREEN_BRUSH_COLOUR=1,BLACK_BRUSH_COLOUR=2,MAGENTA_BRUSH_COLOUR=3,
+	ORANGE_BRUSH_COLOUR=4,NUM_BRUSH_COLOURS
 };
 
-/* Random table. Saves calling rand() */
-/* Size of indices, in bits */
-#define RND_TBL_BITS (13)
-/* Size of random table, in entries */
-#define RND_TBL_SIZE (1<<RND_TBL_BITS)
-/* Mask random table index with this value to clamp to valid range (with wrap) */
-#define RND_TBL_IDX_MASK ((1<<RND_TBL_BITS)-1)
-/* Random table */
-static unsigned dir_tbl[RND_TBL_SIZE];
-
-/* Map droplet type to droplet colour (as in: value to be written to screen memory) */
-static DWORD droplet_colours[2];
-/* Map droplet type to direction (specified as offset in bytes) when on green surface */
-static int droplet_dirs[2];
+/* brush_cells -- map brush type to what it draws */
+static int brush_cells[NUM_BRUSH_COLOURS]={CELL_YELLOW,CELL_GREEN,CELL_EMPTY,CELL_MAGENTA,CELL_ORANGE};
+/* Brush_col_names -- map brush type to entry in string table giving natural language name */
+static unsigned brush_col_names[NUM_BRUSH_COLOURS]={IDS_BROWN_NAME,IDS_GREEN_NAME,IDS_BLACK_NAME,IDS_MAGENTA_NAME,IDS_ORANGE_NAME};
+/* brush_accels -- map brush type to accelerator used to select it */
+static unsigned brush_accels[NUM_BRUSH_COLOURS]={IDA_BRUSHYELLOW,IDA_BRUSHGREEN,IDA_BRUSHBLACK,IDA_BRUSHMAGENTA,IDA_BRUSHORANGE};
+
+/* schemes -- colour of each cell (CELL_xxx order), for each colour scheme */
+#define CLASSIC_COLOUR(NAME,CLASSIC,NIGHT,SLIDE,RED,BLUE) CLASSIC,
+#define NIGHT_COLOUR(NAME,CLASSIC,NIGHT,SLIDE,RED,BLUE) NIGHT,
+static COLORREF schemes[2][NUM_CELLS]={
+	{CELLS(CLASSIC_COLOUR)},
+	{CELLS(NIGHT_COLOUR)},
+};
 
 /*
 	Functions
 */
 
-/* Draw and update droplets, 2 bytes/pixel */
-static void draw_all_droplets16(int mask,void *vstuff,DDSURFACEDESC *ds);
-static void update_all_droplets16(int no_era,void *vstuff,DDSURFACEDESC *ds);
-/* Draw and update droplets, 4 bytes/pixel */
-static void draw_all_droplets32(int mask,void *vstuff,DDSURFACEDESC *ds);
-static void update_all_droplets32(int no_era,void *vstuff,DDSURFACEDESC *ds);
-
-typedef struct funcs_t {
-	unsigned bpp;
-	void (*draw_all_droplets)(int,void *,DDSURFACEDESC *);
-	void (*update_all_droplets)(int,void *,DDSURFACEDESC *);
-	void (*draw_all_droplets_asm)(int,void *,DDSURFACEDESC *);
-	void (*update_all_droplets_asm)(int,void *,DDSURFACEDESC *);
-}funcs_t;
-
-static funcs_t funcsarr[]={
-	{16,draw_all_droplets16,update_all_droplets16,0,0},
-	{32,draw_all_droplets32,update_all_droplets32,0,0},
-	{0}
-};
-
-/* Drawing and update routines for current colour depth, chosen from the above selection */
-static void (*draw_all_droplets)(int,void *,DDSURFACEDESC *)=0;
-static void (*update_all_droplets)(int,void *,DDSURFACEDESC *)=0;
-
-/* Save and restore landscape */
-static void save_land(stuff_t *);
-static int restore_land(stuff_t *);
-
-/* Set number of droplets */
-static void set_drops(stuff_t *stuff,unsigned num_drops);
-/* Draw landscape border on landscape surface */
-static void do_land_border(stuff_t *stuff);
+/* Send commands to the engine */
+static void post_command(stuff_t *stuff,int type);
+static void post_stroke(stuff_t *stuff,int x1,int y1,int x2,int y2,int flood);
+static void post_fill(stuff_t *stuff,int cell);
+static void post_gate(stuff_t *stuff,int x1,int y1,int x2,int y2);
+static void post_pools(stuff_t *stuff);
+static void post_pressure(stuff_t *stuff);
+static void post_row_order(stuff_t *stuff);
+static void set_paused(stuff_t *stuff,int paused);
+/* Copy engine's latest frame to back surface */
+static int present_frame(stuff_t *stuff);
+static void render_frame(stuff_t *stuff,int *width,int *height);
 /* Do WM_PAINT stuff */
 static void paint_window(HWND h_wnd,stuff_t *stuff);
+static void draw_gates(HWND h_wnd,stuff_t *stuff);
 
 /* See do_window_stuff for more details. */
 #define RW_NOSETWINDOWPOS (1)
@@ -177,25 +172,6 @@ static void paint_window(HWND h_wnd,stuff_t *stuff);
 static void reset_window(stuff_t *stuff,HWND h_wnd,unsigned flags);
 static void sizing_window(stuff_t *stuff,HWND h_wnd,RECT *rect,int side);
 
-#ifdef _DEBUG
-static void log_droplets(stuff_t *p,char *file,char *mode) {
-	FILE *h;
-
-	h=fopen(file,mode);
-	if(h) {
-		unsigned i;
-
-		fprintf(h,"There are %u droplets.\n",p->num_drops);
-		fprintf(h,"Pitch is %u.\n",p->pitch);
-		for(i=0;i<p->num_drops;i++) {
-			fprintf(h,"#%u: dw1=0x%08X dw2=0x%08X (X=%u, Y=%u)\n",
-				i,p->drops[i*2],p->drops[i*2+1],p->drops[i*2]%p->pitch,p->drops[i*2]/p->pitch);
-		}
-		fclose(h);
-	}
-}
-#endif
-
 /*
 	set_message
 
@@ -244,10 +220,10 @@ set_brushcolour
 static void set_brushcolour(stuff_t *stuff,int ncolour) {
 	int i;
 
-	for(i=0;i<3;i++) {
+	for(i=0;i<NUM_BRUSH_COLOURS;i++) {
 		CheckMenuItem(stuff->menu,brush_accels[i],MF_BYCOMMAND|MF_UNCHECKED);
 	}
-	if(ncolour>=0&&ncolour<3) {
+	if(ncolour>=0&&ncolour<NUM_BRUSH_COLOURS) {
 		CheckMenuItem(stuff->menu,brush_accels[ncolour],MF_BYCOMMAND|MF_CHECKED);
 		stuff->brush_col=ncolour;
 		set_message(stuff,IDS_BRUSH_COL_MSG,get_string(brush_col_names[ncolour]));
@@ -263,19 +239,96 @@ set_zoom
   nyz -> new Y zoom
   */
 static void set_zoom(stuff_t *stuff,int nxz,int nyz) {
-	static unsigned ids[3]={IDA_ZOOM1,IDA_ZOOM2,IDA_ZOOM3};
+	static const struct {
+		int zoom;
+		unsigned id;
+	}items[]={
+		{1,IDA_ZOOM1},{2,IDA_ZOOM2},{3,IDA_ZOOM3},{4,IDA_ZOOM4},{6,IDA_ZOOM6},{8,IDA_ZOOM8},
+	};
 	int i;
 
 	stuff->w_mul=nxz;
 	stuff->h_mul=nyz;
 	stuff->window_valid=0;
 	set_message(stuff,IDS_ZOOM_MSG,stuff->w_mul,stuff->h_mul);
-	for(i=0;i<3;i++) {
-		CheckMenuItem(stuff->menu,ids[i],MF_BYCOMMAND|MF_UNCHECKED);
+	for(i=0;i<sizeof(items)/sizeof(items[0]);i++) {
+		CheckMenuItem(stuff->menu,items[i].id,MF_BYCOMMAND|((nxz==nyz&&nxz==items[i].zoom)?MF_CHECKED:MF_UNCHECKED));
+	}
+}
+
+/*
+set_speed
+
+  Sets the number of ticks per second, displays suitable message, checks appropriate
+  menu item.
+
+  hz -> new rate, or 0 for turbo
+*/
+static void set_speed(stuff_t *stuff,int hz) {
+	static unsigned ids[5]={ID_SPEED_50,ID_SPEED_100,ID_SPEED_200,ID_SPEED_500,ID_SPEED_TURBO};
+	static int rates[5]={50,100,200,500,0};
+	int i;
+
+	stuff->tick_hz=hz;
+	set_message(stuff,hz?IDS_SPEED_MSG:IDS_TURBO_MSG,hz);
+	for(i=0;i<5;i++) {
+		CheckMenuItem(stuff->menu,ids[i],MF_BYCOMMAND|(rates[i]==hz?MF_CHECKED:MF_UNCHECKED));
+	}
+	if(stuff->engine) {
+		cmd_t c;
+
+		c.type=CMD_RATE;
+		c.u.hz=hz;
+		engine_post(stuff->engine,&c);
+	}
+}
+
+/*
+show_timing
+
+  Puts up a message box saying how well the engine is keeping time, what instruction
+  set it's using, how the files are doing if the world's in them, the hash of the
+  water, and what the gates have counted.
+*/
+static void show_timing(stuff_t *stuff,HWND h) {
+	const pace_stats_t *s=&stuff->stats;
+	const gate_stats_t *g=&stuff->gate_stats;
+	const map_stats_t *m=&stuff->map_stats;
+	char txt[2000];
+	int i,j,k,n;
+
+	n=_snprintf(txt,sizeof(txt),get_string(IDS_TIMING_INFO),s->target_hz,s->achieved_hz,s->ticks,
+		s->missed,s->mean_ms,s->sd_ms,s->max_ms);
+	if(n>=0) {
+		k=_snprintf(txt+n,sizeof(txt)-n,get_string(IDS_CPU_INFO),cpu_name(cpu_best()),cpu_name(cpu_detected()),
+			render_name(render_get()));
+		n=k<0?-1:n+k;
 	}
-	if(nxz==nyz&&nxz>=1&&nxz<=3) {
-		CheckMenuItem(stuff->menu,ids[nxz-1],MF_BYCOMMAND|MF_CHECKED);
+	if(m->mapped&&n>=0) {
+		k=_snprintf(txt+n,sizeof(txt)-n,get_string(IDS_MAP_INFO),m->quiet_bands,m->num_bands,
+			m->prefetches,m->evictions,m->page_faults,m->read_bytes/1e6,m->write_bytes/1e6);
+		n=k<0?-1:n+k;
 	}
+	if(n>=0) {
+		k=_snprintf(txt+n,sizeof(txt)-n,get_string(IDS_HASH_INFO),stuff->hash_tick,
+			(unsigned)(stuff->hash>>32),(unsigned)stuff->hash);
+		n=k<0?-1:n+k;
+	}
+	/* Then each gate's totals, and its last few samples, newest last. _snprintf gives -1
+	   if it runs out of room, which stops it there. */
+	for(i=0;i<g->num_gates&&n>=0;i++) {
+		k=_snprintf(txt+n,sizeof(txt)-n,get_string(IDS_GATE_INFO),i+1,g->totals[i][0],g->totals[i][1],
+			GATE_SAMPLE_TICKS);
+		n=k<0?-1:n+k;
+		for(j=max(g->num_samples-GATE_SHOWN_SAMPLES,0);j<g->num_samples&&n>=0;j++) {
+			k=_snprintf(txt+n,sizeof(txt)-n," %u/%u",g->samples[j][i][0],g->samples[j][i][1]);
+			n=k<0?-1:n+k;
+		}
+	}
+	txt[sizeof(txt)-1]=0;
+	stuff->use_wm_paint=1;
+	MessageBox(h,txt,get_string(IDS_TIMING_TITLE),MB_OK|MB_ICONINFORMATION);
+	stuff->use_wm_paint=0;
 }
 
 /*
@@ -315,6 +368,12 @@ static void mouse_trans(stuff_t *stuff,HWND h,int *x,int *y) {
 	RECT r;
 	float xamt,yamt;
 
+	if(!stuff->stretch_image) {
+		/* The view is drawn pixel for pixel */
+		*x=stuff->view_x+*x/stuff->w_mul;
+		*y=(stuff->view_y-stuff->bucket_size)+*y/stuff->h_mul;
+		return;
+	}
 	GetClientRect(h,&r);
 	xamt=(*x/(float)r.right);
 	yamt=(*y/(float)r.bottom);
@@ -336,7 +395,6 @@ static void debug_status(stuff_t *p) {
 //	dprintf("view:\tat (%d,%d), ",p->view_x,p->view_y);
 	dprintf("zoom factor=%d x %d\n",p->w_mul,p->h_mul);
 	dprintf("Flags:\tusing WM_PAINT=%s; ",p->use_wm_paint?"yes":"no");
-	dprintf("no_catchup=%s; ",p->no_catchup?"yes":"no");
 	dprintf("paused=%s\n",p->paused?"yes":"no");
 	dprintf("\nThat's everything for %s\n",asctime(newtime));
 }
@@ -403,7 +461,7 @@ static BOOL CALLBACK resize_dlgproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 		stuff=(stuff_t *)l;
 		{
 			/* Initialise dialog appearance */
-			char numtmp[20]; HWND cb; int selidx;
+			char numtmp[20]; HWND cb; int i,n;
 
 			/* Width text box */
 			_snprintf(numtmp,sizeof(numtmp),"%d",stuff->area_width);
@@ -413,11 +471,17 @@ static BOOL CALLBACK resize_dlgproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 			SendMessage(GetDlgItem(h,IDC_NEW_HEIGHT),WM_SETTEXT,0,(LPARAM)numtmp);
 			/* Add items to list box */
 			cb=GetDlgItem(h,IDC_CURRENT_CONTENTS);
-			selidx=cbox_add_item(cb,IDS_CONTENTS_DISCARD);
+			cbox_add_item(cb,IDS_CONTENTS_DISCARD);
 			cbox_add_item(cb,IDS_CONTENTS_PRESERVE);
 			cbox_add_item(cb,IDS_CONTENTS_CENTRE);
 			cbox_add_item(cb,IDS_CONTENTS_RESIZE);
-			SendMessage(cb,CB_SETCURSEL,selidx,0);
+			/* The list is sorted, so find the last choice by its item data */
+			n=SendMessage(cb,CB_GETCOUNT,0,0);
+			for(i=0;i<n;i++) {
+				if((unsigned)SendMessage(cb,CB_GETITEMDATA,i,0)==stuff->resize_contents) {
+					SendMessage(cb,CB_SETCURSEL,i,0);
+				}
+			}
 		}
 		return TRUE;
 	case WM_COMMAND:
@@ -446,9 +510,12 @@ static BOOL CALLBACK resize_dlgproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 						EndDialog(h,0);		/* Cancel */
 					}
 				} else {
+					HWND cb=GetDlgItem(h,IDC_CURRENT_CONTENTS);
+
 					dprintf("resize dlg: OK: new_width=%u; new_height=%u\n",new_width,new_height);
 					stuff->area_width=(signed)new_width;
 					stuff->area_height=(signed)new_height;
+					stuff->resize_contents=SendMessage(cb,CB_GETITEMDATA,SendMessage(cb,CB_GETCURSEL,0,0),0);
 					EndDialog(h,1);		/* non-0 is OK'ed */
 				}
 			}
@@ -474,14 +541,24 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 	case WM_ENTERMENULOOP:
 //		dprintf("WM_ENTERMENULOOP:\n");
 		p->use_wm_paint=1;
-		p->no_catchup=1;
+		SetTimer(h,PRESENT_TIMER,PRESENT_TIMER_MS,0);
+		return 0;
+	case WM_EXITMENULOOP:
+		KillTimer(h,PRESENT_TIMER);
 		return 0;
 	case WM_ENTERSIZEMOVE:
 		p->use_wm_paint=1;
-		p->no_catchup=1;
+		SetTimer(h,PRESENT_TIMER,PRESENT_TIMER_MS,0);
 		return 0;
 	case WM_EXITSIZEMOVE:
 		p->use_wm_paint=0;
+		KillTimer(h,PRESENT_TIMER);
+		return 0;
+	case WM_TIMER:
+		/* The sim thread carries on regardless, so keep showing what it's doing. */
+		if(w==PRESENT_TIMER&&present_frame(p)) {
+			InvalidateRect(h,0,FALSE);
+		}
 		return 0;
 	case WM_VSCROLL:
 	case WM_HSCROLL:
@@ -503,7 +580,6 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 #endif
 			if(LOWORD(w)==SB_ENDSCROLL) {
 				p->use_wm_paint=0;
-				p->no_catchup=1;
 				si.nPos=old_pos;
 				name="SB_ENDSCROLL";
 			} else {
@@ -595,7 +671,9 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 
 			EndPaint(h,&ps);
 			return 0;
-		} else if(p->use_wm_paint&&p->ddraw_valid&&!p->ddraw_bad) {
+		} else if(p->ddraw_valid&&!p->ddraw_bad) {
+			/* Not just when use_wm_paint: the engine may be paused, in which case there won't
+			   be any new frames to prompt a repaint. */
 			PAINTSTRUCT ps;
 			HDC dc;
 			dc=BeginPaint(h,&ps);
@@ -605,14 +683,8 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 		}
 		break;
 	case WM_DISPLAYCHANGE:
-		if(p->ddraw_valid&&!p->ddraw_bad) {
-			HCURSOR oc;
-
-			//dx_with_lock(p->land,0,0,copy_bits_from);
-			oc=SetCursor(LoadCursor(0,IDC_WAIT));
-			save_land(p);
-			SetCursor(oc);
-		}
+		/* The world is cells, so the engine doesn't care; reset_ddraw makes new surfaces
+		   and builds the palette afresh for the new pixel format. */
 		p->ddraw_valid=0;
 		return 0;
 	case WM_CREATE:
@@ -637,10 +709,31 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 		}
 		break;
 	case WM_LBUTTONDOWN:
+		if(p->gate_tool) {
+			/* Gate goes in when the button's released */
+			p->gating=1;
+			p->lastpoint=l;
+			return 0;
+		} else if(p->flood_tool) {
+			int x=LOWORD(l),y=HIWORD(l);
+
+			mouse_trans(p,h,&x,&y);
+			post_stroke(p,x,y,x,y,1);
+			return 0;
+		}
 		p->held=1;
 		p->lastpoint=l;
 		return 0;
 	case WM_LBUTTONUP:
+		if(p->gating) {
+			int x1=LOWORD(p->lastpoint),y1=HIWORD(p->lastpoint),x2=LOWORD(l),y2=HIWORD(l);
+
+			p->gating=0;
+			mouse_trans(p,h,&x1,&y1);
+			mouse_trans(p,h,&x2,&y2);
+			post_gate(p,x1,y1,x2,y2);
+			return 0;
+		}
 		SendMessage(h,WM_MOUSEMOVE,w,l);
 		p->held=0;
 		return 0;
@@ -650,9 +743,6 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 			p->held=0;
 		} else if(p->held) {
 			int oldx,oldy,thisx,thisy;
-			HPEN pen;
-			HRGN rgn;
-			HDC hdc;
 
 			/* Fetch unadulterated coordinates */
 			oldx=LOWORD(p->lastpoint);
@@ -672,18 +762,9 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 			/* Modify coordinates, taking into account zoom factor and origin */
 			mouse_trans(p,h,&oldx,&oldy);
 			mouse_trans(p,h,&thisx,&thisy);
-			if((oldx!=thisx||oldy!=thisy)&&SUCCEEDED(IDirectDrawSurface2_GetDC(p->land,&hdc))) {
-				rgn=CreateRectRgn(1,1,p->area_width-1,p->area_height-1);
-				pen=CreatePen(PS_SOLID,p->brush_size,brush_cols[p->brush_col]);
-				SelectObject(hdc,pen);
-				SelectClipRgn(hdc,rgn);
-				DeleteObject(rgn);
-				MoveToEx(hdc,oldx,oldy,0);
-				LineTo(hdc,thisx,thisy);
-				SelectObject(hdc,GetStockObject(WHITE_PEN));
-				IDirectDrawSurface2_ReleaseDC(p->land,hdc);
-				DeleteObject(pen);
-				p->land_changed=1;
+			if(oldx!=thisx||oldy!=thisy) {
+				/* Drawn between ticks by the engine */
+				post_stroke(p,oldx,oldy,thisx,thisy,0);
 			}
 		}
 		return 0;
@@ -698,31 +779,45 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 				{
 					int i;
 
-					p->no_catchup=1;
 					i=DialogBoxParam(GetModuleHandle(0),MAKEINTRESOURCE(IDD_RESIZE),h,resize_dlgproc,(LPARAM)p);
 					if(i) {
-						/* -> area_width and area_height already done. */
+						/* -> area_width, area_height and resize_contents already done. Engine
+						   sorts out landscape and droplets. */
+						cmd_t c;
+
+						c.type=CMD_RESIZE;
+						c.u.size.width=p->area_width;
+						c.u.size.height=p->area_height;
+						switch(p->resize_contents) {
+						case IDS_CONTENTS_PRESERVE:
+							c.u.size.contents=RESIZE_PRESERVE;
+							break;
+						case IDS_CONTENTS_CENTRE:
+							c.u.size.contents=RESIZE_CENTRE;
+							break;
+						case IDS_CONTENTS_RESIZE:
+							c.u.size.contents=RESIZE_SCALE;
+							break;
+						default:
+							c.u.size.contents=RESIZE_DISCARD;
+							break;
+						}
+						engine_post(p->engine,&c);
+						/* Engine drops the gates too */
+						p->num_gates=0;
 						p->ddraw_valid=0;
 						p->window_valid=0;
-						/* A bit of a kludge, this ensures droplets are reset when the land size changes */
-						SendMessage(h,WM_COMMAND,MAKELONG(ID_FILE_RESET,0),0);
 					}
 				}
 				return 0;
 			case ID_FILE_CLEAR:
-				if(p->land) {
-					dx_clear_surface(p->land);
-					do_land_border(p);
-					p->land_changed=1;
-					p->no_catchup=1;
-				}
+				post_fill(p,CELL_EMPTY);
 				return 0;
 			case ID_FILE_EXIT:
 				DestroyWindow(h);
 				return 0;
 			case ID_FILE_RESET:
-				p->new_num_drops=p->num_drops;
-				p->no_catchup=1;
+				post_command(p,CMD_RESET);
 				return 0;
 			case ID_TOOLS_POPUPMENU:
 				p->popup_menu=!p->popup_menu;
@@ -732,18 +827,35 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 				p->use_wm_paint=1;
 				MessageBox(h,get_string(IDS_ABOUT_INFO),get_string(IDS_ABOUT_INFO_TITLE),MB_OK|MB_ICONINFORMATION);
 				p->use_wm_paint=0;
-				p->no_catchup=1;
 				return 0;
 #ifdef _DEBUG
 			case ID_TOOLS_SAVEDROPLETDATA:
-				log_droplets(p,get_string(IDS_DROPLETDATAFILE),"wt");
+				post_command(p,CMD_LOG_DROPLETS);
 				return 0;
 #endif
 			case ID_TOOLS_RUN:
-				p->paused=0;
+				set_paused(p,0);
+				return 0;
+			case ID_SPEED_50:
+				set_speed(p,50);
+				return 0;
+			case ID_SPEED_100:
+				set_speed(p,100);
+				return 0;
+			case ID_SPEED_200:
+				set_speed(p,200);
+				return 0;
+			case ID_SPEED_500:
+				set_speed(p,500);
+				return 0;
+			case ID_SPEED_TURBO:
+				set_speed(p,0);
+				return 0;
+			case ID_TOOLS_TIMING:
+				show_timing(p,h);
 				return 0;
 			case ID_TOOLS_PAUSE:
-				p->paused=1;
+				set_paused(p,1);
 				return 0;
 			case IDA_ZOOM1:
 				set_zoom(p,1,1);
@@ -754,6 +866,15 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 			case IDA_ZOOM3:
 				set_zoom(p,3,3);
 				return 0;
+			case IDA_ZOOM4:
+				set_zoom(p,4,4);
+				return 0;
+			case IDA_ZOOM6:
+				set_zoom(p,6,6);
+				return 0;
+			case IDA_ZOOM8:
+				set_zoom(p,8,8);
+				return 0;
 			case IDA_BRUSH1:
 				set_brushsize(p,1);
 				return 0;
@@ -783,6 +904,12 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 			case IDA_BRUSHGREEN:
 				set_brushcolour(p,GREEN_BRUSH_COLOUR);
 				return 0;
+			case IDA_BRUSHMAGENTA:
+				set_brushcolour(p,MAGENTA_BRUSH_COLOUR);
+				return 0;
+			case IDA_BRUSHORANGE:
+				set_brushcolour(p,ORANGE_BRUSH_COLOUR);
+				return 0;
 #ifdef _DEBUG
 			case IDA_DEBUG_STATUS:
 				debug_status(p);
@@ -793,27 +920,46 @@ static LRESULT CALLBACK main_wndproc(HWND h,UINT msg,WPARAM w,LPARAM l) {
 				p->window_valid=0;
 				set_message(p,p->stretch_image?IDS_YESSTRETCH:IDS_NOSTRETCH);
 				return 0;
+			case ID_TOOLS_FLOODFILL:
+				p->flood_tool=!p->flood_tool;
+				CheckMenuItem(p->menu,ID_TOOLS_FLOODFILL,p->flood_tool?MF_CHECKED:MF_UNCHECKED);
+				set_message(p,p->flood_tool?IDS_FLOOD_ON:IDS_FLOOD_OFF);
+				return 0;
 			case ID_TOOLS_FILL:
-				{
-					HDC hdc;
-					LOGBRUSH lb;
-					HRGN rgn;
-					HGDIOBJ oldpen,oldbrush;
-
-					if(SUCCEEDED(IDirectDrawSurface2_GetDC(p->land,&hdc))) {
-						lb.lbStyle=BS_SOLID;
-						lb.lbColor=brush_cols[0];
-						oldpen=SelectObject(hdc,CreatePen(PS_SOLID,0,brush_cols[0]));		/* yellow */
-						oldbrush=SelectObject(hdc,CreateBrushIndirect(&lb));
-						rgn=CreateRectRgn(1,1,p->area_width-1,p->area_height-1);
-						Rectangle(hdc,1,1,p->area_width-1,p->area_height-1);
-						SelectClipRgn(hdc,rgn);
-						DeleteObject(rgn);
-						DeleteObject(SelectObject(hdc,oldpen));
-						DeleteObject(SelectObject(hdc,oldbrush));
-						IDirectDrawSurface2_ReleaseDC(p->land,hdc);
-						p->land_changed=1;
-					}
+				post_fill(p,brush_cells[YELLOW_BRUSH_COLOUR]);
+				return 0;
+			case ID_TOOLS_GATE:
+				p->gate_tool=!p->gate_tool;
+				CheckMenuItem(p->menu,ID_TOOLS_GATE,p->gate_tool?MF_CHECKED:MF_UNCHECKED);
+				set_message(p,p->gate_tool?IDS_GATE_ON:IDS_GATE_OFF);
+				return 0;
+			case ID_TOOLS_CLEARGATES:
+				post_command(p,CMD_CLEAR_GATES);
+				p->num_gates=0;
+				InvalidateRect(h,0,FALSE);
+				return 0;
+			case ID_OPTIONS_POOLS:
+				p->pools=!p->pools;
+				CheckMenuItem(p->menu,ID_OPTIONS_POOLS,p->pools?MF_CHECKED:MF_UNCHECKED);
+				post_pools(p);
+				return 0;
+			case ID_OPTIONS_PRESSURE:
+				p->pressure=!p->pressure;
+				CheckMenuItem(p->menu,ID_OPTIONS_PRESSURE,p->pressure?MF_CHECKED:MF_UNCHECKED);
+				post_pressure(p);
+				return 0;
+			case ID_OPTIONS_ROWORDER:
+				p->row_order=!p->row_order;
+				CheckMenuItem(p->menu,ID_OPTIONS_ROWORDER,p->row_order?MF_CHECKED:MF_UNCHECKED);
+				post_row_order(p);
+				return 0;
+			case ID_OPTIONS_NIGHTCOLOURS:
+				/* Only the palette changes; the engine doesn't need to know. */
+				p->colour_scheme=!p->colour_scheme;
+				CheckMenuItem(p->menu,ID_OPTIONS_NIGHTCOLOURS,p->colour_scheme?MF_CHECKED:MF_UNCHECKED);
+				if(p->ddraw_valid&&!p->ddraw_bad) {
+					render_palette(&p->palette,&p->pf,schemes[p->colour_scheme],NUM_CELLS);
+					InvalidateRect(h,0,FALSE);
 				}
 				return 0;
 			}
@@ -854,10 +1000,6 @@ static void kill_stuff(stuff_t *p) {
 		IDirectDrawClipper_Release(p->clipper);
 		p->clipper=0;
 	}
-	if(p->land) {
-		IDirectDrawSurface2_Release(p->land);
-		p->land=0;
-	}
 	if(p->back) {
 		IDirectDrawSurface2_Release(p->back);
 		p->back=0;
@@ -870,48 +1012,217 @@ static void kill_stuff(stuff_t *p) {
 }
 
 /*
-set_drops
+post_command
 
-  Sets the number of droplets. Existing droplets are removed and a fresh
-  set is created.
+  Sends the engine a command that has no parameters.
 
-  num_drops -> number of droplets
+  type -> command type (CMD_xxx)
 */
-static void set_drops(stuff_t *stuff,unsigned num_drops) {
-	free(stuff->drops);
-	stuff->droplets_bpp=1;
-	if(!num_drops) {
-		stuff->num_drops=0;
-		stuff->drops=0;
-	} else {
-		unsigned idx;
-		int i,j;
-
-		stuff->drops=malloc(num_drops*sizeof(unsigned)*2);
-		memset(stuff->drops,0,num_drops*sizeof(unsigned)*2);
-		stuff->num_drops=num_drops;
-		stuff->pitch=stuff->area_width*stuff->droplets_bpp;		/* will do for the moment */
-		/* Bucket must be big enuogh to contain all droplets */
-		stuff->bucket_size=(int)sqrt(stuff->num_drops)+10;
-		/* Generate positions */
-		idx=0;
-		for(i=1;idx<=stuff->num_drops&&i<stuff->bucket_size;i++) {
-			for(j=1;idx<stuff->num_drops&&j<i*2;j++) {
-				BYTE *p;
-
-				stuff->drops[idx*2]=((stuff->area_width/2-i)+j)*stuff->droplets_bpp;			/* X position */
-				stuff->drops[idx*2]+=(stuff->bucket_size-i)*stuff->pitch;				/* Y position */
-				p=(BYTE *)&stuff->drops[idx*2+1];
-				*p=rand()>=RAND_MAX/2;			/* droplet type */
-				idx++;
-			}
-		}
-#ifdef _DEBUG
-		log_droplets(stuff,get_string(IDS_DROPLETDATAFILE),"wt");
-#endif
+static void post_command(stuff_t *stuff,int type) {
+	cmd_t c;
+
+	c.type=type;
+	engine_post(stuff->engine,&c);
+}
+
+/*
+post_stroke
+
+  Sends the engine a brush stroke, in the current brush colour and size.
+
+  x1,y1 -> start point, landscape coordinates
+  x2,y2 -> end point
+  flood -> if non-0, flood fill from the start point instead
+*/
+static void post_stroke(stuff_t *stuff,int x1,int y1,int x2,int y2,int flood) {
+	cmd_t c;
+
+	c.type=CMD_STROKE;
+	c.u.stroke.x1=x1;
+	c.u.stroke.y1=y1;
+	c.u.stroke.x2=x2;
+	c.u.stroke.y2=y2;
+	c.u.stroke.size=stuff->brush_size;
+	c.u.stroke.cell=brush_cells[stuff->brush_col];
+	c.u.stroke.flood=flood;
+	engine_post(stuff->engine,&c);
+}
+
+/* Fills the landscape inside the border with the given cell. CELL_EMPTY erases it. */
+static void post_fill(stuff_t *stuff,int cell) {
+	cmd_t c;
+
+	c.type=CMD_FILL;
+	c.u.fill=cell;
+	engine_post(stuff->engine,&c);
+}
+
+/*
+post_gate
+
+  Sends the engine a new gate, and keeps a note of it so it can be drawn.
+
+  x1,y1 -> one end, landscape coordinates
+  x2,y2 -> other end
+*/
+static void post_gate(stuff_t *stuff,int x1,int y1,int x2,int y2) {
+	cmd_t c;
+
+	if(stuff->num_gates==MAX_GATES) {
+		set_message(stuff,IDS_GATES_FULL,MAX_GATES);
+		return;
+	}
+	c.type=CMD_GATE;
+	memset(&c.u.stroke,0,sizeof(c.u.stroke));
+	c.u.stroke.x1=x1;
+	c.u.stroke.y1=y1;
+	c.u.stroke.x2=x2;
+	c.u.stroke.y2=y2;
+	c.u.stroke.size=1;
+	engine_post(stuff->engine,&c);
+	stuff->gates[stuff->num_gates++]=c.u.stroke;
+	set_message(stuff,IDS_GATE_ADDED,stuff->num_gates);
+}
+
+/* Tells the engine whether to pool settled water. It looks the same either way. */
+static void post_pools(stuff_t *stuff) {
+	cmd_t c;
+
+	c.type=CMD_POOLS;
+	c.u.pools=stuff->pools;
+	engine_post(stuff->engine,&c);
+}
+
+/* Tells the engine whether connected water should find its level straight away. */
+static void post_pressure(stuff_t *stuff) {
+	cmd_t c;
+
+	c.type=CMD_PRESSURE;
+	c.u.pressure=stuff->pressure;
+	engine_post(stuff->engine,&c);
+}
+
+/* Tells the engine whether to keep the droplets in row order, which is quicker for big
+   worlds. */
+static void post_row_order(stuff_t *stuff) {
+	cmd_t c;
+
+	c.type=CMD_ROW_ORDER;
+	c.u.row_order=stuff->row_order;
+	engine_post(stuff->engine,&c);
+}
+
+static void set_paused(stuff_t *stuff,int paused) {
+	cmd_t c;
+
+	stuff->paused=paused;
+	c.type=CMD_PAUSE;
+	c.u.paused=paused;
+	engine_post(stuff->engine,&c);
+}
+
+/*
+view_size
+
+  Works out how much of the back surface the view takes up: the window's view, or less
+  if the area runs out first.
+
+  width,height -> set to size of view, in pixels
+  cells -> if not NULL, set to the part of the world that's in view, in cells
+*/
+static void view_size(stuff_t *stuff,int *width,int *height,RECT *cells) {
+	*width=min(stuff->view_width,(stuff->area_width-stuff->view_x)*stuff->w_mul);
+	*width=max(min(*width,stuff->back_width),0);
+	*height=min(stuff->view_height,(stuff->area_height+stuff->bucket_size-stuff->view_y)*stuff->h_mul);
+	*height=max(min(*height,stuff->back_height),0);
+	if(cells) {
+		SetRect(cells,stuff->view_x,stuff->view_y,stuff->view_x+(*width+stuff->w_mul-1)/stuff->w_mul,
+			stuff->view_y+(*height+stuff->h_mul-1)/stuff->h_mul);
 	}
 }
 
+/* This is a dx_with_lock callback function. */
+static void copy_frame(int iparam,void *vstuff,DDSURFACEDESC *ds) {
+	stuff_t *stuff=vstuff;
+	const frame_t *f=stuff->frame;
+	int w,h;
+
+	(void)iparam;
+	view_size(stuff,&w,&h,0);
+	render_zoom(ds->lpSurface,ds->lPitch,w,h,
+		f->bits+(stuff->view_y-f->view.top)*f->pitch+(stuff->view_x-f->view.left),f->pitch,
+		stuff->w_mul,stuff->h_mul,&stuff->palette);
+}
+
+/*
+render_frame
+
+  Converts the visible part of the frame last shown to the display's format, zoomed, on
+  the back surface. It's the palette that says what colour everything is, so this is all
+  a new colour scheme needs.
+
+  If the view's moved, the engine is asked for frames of the new part of the world. Until
+  one arrives, the back surface is left as it is.
+
+  width,height -> set to size of the part of the back surface that's the view
+*/
+static void render_frame(stuff_t *stuff,int *width,int *height) {
+	const frame_t *f=stuff->frame;
+	RECT cells,both;
+
+	view_size(stuff,width,height,&cells);
+	if(!EqualRect(&cells,&stuff->frame_view)) {
+		cmd_t c;
+
+		c.type=CMD_VIEW;
+		c.u.view=cells;
+		engine_post(stuff->engine,&c);
+		stuff->frame_view=cells;
+	}
+	/* Frames made before a resize are no good */
+	if(!f||f->width!=stuff->area_width||f->height!=stuff->area_height+stuff->bucket_size) {
+		return;
+	}
+	if(IsRectEmpty(&cells)||(IntersectRect(&both,&cells,&f->view)&&EqualRect(&both,&cells))) {
+		dx_with_lock(stuff->back,0,stuff,copy_frame);
+	}
+}
+
+/*
+present_frame
+
+  Gets the engine's latest frame, if there's a new one. It's rendered when the window's
+  painted.
+
+  Return: non-0 if there's a new frame, and the window wants repainting.
+*/
+static int present_frame(stuff_t *stuff) {
+	const frame_t *f;
+
+	if(!stuff->engine||!stuff->ddraw_valid||stuff->ddraw_bad) {
+		return 0;
+	}
+	f=engine_frame(stuff->engine);
+	if(!f) {
+		return 0;
+	}
+	/* Frames made before a resize or display change are no good */
+	/* The one before is the sim thread's again now */
+	stuff->frame=0;
+	if(f->width!=stuff->area_width||f->height!=stuff->area_height+stuff->bucket_size) {
+		return 0;
+	}
+	stuff->stats=f->stats;
+	stuff->num_drops=f->num_drops;
+	stuff->gate_stats=f->gates;
+	stuff->settled=f->settled;
+	stuff->map_stats=f->map;
+	stuff->hash_tick=f->tick;
+	stuff->hash=f->hash;
+	stuff->frame=f;
+	return 1;
+}
+
 /*
 pixel
 
@@ -948,96 +1259,49 @@ static void pixel(DDSURFACEDESC *ds,int x,int y,DWORD val,int mul) {
 	}
 }
 
-static void do_land_border(stuff_t *stuff) {
-	DWORD colour=stuff->pf.dwRBitMask|stuff->pf.dwBBitMask|stuff->pf.dwGBitMask;
-	int cx=stuff->area_width/2;
-
-	dx_fill_area(stuff->land,colour,0,0,stuff->area_width-1,0);
-	dx_fill_area(stuff->land,colour,0,stuff->area_height-1,stuff->area_width-1,stuff->area_height-1);
-	dx_fill_area(stuff->land,colour,0,0,0,stuff->area_height-1);
-	dx_fill_area(stuff->land,colour,stuff->area_width-1,0,stuff->area_width-1,stuff->area_height-1);
-	dx_fill_area(stuff->land,0,cx-(stuff->bucket_neck_size-1),0,cx+(stuff->bucket_neck_size-1),0);
-	dx_fill_area(stuff->land,0,cx,stuff->area_height-1,cx,stuff->area_height-1);
-}
-
-
-/* Draw bucket and frame */
-static void do_bucket(stuff_t *stuff) {
-	int i,cx,cy;
-	DWORD white=stuff->pf.dwRBitMask|stuff->pf.dwBBitMask|stuff->pf.dwGBitMask;
-	cx=stuff->area_width/2;
-	for(i=1;i<=stuff->bucket_size;i++) {
-		int dx;
-
-		cy=stuff->bucket_size-i;
-		dx=max(i,stuff->bucket_neck_size);
-		dx_fill_area(stuff->back,white,0,cy,cx-dx,cy);
-		dx_fill_area(stuff->back,white,cx+dx,cy,stuff->area_width-1,cy);
-	}
-}
-
-static void fix_droplet_data(stuff_t *stuff,unsigned this_pitch) {
-	if(stuff->pitch!=this_pitch||stuff->droplets_bpp!=stuff->dd_bpp) {
-		int n_l=0,n_r=0;
-		unsigned *p=stuff->drops,x,y,i;
-
-		dprintf("fix_droplet_data: before: pitch=%u bpp=%u after: pitch=%u bpp=%d\n",
-			stuff->pitch,stuff->droplets_bpp,this_pitch,stuff->dd_bpp);
-		for(i=0;i<stuff->num_drops;i++,p+=2) {
-			x=(*p%stuff->pitch)/stuff->droplets_bpp;
-			y=*p/stuff->pitch;
-			*p=x*stuff->dd_bpp+y*this_pitch;
-		}
-		stuff->pitch=this_pitch;
-		stuff->droplets_bpp=stuff->dd_bpp;
-		/* RND table as well */
-		for(i=0;i<RND_TBL_SIZE;i++) {
-			dir_tbl[i]=((float)rand()/RAND_MAX)>0.5?-stuff->dd_bpp:+stuff->dd_bpp;
-			if((signed)dir_tbl[i]<0) {
-				n_l++;
-			} else {
-				n_r++;
-			}
-		}
-		dprintf("dir_tbl: %d elements: %d left, %d right\n",RND_TBL_SIZE,n_l,n_r);
-	}
-}
-
 static void cons(stuff_t *stuff) {
 	stuff->window_valid=0;
 	stuff->ddraw_valid=0;
 	stuff->ddraw_bad=0;
 	stuff->primary=0;
 	stuff->back=0;
-	stuff->land=0;
+	stuff->flood_tool=0;
+	stuff->gate_tool=0;
+	stuff->gating=0;
+	stuff->resize_contents=IDS_CONTENTS_DISCARD;
 	stuff->clipper=0;
 	stuff->paused=1;
-	stuff->new_num_drops=0;
-	stuff->no_catchup=0;
-	stuff->update_diff=10;
+	stuff->engine=0;
+	stuff->frame=0;
+	SetRectEmpty(&stuff->frame_view);
+	memset(&stuff->stats,0,sizeof(stuff->stats));
+	stuff->num_drops=0;
+	memset(&stuff->gate_stats,0,sizeof(stuff->gate_stats));
+	memset(&stuff->map_stats,0,sizeof(stuff->map_stats));
+	stuff->hash_tick=0;
+	stuff->hash=0;
+	stuff->num_gates=0;
 
 	stuff->view_x=0;
 	stuff->view_y=0;
 	stuff->include_bucket=0;
-	stuff->land_backup=0;
 
 	stuff->msg=0;
 }
 
 static void defaults(stuff_t *stuff) { 
 	stuff->asm=0;
-	stuff->num_drops=0;
-	stuff->drops=0;
-	stuff->pitch=0;
 	stuff->area_width=MIN_AREA_WIDTH;
 	stuff->area_height=400;
 	stuff->view_width=MIN_AREA_WIDTH;
 	stuff->view_height=400;
 	stuff->stretch_image=0;
+	stuff->colour_scheme=0;
 
 	stuff->popup_menu=0;
 	stuff->use_wm_paint=0;
 
+	set_speed(stuff,100);
 	set_zoom(stuff,1,1);
 	set_brushsize(stuff,1);
 	set_brushcolour(stuff,0);
@@ -1058,48 +1322,27 @@ static char *reset_ddraw(stuff_t *stuff,HWND h_wnd) {
 		return describe_dx_error(hr);
 	}
 	stuff->primary=dx_create_surface(DDSCAPS_PRIMARYSURFACE,-1,-1);
-	stuff->back=dx_create_surface(DDSCAPS_OFFSCREENPLAIN|DDSCAPS_SYSTEMMEMORY,stuff->area_width,stuff->area_height+stuff->bucket_size);
-	stuff->land=dx_create_surface(DDSCAPS_OFFSCREENPLAIN|DDSCAPS_SYSTEMMEMORY,stuff->area_width,stuff->area_height);
-	if(!stuff->primary||!stuff->back||!stuff->land) {
+	/* The view is rendered at the window's size, zoom and all, so the back surface only
+	   has to be as big as the desktop. */
+	stuff->back_width=GetSystemMetrics(SM_CXVIRTUALSCREEN);
+	stuff->back_height=GetSystemMetrics(SM_CYVIRTUALSCREEN);
+	stuff->back=dx_create_surface(DDSCAPS_OFFSCREENPLAIN|DDSCAPS_SYSTEMMEMORY,stuff->back_width,stuff->back_height);
+	if(!stuff->primary||!stuff->back) {
 		kill_stuff(stuff);
 		return get_string(IDS_NO_SURFACES_MSG);
 	}
 	stuff->pf.dwSize=sizeof(stuff->pf);
 	IDirectDrawSurface2_GetPixelFormat(stuff->primary,&stuff->pf);
-	/* Set up back surface */
+	/* Set up back surface; it's blank until the engine's first frame arrives */
 	dx_clear_surface(stuff->back);
-	do_bucket(stuff);
-	/* Initialise functions for this bit depth */
-	{
-		funcs_t *p;
-
-		for(p=funcsarr;p->bpp&&p->bpp!=stuff->pf.dwRGBBitCount;p++) {
-		}
-		if(p->bpp) {
-			int asm_ok=p->update_all_droplets_asm&&p->draw_all_droplets_asm;
-
-			EnableMenuItem(GetMenu(h_wnd),ID_OPTIONS_ASSEMBLERVERSION,asm_ok?MF_ENABLED:MF_DISABLED);
-			CheckMenuItem(GetMenu(h_wnd),ID_OPTIONS_ASSEMBLERVERSION,(asm_ok&&stuff->asm)?MF_CHECKED:MF_UNCHECKED);
-			if(stuff->asm&&asm_ok) {
-				update_all_droplets=p->update_all_droplets_asm;
-				draw_all_droplets=p->draw_all_droplets_asm;
-			} else {
-				update_all_droplets=p->update_all_droplets;
-				draw_all_droplets=p->draw_all_droplets;
-			}
-			stuff->dd_bpp=p->bpp/8;
-		} else {
-			/* Unsupported */
-			kill_stuff(stuff);
-			return get_string(IDS_BADBITDEPTH);
-		}
-	}
-	/* Restore landscape or just clear the surface */
-	if(!restore_land(stuff)) {
-		dx_clear_surface(stuff->land);
-		do_land_border(stuff);
+	/* Check frames can be rendered at this bit depth */
+	if(!render_supports(stuff->pf.dwRGBBitCount)) {
+		/* Unsupported */
+		kill_stuff(stuff);
+		return get_string(IDS_BADBITDEPTH);
 	}
-	stuff->land_changed=1;
+	stuff->dd_bpp=stuff->pf.dwRGBBitCount/8;
+	render_palette(&stuff->palette,&stuff->pf,schemes[stuff->colour_scheme],NUM_CELLS);
 	hr=IDirectDraw2_CreateClipper(dx_ddraw(),0,&stuff->clipper,0);
 	CHK;
 	hr=IDirectDrawClipper_SetHWnd(stuff->clipper,0,h_wnd);
@@ -1313,6 +1556,7 @@ static void paint_window(HWND h_wnd,stuff_t *stuff) {
 		POINT tlpos;
 		RECT rect,src_rect,dest_rect;
 		HRESULT br;
+		int w,h;
 
 		if(FAILED(IDirectDrawSurface2_IsLost(stuff->primary))) {
 			IDirectDrawSurface2_Restore(stuff->primary);
@@ -1324,27 +1568,18 @@ static void paint_window(HWND h_wnd,stuff_t *stuff) {
 		if(!ClientToScreen(h_wnd,&tlpos)||!GetClientRect(h_wnd,&rect)) {
 			return;
 		}
+		/* Source rectangle: the view, already zoomed, so no stretching */
+		render_frame(stuff,&w,&h);
+		SetRect(&src_rect,0,0,w,h);
 		/* Dest rectangle */
-		dest_rect.left=0;
-		dest_rect.right=rect.right;
-		dest_rect.top=0;
-		dest_rect.bottom=rect.bottom;
-		/* Source rectangle */
-		src_rect.left=stuff->view_x;
-		src_rect.top=stuff->view_y;
-		src_rect.right=src_rect.left+(int)(stuff->view_width/(float)stuff->w_mul);
-		src_rect.bottom=src_rect.top+(int)(stuff->view_height/(float)stuff->h_mul);
-		/* It seems that small rounding errors may occur in the above operations, and generate
-		   invalid rectangle errors when diong the Blt. */
-		if(src_rect.right>stuff->area_width) {
-			src_rect.right=stuff->area_width;
-		}
-		if(src_rect.bottom>stuff->area_height+stuff->bucket_size) {
-			src_rect.bottom=stuff->area_height+stuff->bucket_size;
+		if(stuff->stretch_image) {
+			dest_rect=rect;
+		} else {
+			dest_rect=src_rect;
 		}
 		/* Fix dest rect coordinates (from client coords -> screen coords) */
 		OffsetRect(&dest_rect,tlpos.x,tlpos.y);
-		if(dest_rect.right>dest_rect.left&&dest_rect.bottom>dest_rect.top) {
+		if(w>0&&h>0&&dest_rect.right>dest_rect.left&&dest_rect.bottom>dest_rect.top) {
 			br=IDirectDrawSurface2_Blt(stuff->primary,&dest_rect,stuff->back,&src_rect,DDBLT_WAIT,0);
 			if(FAILED(br)) {
 #ifdef DEBUG_PAINT_WINDOW
@@ -1357,6 +1592,9 @@ static void paint_window(HWND h_wnd,stuff_t *stuff) {
 #endif
 			}
 		}
+		if(stuff->num_gates) {
+			draw_gates(h_wnd,stuff);
+		}
 		/* This ends up a bit flickery! */
 		if(stuff->msg) {
 			HDC dc;
@@ -1373,7 +1611,115 @@ static void paint_window(HWND h_wnd,stuff_t *stuff) {
 				r.bottom-GetSystemMetrics(SM_CYFIXEDFRAME)*2,stuff->msg,strlen(stuff->msg));
 			ReleaseDC(h_wnd,dc);
 		}
+		/* In turbo mode, show how fast it's going. Once the water's stopped, it's not going
+		   at all, and the engine's waiting for something to change; say so instead. */
+		if(stuff->settled||(!stuff->tick_hz&&!stuff->paused)) {
+			HDC dc;
+			RECT r;
+			char txt[100];
+
+			if(stuff->settled) {
+				_snprintf(txt,sizeof(txt),get_string(IDS_SETTLED),stuff->settled);
+			} else {
+				_snprintf(txt,sizeof(txt),get_string(IDS_THROUGHPUT),stuff->stats.recent_hz,
+					stuff->stats.recent_hz*stuff->num_drops/1e6);
+			}
+			txt[sizeof(txt)-1]=0;
+			dc=GetWindowDC(h_wnd);
+			GetClientRect(h_wnd,&r);
+			SelectObject(dc,GetStockObject(WHITE_PEN));
+			SelectObject(dc,GetStockObject(SYSTEM_FONT));
+			SetTextAlign(dc,TA_BASELINE|TA_LEFT);
+			TextOut(dc,GetSystemMetrics(SM_CXFIXEDFRAME)*2,
+				r.bottom-GetSystemMetrics(SM_CYFIXEDFRAME)*2,txt,strlen(txt));
+			ReleaseDC(h_wnd,dc);
+		}
+	}
+}
+
+/*
+draw_gates
+
+  Draws the gates over the view, each with its number, as GDI lines. They're not in the
+  frames; the engine only has a map of which cells they cover.
+*/
+static void draw_gates(HWND h_wnd,stuff_t *stuff) {
+	HDC dc;
+	RECT r;
+	int i,xn,xd,yn,yd;
+	char txt[10];
+
+	GetClientRect(h_wnd,&r);
+	/* Client pixels per cell, as a fraction, so it works stretched too */
+	if(stuff->stretch_image) {
+		xn=r.right*stuff->w_mul;
+		xd=max(stuff->view_width,1);
+		yn=r.bottom*stuff->h_mul;
+		yd=max(stuff->view_height,1);
+	} else {
+		xn=stuff->w_mul;
+		yn=stuff->h_mul;
+		xd=yd=1;
+	}
+	dc=GetDC(h_wnd);
+	SelectObject(dc,GetStockObject(WHITE_PEN));
+	SelectObject(dc,GetStockObject(SYSTEM_FONT));
+	SetTextAlign(dc,TA_BOTTOM|TA_LEFT);
+	SetTextColor(dc,RGB(255,255,255));
+	SetBkMode(dc,TRANSPARENT);
+	for(i=0;i<stuff->num_gates;i++) {
+		const stroke_t *g=&stuff->gates[i];
+		int x1,y1,x2,y2;
+
+		/* Middle of each end cell */
+		x1=((g->x1-stuff->view_x)*2+1)*xn/(2*xd);
+		y1=((g->y1+stuff->bucket_size-stuff->view_y)*2+1)*yn/(2*yd);
+		x2=((g->x2-stuff->view_x)*2+1)*xn/(2*xd);
+		y2=((g->y2+stuff->bucket_size-stuff->view_y)*2+1)*yn/(2*yd);
+		MoveToEx(dc,x1,y1,0);
+		LineTo(dc,x2,y2);
+		_snprintf(txt,sizeof(txt),"%d",i+1);
+		TextOut(dc,x1,y1,txt,strlen(txt));
+	}
+	ReleaseDC(h_wnd,dc);
+}
+
+/*
+	map_option
+
+	Looks for -mapped DIR on a command line: keep the world in files in DIR, rather than in
+	memory (see engine_map). DIR can be in double quotes.
+
+	dir -> MAX_PATH chars, for DIR; empty if there's no -mapped
+
+	Return: non-0 if OK (including if there's no -mapped), 0 if DIR is missing.
+*/
+static int map_option(const char *cmd_line,char *dir) {
+	const char *p;
+	int n=0;
+
+	dir[0]=0;
+	for(p=cmd_line;(p=strstr(p,"-mapped"))!=0;p+=7) {
+		if((p==cmd_line||isspace((unsigned char)p[-1]))&&(!p[7]||isspace((unsigned char)p[7]))) {
+			break;
+		}
 	}
+	if(!p) {
+		return 1;
+	}
+	for(p+=7;isspace((unsigned char)*p);p++) {
+	}
+	if(*p=='"') {
+		for(p++;*p&&*p!='"'&&n<MAX_PATH-1;) {
+			dir[n++]=*p++;
+		}
+	} else {
+		while(*p&&!isspace((unsigned char)*p)&&n<MAX_PATH-1) {
+			dir[n++]=*p++;
+		}
+	}
+	dir[n]=0;
+	return n>0;
 }
 
 int WINAPI WinMain(HINSTANCE hInstance,HINSTANCE hPrevInstance,LPSTR lpCmdLine,int nShowCmd) {
@@ -1381,20 +1727,38 @@ int WINAPI WinMain(HINSTANCE hInstance,HINSTANCE hPrevInstance,LPSTR lpCmdLine,i
 	int done=0;
 	HWND h_wnd=0;
 	stuff_t stuff;
-	DWORD l_upd,diff,tick;
+	DWORD tick,wait;
 	HACCEL accelerator=0;
 	STARTUPINFO sif;
+	unsigned seed=1;					/* debug builds get the same water every time */
+	char map_dir[MAX_PATH];
 
-	(void)hInstance,(void)hPrevInstance,(void)lpCmdLine,(void)nShowCmd;
+	(void)hInstance,(void)hPrevInstance,(void)nShowCmd;
 
+	if(headless_wanted(lpCmdLine)) {
+		ExitProcess(headless_main(lpCmdLine));
+	}
+	if(!cpu_option(lpCmdLine)) {
+		MessageBox(0,get_string(IDS_BAD_CPU),get_string(IDS_ERROR_TITLE),MB_OK|MB_ICONEXCLAMATION);
+		ExitProcess(1);
+	}
+	if(!map_option(lpCmdLine,map_dir)) {
+		MessageBox(0,get_string(IDS_BAD_MAPPED),get_string(IDS_ERROR_TITLE),MB_OK|MB_ICONEXCLAMATION);
+		ExitProcess(1);
+	}
 	GetStartupInfo(&sif);
 #ifndef _DEBUG
-	srand(GetTickCount());
+	seed=GetTickCount();
 #endif
 	stuff.menu=LoadMenu(GetModuleHandle(0),MAKEINTRESOURCE(ID_MAINMENU));
 	cons(&stuff);
 	defaults(&stuff);
-	set_drops(&stuff,NUM_DROPLETS);
+	stuff.engine=engine_create(stuff.area_width,stuff.area_height,NUM_DROPLETS,seed);
+	if(!stuff.engine||!engine_map(stuff.engine,map_dir)||!engine_start(stuff.engine)) {
+		MessageBox(0,get_string(IDS_NO_ENGINE),get_string(IDS_ERROR_TITLE),MB_OK|MB_ICONEXCLAMATION);
+		ExitProcess(1);
+	}
+	stuff.bucket_size=stuff.engine->bucket_size;
 	wclass();
 	accelerator=LoadAccelerators(GetModuleHandle(0),MAKEINTRESOURCE(IDR_ACCELERATOR1));
 	h_wnd=CreateWindow(CLASS_NAME,get_string(IDS_WINDOW_TITLE),WS_BORDER|WS_CAPTION|WS_SYSMENU|WS_MINIMIZEBOX|WS_HSCROLL|WS_VSCROLL|WS_THICKFRAME,
@@ -1405,11 +1769,13 @@ int WINAPI WinMain(HINSTANCE hInstance,HINSTANCE hPrevInstance,LPSTR lpCmdLine,i
 	reset_window(&stuff,h_wnd,0);
 	ShowWindow(h_wnd,(sif.dwFlags&STARTF_USESHOWWINDOW)?sif.wShowWindow:SW_SHOWDEFAULT);
 //	UpdateWindow(h_wnd);
-	l_upd=GetTickCount();
 	while(!done) {
+		int repaint=0;
+
 		if(!stuff.window_valid) {		/* Reset window */
 			reset_window(&stuff,h_wnd,0);
 			stuff.window_valid=1;
+			repaint=1;
 		}
 		if(!stuff.ddraw_valid&&stuff.window_valid) {
 			char *msg;
@@ -1427,16 +1793,9 @@ int WINAPI WinMain(HINSTANCE hInstance,HINSTANCE hPrevInstance,LPSTR lpCmdLine,i
 				strcat(buf,get_string(IDS_DDRAW_ERROR_MSGBOX2));
 				MessageBox(h_wnd,buf,get_string(IDS_ERROR_TITLE),MB_OK|MB_ICONEXCLAMATION);
 				dprintf("reset_draw says \"%s\"\n",msg);
-				stuff.paused=1;
+				set_paused(&stuff,1);
 			} else {
-				droplet_colours[0]=stuff.pf.dwRBitMask;
-				droplet_colours[1]=stuff.pf.dwBBitMask;
-				droplet_dirs[0]=-stuff.dd_bpp;
-				droplet_dirs[1]=stuff.dd_bpp;
 				dprintf("reset_draw: returned OK.\n");
-				dprintf("\tdroplet_colors[0]=0x%08lX, droplet_colours[1]=0x%08lX\n",droplet_colours[0],
-					droplet_colours[1]);
-				dprintf("\tdroplet_dirs[0]=%d, droplet_dirs[1]=%d\n",droplet_dirs[0],droplet_dirs[1]);
 				dprintf("\tcolour depth: %dbpp\n",stuff.dd_bpp*8);
 			}
 		}
@@ -1465,81 +1824,32 @@ int WINAPI WinMain(HINSTANCE hInstance,HINSTANCE hPrevInstance,LPSTR lpCmdLine,i
 #endif
 		tick=GetTickCount();
 		/* Message decay */
-		if(tick>stuff.msg_time) {
+		if(stuff.msg&&tick>stuff.msg_time) {
 			free(stuff.msg);
 			stuff.msg=0;
+			repaint=1;
 		}
-		if(stuff.paused||stuff.no_catchup) {
-			l_upd=tick;
-			diff=0;
-		} else {
-			diff=tick-l_upd;
+		/* The engine runs on its own; just show whatever it's done most recently. */
+		if(present_frame(&stuff)) {
+			repaint=1;
 		}
-		if(diff>stuff.update_diff||stuff.paused||stuff.no_catchup) {
-			DDSURFACEDESC ds;
-
-			if(!stuff.new_num_drops) {
-				stuff.no_catchup=0;
-			}
-			if(stuff.ddraw_valid&&!stuff.ddraw_bad) {
-				HRESULT hr;
-				int no_era=0;
-				unsigned i;
-
-				diff/=stuff.update_diff;
-				memset(&ds,0,sizeof(ds));
-				ds.dwSize=sizeof(ds);
-				/*dprintf("processing %u frames\n",diff);*/
-				if(stuff.land_changed) {
-					RECT dest;
-
-					dest.left=0;
-					dest.top=stuff.bucket_size;
-					dest.right=stuff.area_width;
-					dest.bottom=stuff.area_height+stuff.bucket_size;
-					hr=IDirectDrawSurface2_Blt(stuff.back,&dest,stuff.land,0,DDBLT_WAIT,0);
-					if(SUCCEEDED(hr)) {
-						stuff.land_changed=0;
-						no_era=1;
-					}
-				}
-				if(stuff.new_num_drops) {
-					//draw_all_droplets(&stuff,0);
-					/* Don't erase if no_era! */
-					if(!no_era) {
-						dx_with_lock(stuff.back,0,&stuff,draw_all_droplets);
-					}
-					set_drops(&stuff,stuff.new_num_drops);
-					stuff.new_num_drops=0;
-					no_era=1;
-				}
-				if(stuff.paused) {
-					/* If no_era is true, the droplets have been erased already and must
-					   be redrawn. */
-					if(no_era) {
-						//draw_all_droplets(&stuff,-1);
-						dx_with_lock(stuff.back,-1,&stuff,draw_all_droplets);
-						no_era=0;
-					}
-				} else {
-					diff=1;//HACK
-					for(i=0;i<diff;i++) {
-						dx_with_lock(stuff.back,no_era,&stuff,update_all_droplets);
-						no_era=0;
-					}
-				}
-				/* frames */
-				l_upd+=diff*stuff.update_diff;	/* yes, to prevent timer going wrong */
-			}
-			/* draw the update(s) */
+		if(repaint) {
 			if(stuff.use_wm_paint) {
 				InvalidateRect(h_wnd,0,FALSE);
 			} else {
 				paint_window(h_wnd,&stuff);
 			}
 		}
+		/* Nothing to do until there's a new frame or a message, or the message needs taking
+		   down. */
+		if(stuff.msg) {
+			wait=tick<stuff.msg_time?stuff.msg_time-tick:0;
+		} else {
+			wait=INFINITE;
+		}
+		MsgWaitForMultipleObjectsEx(1,&stuff.engine->frame_event,wait,QS_ALLINPUT,MWMO_INPUTAVAILABLE);
 	}
-	set_drops(&stuff,0);
+	engine_destroy(stuff.engine);
 	DestroyMenu(stuff.menu);
 	free(stuff.msg);
 	_cexit();
@@ -1547,297 +1857,3 @@ int WINAPI WinMain(HINSTANCE hInstance,HINSTANCE hPrevInstance,LPSTR lpCmdLine,i
 	_CrtDumpMemoryLeaks();
 	ExitProcess(0);
 }
-
-/* This is a dx_with_lock callback function. */
-static void draw_all_droplets16(int mask,void *vstuff,DDSURFACEDESC *ds) {
-	stuff_t *stuff=vstuff;
-	unsigned *p,j;
-	BYTE *surface;
-
-	surface=ds->lpSurface;
-	fix_droplet_data(stuff,ds->lPitch);
-	p=stuff->drops;
-	for(j=0;j<stuff->num_drops;j++,p+=2) {
-		*((WORD *)(surface+*p))=(WORD)(droplet_colours[*((BYTE *)(p+1))]&((unsigned)mask));
-	}
-}
-
-/* This is a dx_with_lock callback function. */
-void update_all_droplets16(int no_era,void *vstuff,DDSURFACEDESC *ds) {
-	static unsigned r_idx=0;
-	stuff_t *stuff=vstuff;
-	WORD value,lval,rval;
-	unsigned max,t_p,type,*p,j;
-	BYTE *tptr,*surface;
-	int pitch;
-
-	value=(WORD)stuff->pf.dwGBitMask;
-	fix_droplet_data(stuff,ds->lPitch);
-	/* -1 -- droplets go back to top upon falling into the hole rather than falling
-	   below it. */
-	max=(stuff->area_height+stuff->bucket_size-1)*ds->lPitch;
-	/* If the landscape was erased, the old droplets are no longer in place.
-	   This is unfortunate because they must be there. This redraws them. */
-	surface=ds->lpSurface;
-	pitch=ds->lPitch;
-	if(no_era) {
-		p=stuff->drops;
-		for(j=0;j<stuff->num_drops;j++,p+=2) {
-			*((WORD *)(surface+*p))=(WORD)droplet_colours[*((BYTE *)(p+1))];;
-		}
-		no_era=0;
-	}
-	p=stuff->drops;
-	//for(j=stuff->num_drops;j;j--,p+=2) {
-	for(j=0;j<stuff->num_drops;j++,p+=2) {
-		t_p=*p;
-		type=*((BYTE *)(p+1));
-		tptr=surface+t_p;
-		*((WORD *)tptr)=0;
-		/* where now */
-		if(!*((WORD *)(tptr+pitch))) {
-			t_p+=pitch;
-		} else {
-			lval=*((WORD *)(tptr-2));
-			rval=*((WORD *)(tptr+2));
-			if(!lval) {				/* can move left */
-				if(!rval) {			/* can move left or right */
-					if(*((WORD *)(tptr+pitch))==value) {
-						t_p+=droplet_dirs[type];
-					} else {
-						t_p+=dir_tbl[r_idx++];
-						r_idx&=RND_TBL_IDX_MASK;
-					}
-				} else {
-					t_p-=2;			/* can move left only */
-				}
-			} else {				/* cannot move left */
-				if(!rval) {			/* can move right only */
-					t_p+=2;
-				} else {			/* can move up only */
-					if(t_p>=(unsigned)pitch&&!*((WORD *)(tptr-pitch))) {
-						t_p-=pitch;
-					}
-				}
-			}
-		}
-		/* if(t_p>=max) {t_p-=max;} */
-		t_p%=max;
-		/* draw */
-		*((WORD *)(surface+t_p))=(WORD)droplet_colours[type];
-		*p=t_p;
-	}
-}
-
-/* This is a dx_with_lock callback function. */
-static void draw_all_droplets32(int mask,void *vstuff,DDSURFACEDESC *ds) {
-	stuff_t *stuff=vstuff;
-	unsigned *p,j;
-	BYTE *surface;
-
-	surface=ds->lpSurface;
-	fix_droplet_data(stuff,ds->lPitch);
-	p=stuff->drops;
-	for(j=0;j<stuff->num_drops;j++,p+=2) {
-		*((DWORD *)(surface+*p))=droplet_colours[*((BYTE *)(p+1))]&((unsigned)mask);
-	}
-}
-
-/* This is a dx_with_lock callback function. */
-void update_all_droplets32(int no_era,void *vstuff,DDSURFACEDESC *ds) {
-	static unsigned r_idx=0;
-	stuff_t *stuff=vstuff;
-	DWORD value,lval,rval;
-	unsigned max,t_p,type,*p,j;
-	BYTE *tptr,*surface;
-	int pitch;
-
-	value=stuff->pf.dwGBitMask;
-	fix_droplet_data(stuff,ds->lPitch);
-	/* -1 -- droplets go back to top upon falling into the hole rather than falling
-	   below it. */
-	max=(stuff->area_height+stuff->bucket_size-1)*ds->lPitch;
-	/* If the landscape was erased, the old droplets are no longer in place.
-	   This is unfortunate because they must be there. This redraws them. */
-	surface=ds->lpSurface;
-	pitch=ds->lPitch;
-	if(no_era) {
-		p=stuff->drops;
-		for(j=0;j<stuff->num_drops;j++,p+=2) {
-			*((DWORD *)(surface+*p))=droplet_colours[*((BYTE *)(p+1))];
-		}
-		no_era=0;
-	}
-	p=stuff->drops;
-	//for(j=stuff->num_drops;j;j--,p+=2) {
-	for(j=0;j<stuff->num_drops;j++,p+=2) {
-		DWORD below;
-
-		t_p=*p;
-		type=*((BYTE *)(p+1));
-		tptr=surface+t_p;
-		*((DWORD *)tptr)=0;
-		/* where now */
-		below=*(DWORD *)(tptr+pitch);
-		if(below==0) {
-			t_p+=pitch;
-		} else {
-			lval=*((DWORD *)(tptr-4));
-			rval=*((DWORD *)(tptr+4));
-			if(!lval) {				/* can move left */
-				if(!rval) {			/* can move left or right */
-					if(below==value) {
-						t_p+=droplet_dirs[type];
-					} else {
-						t_p+=dir_tbl[r_idx++];
-						r_idx&=RND_TBL_IDX_MASK;
-					}
-				} else {
-					t_p-=4;			/* can move left only */
-				}
-			} else {				/* cannot move left */
-				if(!rval) {			/* can move right only */
-					t_p+=4;
-				} else {			/* can move up only */
-					if(t_p>=(unsigned)pitch&&!*((DWORD *)(tptr-pitch))) {
-						t_p-=pitch;
-					}
-				}
-			}
-		}
-		/* if(t_p>=max) {t_p-=max;} */
-		//t_p%=max;
-		if(t_p>=max) {
-			t_p-=max;
-		}
-		/* draw */
-		*((DWORD *)(surface+t_p))=droplet_colours[type];
-		*p=t_p;
-	}
-}
-
-static int restore_land(stuff_t *stuff) {
-	COLORREF *src;
-	HDC dc;
-	int x,y;
-
-	if(!stuff->land_backup) {
-		return 0;
-	}
-	if(SUCCEEDED(IDirectDrawSurface2_GetDC(stuff->land,&dc))) {
-		src=stuff->land_backup;
-		for(y=0;y<stuff->area_height;y++) {
-			for(x=0;x<stuff->area_width;x++) {
-				SetPixel(dc,x,y,*src++);
-			}
-		}
-		IDirectDrawSurface2_ReleaseDC(stuff->land,dc);
-	}
-	free(stuff->land_backup);
-	stuff->land_backup=0;
-	return 1;
-}
-
-static void save_land(stuff_t *stuff) {
-	COLORREF *dest;
-	HDC dc;
-	int x,y;
-
-	if(stuff->land_backup) {
-		free(stuff->land_backup);
-	}
-	dest=stuff->land_backup=malloc(stuff->area_width*stuff->area_height*sizeof(COLORREF));
-	if(SUCCEEDED(IDirectDrawSurface2_GetDC(stuff->land,&dc))) {
-		for(y=0;y<stuff->area_height;y++) {
-			for(x=0;x<stuff->area_width;x++) {
-				*dest++=GetPixel(dc,x,y);
-			}
-		}
-		IDirectDrawSurface2_ReleaseDC(stuff->land,dc);
-	} else {
-		free(stuff->land_backup);
-		stuff->land_backup=0;
-	}
-}
-
-#if 0
-/* This is a dx_with_lock callback function. */
-static void draw_all_droplets16_asm(int mask,void *vstuff,DDSURFACEDESC *ds) {
-	stuff_t *stuff=vstuff;
-	unsigned *p,j;
-	BYTE *surface;
-
-	surface=ds->lpSurface;
-	fix_droplet_data(stuff,ds->lPitch);
-	p=stuff->drops;
-	for(j=0;j<stuff->num_drops;j++,p+=2) {
-		*((WORD *)(surface+*p))=(WORD)(droplet_colours[*((BYTE *)(p+1))]&((unsigned)mask));
-	}
-}
-
-/* This is a dx_with_lock callback function. */
-void update_all_droplets16_asm(int no_era,void *vstuff,DDSURFACEDESC *ddsd) {
-	DDSURFACEDESC ddsurfacedesc;	// seems to be necessary for assembler syntax
-	unsigned max;
-	/*
-		eax -> 
-		ebx -> counter
-		ecx -> max
-		edx -> pitch
-		esi -> ptr to surface
-		edi
-		ebp
-	*/
-	/* -1 -- droplets go back to top upon falling into the hole rather than falling
-	   below it. */
-	{
-		stuff_t *stuff=vstuff;
-		fix_droplet_data(stuff,ddsd->lPitch);
-		max=(stuff->area_height+stuff->bucket_size-1)*ddsd->lPitch;
-	}
-	__asm {
-		mov edi,vstuff;
-		cmp no_era,0;
-		jne do_droplets;
-redraw_droplets:
-		mov edi,vstuff;
-		mov ecx,[edi].num_drops;
-		dec ecx;
-		mov esi,[edi].drops;
-		mov edi,ddsd;
-		mov edi,[edi]ddsurfacedesc.lpSurface;
-		xor ebx,ebx;
-redraw_droplets_lp:
-		// ptr to cur droplet; counter; ptr to droplet_colours; ptr to surface;
-		mov bl,[esi+ecx*8+4];		// droplet type
-		mov eax,[esi+ecx*8];		// droplet offset
-		mov edx,[ebx*4+droplet_colours];// droplet value in EDX
-		mov [edi+eax],dx;			// write value
-		dec ecx;
-		jns redraw_droplets_lp;
-do_droplets:
-		mov edi,vstuff;
-		mov ecx,[edi].num_drops;
-		mov esi,[edi].drops;
-		dec ecx;
-		mov edi,ddsd;
-		mov ebx,[edi]ddsurfacedesc.lPitch;
-		mov edi,[edi]ddsurfacedesc.lpSurface;
-do_droplets_lp:
-		xor edx,edx;				// erase EDX for OR below
-		mov eax,[esi+ecx*8];		// droplet offset
-		mov word ptr [edi+eax],0;	// erase old droplet
-		add eax,edi;				// eax=address of droplet in surface memory
-		or dx,[eax];				// fetch value, set flags
-		jnz not_move_downwards;
-move_downwards:
-		add eax,ebx;				// move downwards
-		jmp next_droplet;
-
-not_move_downwards:
-		mov dx,[eax-2];				// left droplet
-		
-next_droplet:
-	}
-}
-#endif
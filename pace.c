@@ -0,0 +1,149 @@
+/* Frame pacing. Decides when each tick is due, sleeps until then, and keeps stats on how
+   late ticks actually start. Nothing in here knows about Windows: the clock is passed in,
+   so this can be driven by a fake clock anywhere. */
+#include <math.h>
+#include <string.h>
+#include "pace.h"
+
+/*
+	pace_init
+
+	Initialises a pacer. The first tick is due straight away.
+
+	p -> pacer
+	clock -> clock to use; copied
+	hz -> ticks per second, or 0 for no limit
+*/
+void pace_init(pace_t *p,const pace_clock_t *clock,double hz) {
+	memset(p,0,sizeof(*p));
+	p->clock=*clock;
+	pace_set_rate(p,hz);
+	pace_restart(p);
+}
+
+/*
+	pace_set_rate
+
+	Changes the tick rate. Takes effect from the next deadline; stats are reset, since
+	they're not comparable across rates.
+
+	hz -> ticks per second, or 0 for no limit
+*/
+void pace_set_rate(pace_t *p,double hz) {
+	p->period=hz>0?(pace_time_t)(p->clock.freq/hz+.5):0;
+	if(hz>0&&p->period<1) {
+		p->period=1;
+	}
+	pace_reset_stats(p);
+}
+
+/*
+	pace_restart
+
+	Makes the next tick due now. Call after a pause, so the time spent paused doesn't count
+	as lateness, or against the recent rate.
+*/
+void pace_restart(pace_t *p) {
+	p->next=(*p->clock.now)(p->clock.ctx);
+	p->window_start=p->next;
+	p->window_n=0;
+}
+
+/*
+	pace_due
+
+	Checks whether a tick is due. If it is, its lateness is recorded and the deadline moves
+	on. Deadlines normally move on by exactly one period, so any lateness is made up next
+	time and the average rate is right; if it's more than a whole period behind, it gives up
+	on the ones it's missed rather than trying to catch up with a burst of ticks.
+
+	Return: non-0 if a tick should be done now.
+*/
+int pace_due(pace_t *p) {
+	pace_time_t now=(*p->clock.now)(p->clock.ctx),late;
+
+	late=now-p->next;
+	if(p->period&&late<0) {
+		return 0;
+	}
+	if(!p->period) {
+		late=0;
+	}
+	if(!p->n) {
+		p->first=now;
+	}
+	p->last=now;
+	p->n++;
+	p->sum+=(double)late;
+	p->sum_sq+=(double)late*late;
+	if(late>p->max) {
+		p->max=(double)late;
+	}
+	/* Recent rate is worked out every half second. Uncapped, that's the only way to see
+	   how fast it's going now rather than on average. */
+	p->window_n++;
+	if(now-p->window_start>=p->clock.freq/2) {
+		p->recent_hz=p->window_n*(double)p->clock.freq/(now-p->window_start);
+		p->window_start=now;
+		p->window_n=0;
+	}
+	if(!p->period) {
+		p->next=now;
+	} else if(late>=p->period) {
+		p->missed+=(unsigned)(late/p->period);
+		p->next=now+p->period;
+	} else {
+		p->next+=p->period;
+	}
+	return 1;
+}
+
+/*
+	pace_wait
+
+	Sleeps until the next deadline, or until the clock's sleep is cut short (a command
+	turning up, for example). Returns straight away if a tick is due already or there's no
+	limit.
+
+	Return: non-0 if woken early.
+*/
+int pace_wait(pace_t *p) {
+	if(!p->period||(*p->clock.now)(p->clock.ctx)>=p->next) {
+		return 0;
+	}
+	return (*p->clock.sleep_until)(p->clock.ctx,p->next);
+}
+
+void pace_reset_stats(pace_t *p) {
+	p->n=p->missed=0;
+	p->sum=p->sum_sq=p->max=0;
+	p->first=p->last=0;
+	p->window_start=(*p->clock.now)(p->clock.ctx);
+	p->window_n=0;
+	p->recent_hz=0;
+}
+
+/*
+	pace_get_stats
+
+	Fills in a summary of the stats so far.
+*/
+void pace_get_stats(const pace_t *p,pace_stats_t *s) {
+	double to_ms=1000./p->clock.freq;
+
+	memset(s,0,sizeof(*s));
+	s->target_hz=p->period?(double)p->clock.freq/p->period:0;
+	s->ticks=p->n;
+	s->missed=p->missed;
+	s->recent_hz=p->recent_hz;
+	if(p->n) {
+		double mean=p->sum/p->n,var=p->sum_sq/p->n-mean*mean;
+
+		s->mean_ms=mean*to_ms;
+		s->sd_ms=sqrt(var>0?var:0)*to_ms;
+		s->max_ms=p->max*to_ms;
+	}
+	if(p->n>1&&p->last>p->first) {
+		s->achieved_hz=(p->n-1)*(double)p->clock.freq/(p->last-p->first);
+	}
+}
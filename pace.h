@@ -0,0 +1,49 @@
+#ifndef TOM_PACE_H
+#define TOM_PACE_H
+
+/* Times are in clock units; see pace_clock_t::freq. */
+typedef long long pace_time_t;
+
+/* Where the time comes from, and how to wait for it. The engine supplies one built on
+   QueryPerformanceCounter; anything else (a mock clock, say) will do just as well. */
+typedef struct pace_clock_t {
+	pace_time_t (*now)(void *ctx);		/* current time; must never go backwards */
+	int (*sleep_until)(void *ctx,pace_time_t when);	/* wait until when; return non-0 if woken early */
+	pace_time_t freq;					/* clock units per second */
+	void *ctx;
+}pace_clock_t;
+
+/* Summary of how well deadlines have been kept since stats were last reset. Lateness is
+   how long after its deadline each tick actually started. */
+typedef struct pace_stats_t {
+	double target_hz;					/* 0 if uncapped */
+	double achieved_hz;					/* ticks per second actually done */
+	double recent_hz;					/* same, over the last half second or so */
+	unsigned ticks;						/* number of ticks timed */
+	unsigned missed;					/* deadlines skipped because it fell too far behind */
+	double mean_ms,sd_ms,max_ms;		/* lateness */
+}pace_stats_t;
+
+typedef struct pace_t {
+	pace_clock_t clock;
+	pace_time_t period;					/* time between deadlines; 0 means uncapped */
+	pace_time_t next;					/* next deadline */
+
+	/* Stats */
+	unsigned n,missed;
+	double sum,sum_sq,max;				/* lateness, in clock units */
+	pace_time_t first,last;				/* times of first and last tick timed */
+	pace_time_t window_start;			/* start of current recent_hz window */
+	unsigned window_n;					/* ticks in current window */
+	double recent_hz;
+}pace_t;
+
+void pace_init(pace_t *p,const pace_clock_t *clock,double hz);
+void pace_set_rate(pace_t *p,double hz);
+void pace_restart(pace_t *p);
+int pace_due(pace_t *p);
+int pace_wait(pace_t *p);
+void pace_reset_stats(pace_t *p);
+void pace_get_stats(const pace_t *p,pace_stats_t *s);
+
+#endif
@@ -0,0 +1,251 @@
+/* Tests for pace.c, on a mock clock, so they run anywhere and take no time. Build and run
+   with "make test" (any C99 compiler; see the Makefile). Prints what failed, if anything,
+   and exits non-0 if something did. */
+#include <stdio.h>
+#include <math.h>
+#include "pace.h"
+
+/* Mock clock: microseconds, which only move when told to, or when slept through. */
+#define FREQ (1000000)
+
+typedef struct mock_t {
+	pace_time_t now;
+	int sleeps;							/* number of times sleep_until was called */
+}mock_t;
+
+static int failures;
+
+#define CHECK(COND) check((COND),#COND,__LINE__)
+#define CHECK_NEAR(A,B) check(fabs((double)(A)-(double)(B))<1e-6,#A " == " #B,__LINE__)
+
+static void check(int ok,const char *what,int line) {
+	if(!ok) {
+		printf("pace_test.c(%d): failed: %s\n",line,what);
+		failures++;
+	}
+}
+
+static pace_time_t mock_now(void *ctx) {
+	return ((mock_t *)ctx)->now;
+}
+
+static int mock_sleep_until(void *ctx,pace_time_t when) {
+	mock_t *m=ctx;
+
+	m->sleeps++;
+	if(when>m->now) {
+		m->now=when;
+	}
+	return 0;
+}
+
+static void start(pace_t *p,mock_t *m,double hz) {
+	pace_clock_t clock;
+
+	m->now=1000;
+	m->sleeps=0;
+	clock.now=mock_now;
+	clock.sleep_until=mock_sleep_until;
+	clock.freq=FREQ;
+	clock.ctx=m;
+	pace_init(p,&clock,hz);
+}
+
+/*
+	tick
+
+	Waits for the next deadline, then lets late more microseconds go by before seeing
+	whether a tick is due, as a slow wakeup would.
+
+	Return: what pace_due said.
+*/
+static int tick(pace_t *p,mock_t *m,pace_time_t late) {
+	pace_wait(p);
+	m->now+=late;
+	return pace_due(p);
+}
+
+/* Every tick bang on time: no lateness, the asked for rate, no misses. */
+static void test_on_time(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+	int i,due=0;
+
+	start(&p,&m,100);
+	for(i=0;i<101;i++) {
+		due+=tick(&p,&m,0);
+	}
+	pace_get_stats(&p,&s);
+	CHECK(due==101);
+	CHECK(s.ticks==101);
+	CHECK(s.missed==0);
+	CHECK_NEAR(s.target_hz,100);
+	CHECK_NEAR(s.achieved_hz,100);
+	CHECK_NEAR(s.mean_ms,0);
+	CHECK_NEAR(s.sd_ms,0);
+	CHECK_NEAR(s.max_ms,0);
+	/* The first was due straight away; the rest had to be waited for */
+	CHECK(m.sleeps==100);
+}
+
+/* A tick isn't due before its deadline, and is once it's got there. */
+static void test_not_early(void) {
+	pace_t p;
+	mock_t m;
+
+	start(&p,&m,100);
+	CHECK(pace_due(&p));
+	CHECK(!pace_due(&p));
+	m.now+=FREQ/100-1;
+	CHECK(!pace_due(&p));
+	m.now++;
+	CHECK(pace_due(&p));
+}
+
+/* Lateness of 0 and 2 ms in turn: mean 1, standard deviation 1, worst 2. A late tick
+   doesn't push the deadlines back, so the rate still comes out right. */
+static void test_jitter(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+	int i;
+
+	start(&p,&m,100);
+	for(i=0;i<100;i++) {
+		tick(&p,&m,i&1?2000:0);
+	}
+	/* One more on time, so the first and last ticks are both on time */
+	tick(&p,&m,0);
+	pace_get_stats(&p,&s);
+	CHECK(s.ticks==101);
+	CHECK(s.missed==0);
+	CHECK_NEAR(s.achieved_hz,100);
+	CHECK(fabs(s.mean_ms-100/101.)<1e-6);
+	CHECK(fabs(s.max_ms-2)<1e-6);
+	CHECK(s.sd_ms>0.99&&s.sd_ms<1.01);
+}
+
+/* More than a period behind, the deadlines missed are counted and skipped, rather than
+   caught up with a burst of ticks. */
+static void test_missed(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+
+	start(&p,&m,100);
+	CHECK(tick(&p,&m,0));
+	/* 3.5 periods late: 3 deadlines missed */
+	CHECK(tick(&p,&m,35000));
+	pace_get_stats(&p,&s);
+	CHECK(s.missed==3);
+	CHECK_NEAR(s.max_ms,35);
+	/* The next is a whole period on, not straight away */
+	CHECK(!pace_due(&p));
+	m.now+=FREQ/100;
+	CHECK(pace_due(&p));
+	pace_get_stats(&p,&s);
+	CHECK(s.missed==3);
+}
+
+/* Uncapped, every tick is due and none is late, however long it's been. */
+static void test_uncapped(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+	int i;
+
+	start(&p,&m,0);
+	for(i=0;i<10;i++) {
+		CHECK(pace_due(&p));
+		m.now+=(i+1)*1000;
+	}
+	CHECK(pace_wait(&p)==0);
+	CHECK(m.sleeps==0);
+	pace_get_stats(&p,&s);
+	CHECK_NEAR(s.target_hz,0);
+	CHECK(s.ticks==10);
+	CHECK(s.missed==0);
+	CHECK_NEAR(s.max_ms,0);
+}
+
+/* Time spent paused doesn't count: after pace_restart, the next tick is due now, on
+   time. */
+static void test_restart(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+
+	start(&p,&m,100);
+	CHECK(tick(&p,&m,0));
+	m.now+=10*FREQ;
+	pace_restart(&p);
+	CHECK(pace_due(&p));
+	pace_get_stats(&p,&s);
+	CHECK(s.missed==0);
+	CHECK_NEAR(s.max_ms,0);
+}
+
+/* A new rate starts the stats again, and the deadlines go at the new rate. */
+static void test_set_rate(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+	int i;
+
+	start(&p,&m,100);
+	for(i=0;i<5;i++) {
+		tick(&p,&m,i*1000);
+	}
+	pace_set_rate(&p,50);
+	pace_get_stats(&p,&s);
+	CHECK(s.ticks==0);
+	CHECK(s.missed==0);
+	CHECK_NEAR(s.max_ms,0);
+	CHECK_NEAR(s.target_hz,50);
+	pace_restart(&p);
+	for(i=0;i<51;i++) {
+		tick(&p,&m,0);
+	}
+	pace_get_stats(&p,&s);
+	CHECK_NEAR(s.achieved_hz,50);
+}
+
+/* Recent rate is over the last half second, so it shows a change of speed that the
+   average hides. */
+static void test_recent(void) {
+	pace_t p;
+	mock_t m;
+	pace_stats_t s;
+	int i;
+
+	start(&p,&m,0);
+	for(i=0;i<1000;i++) {
+		pace_due(&p);
+		m.now+=1000;
+	}
+	for(i=0;i<4000;i++) {
+		pace_due(&p);
+		m.now+=250;
+	}
+	pace_get_stats(&p,&s);
+	CHECK(fabs(s.recent_hz-4000)<1);
+	CHECK(s.achieved_hz<3000);
+}
+
+int main(void) {
+	test_on_time();
+	test_not_early();
+	test_jitter();
+	test_missed();
+	test_uncapped();
+	test_restart();
+	test_set_rate();
+	test_recent();
+	if(failures) {
+		printf("pace_test: %d failed\n",failures);
+		return 1;
+	}
+	printf("pace_test: OK\n");
+	return 0;
+}
@@ -0,0 +1,373 @@
+/* Render stage. The engine keeps the world as one byte per cell, each an index into a
+   palette; this turns rows of those into the display's pixel format, 16 cells at a time
+   with table lookups, zooming them up if need be. Changing the colours is just a new
+   palette. */
+#include <windows.h>
+#include <ddraw.h>
+#include <tmmintrin.h>
+#include <immintrin.h>
+#include <string.h>
+#include <malloc.h>
+#include "debug.h"
+#include "land.h"
+#include "cpu.h"
+#include "render.h"
+
+typedef void (*expand_fn)(void *dest,const BYTE *src,int n,const palette_t *pal);
+typedef void (*replicate_fn)(BYTE *dest,const BYTE *src,int n,int k);
+
+static void expand16_c(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void expand32_c(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void expand16_ssse3(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void expand32_ssse3(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void expand32_avx2(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void expand16_avx512(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void expand32_avx512(void *dest,const BYTE *src,int n,const palette_t *pal);
+static void replicate_c(BYTE *dest,const BYTE *src,int n,int k);
+static void replicate_ssse3(BYTE *dest,const BYTE *src,int n,int k);
+
+/* Fastest last. Each needs the CPU to do cpu (CPU_xxx) or better. */
+static const struct {
+	const char *name;
+	int cpu;
+	expand_fn expand16,expand32;
+	replicate_fn replicate;
+}renderers[NUM_RENDERERS]={
+	{"C",CPU_C,expand16_c,expand32_c,replicate_c},
+	{"SSSE3",CPU_SSSE3,expand16_ssse3,expand32_ssse3,replicate_ssse3},
+	{"AVX2",CPU_AVX2,expand16_ssse3,expand32_avx2,replicate_ssse3},
+	{"AVX-512",CPU_AVX512,expand16_avx512,expand32_avx512,replicate_ssse3},
+};
+
+/* Renderer in use; -1 until the CPU's been looked at. */
+static int renderer=-1;
+
+/*
+	render_set
+
+	Picks a renderer. Normally the best one the CPU can do is picked the first time it's
+	needed; this is for the benchmark.
+
+	r -> RENDER_xxx
+
+	Return: non-0 if OK, 0 if the CPU can't do it, or -cpu rules it out.
+*/
+int render_set(int r) {
+	if(r<0||r>=NUM_RENDERERS||!cpu_has(renderers[r].cpu)) {
+		return 0;
+	}
+	renderer=r;
+	return 1;
+}
+
+/* Returns the renderer in use, picking the best one if there isn't one yet. */
+int render_get(void) {
+	if(renderer<0) {
+		int r;
+
+		for(r=NUM_RENDERERS-1;!cpu_has(renderers[r].cpu);r--) {
+		}
+		renderer=r;
+		dprintf("render: using %s\n",renderers[r].name);
+	}
+	return renderer;
+}
+
+const char *render_name(int r) {
+	return r>=0&&r<NUM_RENDERERS?renderers[r].name:"?";
+}
+
+/*
+	render_supports
+
+	Returns non-0 if rows can be rendered at the given colour depth.
+
+	bpp -> bits per pixel
+*/
+int render_supports(unsigned bpp) {
+	return bpp==16||bpp==32;
+}
+
+/*
+	render_palette
+
+	Makes a palette for the given pixel format.
+
+	pal -> palette to fill in
+	pf -> display's pixel format
+	colours -> colour of each cell, CELL_xxx order
+	num_colours -> number of entries in colours; the rest of the palette is black
+*/
+void render_palette(palette_t *pal,const DDPIXELFORMAT *pf,const COLORREF *colours,int num_colours) {
+	int i,j;
+
+	memset(pal,0,sizeof(*pal));
+	pal->bpp=pf->dwRGBBitCount/8;
+	for(i=0;i<PALETTE_SIZE&&i<num_colours;i++) {
+		pal->colours[i]=land_colour(pf,colours[i]);
+	}
+	for(i=0;i<PALETTE_SIZE;i++) {
+		for(j=0;j<4;j++) {
+			pal->planes[j][i]=(BYTE)(pal->colours[i]>>(j*8));
+		}
+	}
+}
+
+static void expand16_c(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	WORD *d=dest;
+	int i;
+
+	for(i=0;i<n;i++) {
+		d[i]=(WORD)pal->colours[src[i]&(PALETTE_SIZE-1)];
+	}
+}
+
+static void expand32_c(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	DWORD *d=dest;
+	int i;
+
+	for(i=0;i<n;i++) {
+		d[i]=pal->colours[src[i]&(PALETTE_SIZE-1)];
+	}
+}
+
+/*
+	expand16_ssse3
+
+	Each pshufb looks up 16 cells' worth of one byte of output; two of them, interleaved,
+	make 16 pixels.
+*/
+static void expand16_ssse3(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	__m128i lo_tbl=_mm_loadu_si128((const __m128i *)pal->planes[0]);
+	__m128i hi_tbl=_mm_loadu_si128((const __m128i *)pal->planes[1]);
+	__m128i mask=_mm_set1_epi8(PALETTE_SIZE-1);
+	BYTE *d=dest;
+	int i;
+
+	for(i=0;i+16<=n;i+=16,d+=32) {
+		__m128i idx=_mm_and_si128(_mm_loadu_si128((const __m128i *)(src+i)),mask);
+		__m128i lo=_mm_shuffle_epi8(lo_tbl,idx),hi=_mm_shuffle_epi8(hi_tbl,idx);
+
+		_mm_storeu_si128((__m128i *)d,_mm_unpacklo_epi8(lo,hi));
+		_mm_storeu_si128((__m128i *)(d+16),_mm_unpackhi_epi8(lo,hi));
+	}
+	expand16_c(d,src+i,n-i,pal);
+}
+
+/* Same, with four bytes of output */
+static void expand32_ssse3(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	__m128i t0=_mm_loadu_si128((const __m128i *)pal->planes[0]);
+	__m128i t1=_mm_loadu_si128((const __m128i *)pal->planes[1]);
+	__m128i t2=_mm_loadu_si128((const __m128i *)pal->planes[2]);
+	__m128i t3=_mm_loadu_si128((const __m128i *)pal->planes[3]);
+	__m128i mask=_mm_set1_epi8(PALETTE_SIZE-1);
+	BYTE *d=dest;
+	int i;
+
+	for(i=0;i+16<=n;i+=16,d+=64) {
+		__m128i idx=_mm_and_si128(_mm_loadu_si128((const __m128i *)(src+i)),mask);
+		__m128i b0=_mm_shuffle_epi8(t0,idx),b1=_mm_shuffle_epi8(t1,idx);
+		__m128i b2=_mm_shuffle_epi8(t2,idx),b3=_mm_shuffle_epi8(t3,idx);
+		__m128i lo01=_mm_unpacklo_epi8(b0,b1),hi01=_mm_unpackhi_epi8(b0,b1);
+		__m128i lo23=_mm_unpacklo_epi8(b2,b3),hi23=_mm_unpackhi_epi8(b2,b3);
+
+		_mm_storeu_si128((__m128i *)d,_mm_unpacklo_epi16(lo01,lo23));
+		_mm_storeu_si128((__m128i *)(d+16),_mm_unpackhi_epi16(lo01,lo23));
+		_mm_storeu_si128((__m128i *)(d+32),_mm_unpacklo_epi16(hi01,hi23));
+		_mm_storeu_si128((__m128i *)(d+48),_mm_unpackhi_epi16(hi01,hi23));
+	}
+	expand32_c(d,src+i,n-i,pal);
+}
+
+/*
+	expand32_avx2
+
+	vpermd looks up 8 dwords at once, but only from an 8-entry table, so there are two
+	lookups (bottom and top half of the palette) and a blend.
+*/
+static void expand32_avx2(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	__m256i lo_tbl=_mm256_loadu_si256((const __m256i *)pal->colours);
+	__m256i hi_tbl=_mm256_loadu_si256((const __m256i *)(pal->colours+8));
+	__m256i mask=_mm256_set1_epi32(PALETTE_SIZE-1),seven=_mm256_set1_epi32(7);
+	BYTE *d=dest;
+	int i;
+
+	for(i=0;i+8<=n;i+=8,d+=32) {
+		__m256i idx=_mm256_and_si256(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src+i))),mask);
+		__m256i lo=_mm256_permutevar8x32_epi32(lo_tbl,idx);
+		__m256i hi=_mm256_permutevar8x32_epi32(hi_tbl,idx);
+
+		_mm256_storeu_si256((__m256i *)d,_mm256_blendv_epi8(lo,hi,_mm256_cmpgt_epi32(idx,seven)));
+	}
+	/* Don't pay for the AVX-SSE transition in whatever's next */
+	_mm256_zeroupper();
+	expand32_c(d,src+i,n-i,pal);
+}
+
+/*
+	expand32_avx512
+
+	With 16 dwords to a register, vpermd looks up the whole palette at once.
+*/
+static void expand32_avx512(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	__m512i tbl=_mm512_loadu_si512(pal->colours);
+	BYTE *d=dest;
+	int i;
+
+	/* Stores that straddle cache lines cost more than the lookups; get to a whole line */
+	i=min((int)((64-((UINT_PTR)d&63))&63)/4,n);
+	expand32_c(d,src,i,pal);
+	d+=i*4;
+	/* vpermd only looks at the bottom 4 bits of each index, which does the masking */
+	for(;i+16<=n;i+=16,d+=64) {
+		__m512i idx=_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(src+i)));
+
+		_mm512_storeu_si512(d,_mm512_permutexvar_epi32(idx,tbl));
+	}
+	_mm256_zeroupper();
+	expand32_c(d,src+i,n-i,pal);
+}
+
+/* Same with words, using vpermw, 32 cells at a time. Its table is 32 entries, so the
+   indices are masked to keep them in the bottom half, where the palette is. An odd
+   address never lines up, but pitches are even. */
+static void expand16_avx512(void *dest,const BYTE *src,int n,const palette_t *pal) {
+	__m512i tbl=_mm512_castsi256_si512(_mm512_cvtepi32_epi16(_mm512_loadu_si512(pal->colours)));
+	__m512i mask=_mm512_set1_epi16(PALETTE_SIZE-1);
+	BYTE *d=dest;
+	int i;
+
+	i=min((int)((64-((UINT_PTR)d&63))&63)/2,n);
+	expand16_c(d,src,i,pal);
+	d+=i*2;
+	for(;i+32<=n;i+=32,d+=64) {
+		__m512i idx=_mm512_and_si512(_mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i *)(src+i))),mask);
+
+		_mm512_storeu_si512(d,_mm512_permutexvar_epi16(idx,tbl));
+	}
+	_mm256_zeroupper();
+	expand16_c(d,src+i,n-i,pal);
+}
+
+/*
+	render_rows
+
+	Converts a block of cells into the display format.
+
+	dest -> top left of where to write
+	dest_pitch -> distance between rows at dest, in bytes
+	src -> top left of cells
+	src_pitch -> distance between rows at src, in bytes
+	w,h -> size of block, in cells
+	pal -> palette to use; says how many bytes per pixel dest is
+*/
+void render_rows(void *dest,int dest_pitch,const BYTE *src,int src_pitch,int w,int h,const palette_t *pal) {
+	int r=render_get(),y;
+	expand_fn expand=pal->bpp==2?renderers[r].expand16:renderers[r].expand32;
+
+	for(y=0;y<h;y++) {
+		(*expand)((BYTE *)dest+y*dest_pitch,src+y*src_pitch,w,pal);
+	}
+}
+
+/*
+	replicate_c
+
+	Repeats each cell k times.
+
+	dest -> where to write
+	src -> cells to read; there must be enough to make n
+	n -> number of cells to write; the last source cell may be cut short
+	k -> number of times to repeat each cell
+*/
+static void replicate_c(BYTE *dest,const BYTE *src,int n,int k) {
+	int i,j;
+
+	for(i=0;i<n;src++) {
+		for(j=0;j<k&&i<n;j++) {
+			dest[i++]=*src;
+		}
+	}
+}
+
+/*
+	replicate_ssse3
+
+	16 source cells make k lots of 16 output cells, each a pshufb of the source with its
+	own mask, so any factor up to 16 works the same way.
+*/
+static void replicate_ssse3(BYTE *dest,const BYTE *src,int n,int k) {
+	__m128i masks[16];
+	int i,j,c;
+
+	if(k>16) {
+		replicate_c(dest,src,n,k);
+		return;
+	}
+	for(c=0;c<k;c++) {
+		BYTE m[16];
+
+		for(j=0;j<16;j++) {
+			m[j]=(BYTE)((c*16+j)/k);
+		}
+		masks[c]=_mm_loadu_si128((const __m128i *)m);
+	}
+	/* Only whole lots of 16 source cells, so nothing past the end is read */
+	for(i=0;i+16*k<=n;i+=16*k,src+=16) {
+		__m128i cells=_mm_loadu_si128((const __m128i *)src);
+
+		for(c=0;c<k;c++) {
+			_mm_storeu_si128((__m128i *)(dest+i+c*16),_mm_shuffle_epi8(cells,masks[c]));
+		}
+	}
+	replicate_c(dest+i,src,n-i,k);
+}
+
+/*
+	render_zoom
+
+	Same as render_rows, but each cell is zx by zy pixels. Cells are repeated across the
+	row before expanding, so expanding is done once per row of pixels, and the other rows
+	of each cell are copies.
+
+	dest -> top left of where to write
+	dest_pitch -> distance between rows at dest, in bytes
+	dest_w,dest_h -> size of block to write, in pixels; the last column and row of cells
+	may be cut short
+	src -> top left of cells
+	src_pitch -> distance between rows at src, in bytes
+	zx,zy -> zoom factors
+	pal -> palette to use; says how many bytes per pixel dest is
+
+	Return: non-0 if OK, 0 if there wasn't enough memory.
+*/
+int render_zoom(void *dest,int dest_pitch,int dest_w,int dest_h,const BYTE *src,int src_pitch,int zx,int zy,const palette_t *pal) {
+	int r=render_get(),y,j,n=dest_w*pal->bpp;
+	expand_fn expand=pal->bpp==2?renderers[r].expand16:renderers[r].expand32;
+	BYTE *row=0,*d;
+
+	if(zx==1&&zy==1) {
+		render_rows(dest,dest_pitch,src,src_pitch,dest_w,dest_h,pal);
+		return 1;
+	}
+	if(zx>1) {
+		row=_aligned_malloc(dest_w+16,16);
+		if(!row) {
+			return 0;
+		}
+	}
+	for(y=0;y<dest_h;y+=zy,src+=src_pitch) {
+		d=(BYTE *)dest+y*dest_pitch;
+		if(row) {
+			(*renderers[r].replicate)(row,src,dest_w,zx);
+			(*expand)(d,row,dest_w,pal);
+		} else {
+			(*expand)(d,src,dest_w,pal);
+		}
+		for(j=1;j<zy&&y+j<dest_h;j++) {
+			memcpy(d+j*dest_pitch,d,n);
+		}
+	}
+	_aligned_free(row);
+	return 1;
+}
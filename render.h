@@ -0,0 +1,34 @@
+#ifndef TOM_RENDER_H
+#define TOM_RENDER_H
+
+#include <ddraw.h>
+
+/* Palettes have this many entries, so a whole palette fits in one SSE register per byte
+   of output. Cells (CELL_xxx) must be less than this. */
+#define PALETTE_SIZE (16)
+
+/* What each cell looks like in the display's pixel format. */
+typedef struct palette_t {
+	int bpp;							/* bytes per pixel: 2 or 4 */
+	DWORD colours[PALETTE_SIZE];		/* display format value for each cell */
+	BYTE planes[4][PALETTE_SIZE];		/* same, split into bytes, for pshufb */
+}palette_t;
+
+/* Ways of expanding rows */
+enum {
+	RENDER_C,							/* plain C; always available */
+	RENDER_SSSE3,						/* pshufb */
+	RENDER_AVX2,						/* vpermd; 32bpp only, 16bpp uses pshufb */
+	RENDER_AVX512,						/* vpermd, vpermw: whole palette in one lookup */
+	NUM_RENDERERS
+};
+
+int render_supports(unsigned bpp);
+void render_palette(palette_t *pal,const DDPIXELFORMAT *pf,const COLORREF *colours,int num_colours);
+int render_set(int renderer);
+int render_get(void);
+const char *render_name(int renderer);
+void render_rows(void *dest,int dest_pitch,const BYTE *src,int src_pitch,int w,int h,const palette_t *pal);
+int render_zoom(void *dest,int dest_pitch,int dest_w,int dest_h,const BYTE *src,int src_pitch,int zx,int zy,const palette_t *pal);
+
+#endif
@@ -34,6 +34,27 @@
 #define IDS_RESIZE_INVALID              30
 #define IDS_RESIZE_INVALID_TITLE        31
 #define IDS_RESIZE_TOOSMALL             32
+#define IDS_FLOOD_ON                    33
+#define IDS_FLOOD_OFF                   34
+#define IDS_NO_ENGINE                   35
+#define IDS_SPEED_MSG                   36
+#define IDS_TIMING_INFO                 37
+#define IDS_TIMING_TITLE                38
+#define IDS_TURBO_MSG                   39
+#define IDS_THROUGHPUT                  40
+#define IDS_MAGENTA_NAME                41
+#define IDS_ORANGE_NAME                 42
+#define IDS_GATE_ON                     43
+#define IDS_GATE_OFF                    44
+#define IDS_GATE_ADDED                  45
+#define IDS_GATES_FULL                  46
+#define IDS_GATE_INFO                   47
+#define IDS_CPU_INFO                    48
+#define IDS_BAD_CPU                     49
+#define IDS_SETTLED                     50
+#define IDS_MAP_INFO                    51
+#define IDS_BAD_MAPPED                  52
+#define IDS_HASH_INFO                   53
 #define PROGICON                        101
 #define ID_MAINMENU                     104
 #define IDD_RESIZE                      105
@@ -72,13 +93,31 @@
 #define ID_TOOLS_FILL                   40044
 #define ID_F__KING_DEVSTUDIO            40047
 #define ID_OPTIONS_ASSEMBLERVERSION     40048
+#define ID_TOOLS_FLOODFILL              40049
+#define ID_SPEED_50                     40050
+#define ID_SPEED_100                    40051
+#define ID_SPEED_200                    40052
+#define ID_SPEED_500                    40053
+#define ID_TOOLS_TIMING                 40054
+#define ID_SPEED_TURBO                  40055
+#define ID_OPTIONS_NIGHTCOLOURS         40056
+#define IDA_ZOOM4                       40057
+#define IDA_ZOOM6                       40058
+#define IDA_ZOOM8                       40059
+#define IDA_BRUSHMAGENTA                40060
+#define IDA_BRUSHORANGE                 40061
+#define ID_TOOLS_GATE                   40062
+#define ID_TOOLS_CLEARGATES             40063
+#define ID_OPTIONS_POOLS                40064
+#define ID_OPTIONS_PRESSURE             40065
+#define ID_OPTIONS_ROWORDER             40066
 
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
 #define _APS_NEXT_RESOURCE_VALUE        109
-#define _APS_NEXT_COMMAND_VALUE         40049
+#define _APS_NEXT_COMMAND_VALUE         40067
 #define _APS_NEXT_CONTROL_VALUE         1004
 #define _APS_NEXT_SYMED_VALUE           101
 #endif
@@ -0,0 +1,534 @@
+/* Parameter sweeps. Runs lots of worlds, each with its own mix of settings, and collects a
+   line of results from each into one file.
+
+	waterworks -sweep <spec file> [-jobs N] [-o FILE]
+
+   Each world has an engine of its own, on a thread of its own, and the engine keeps
+   nothing outside engine_t, so they all share this process. As many run at once as there
+   are CPUs (or -jobs says), each tied to a CPU of its own, so they don't get in each
+   other's way.
+
+   The spec file has a line for each setting to vary, e.g.:
+
+	size 640x400 1280x800
+	drops 20000 100000
+	neck 3 5 8
+	seed 1-4
+	land shelves empty vessels
+	ticks 10000
+
+   and every combination is run. A range a-b is every whole number from a to b; # starts a
+   comment. Settings not mentioned have the one value in key_defaults. */
+#include <process.h>
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "debug.h"
+#include "land.h"
+#include "engine.h"
+#include "cpu.h"
+#include "sweep.h"
+
+/* How often to see where the droplets have got to, in ticks */
+#define STEADY_TICKS (100)
+/* It's steady when, STEADY_LOOKS looks running, no band has gained or lost more than
+   1/STEADY_FRACTION of the droplets since the look before. */
+#define STEADY_FRACTION (200)
+#define STEADY_LOOKS (5)
+/* The landscape is split into this many bands, top to bottom, for the distribution */
+#define NUM_BANDS (4)
+
+/* Most values for any one setting */
+#define MAX_VALUES (256)
+/* Most worlds at once; WaitForMultipleObjects can't wait for more */
+#define MAX_JOBS (MAXIMUM_WAIT_OBJECTS)
+
+static const char *const land_names[NUM_SWEEP_LANDS]={"empty","shelves","vessels"};
+
+/* What a sweep can vary, and what it is if the spec doesn't say. Innermost last, i.e.,
+   runs go through the ticks values first. */
+enum {
+	KEY_SIZE,KEY_DROPS,KEY_NECK,KEY_SEED,KEY_LAND,KEY_TICKS,NUM_KEYS
+};
+static const char *const key_names[NUM_KEYS]={"size","drops","neck","seed","land","ticks"};
+static const char *const key_defaults[NUM_KEYS]={"640x400","100000","5","1","shelves","10000"};
+
+typedef struct {
+	char *values[NUM_KEYS][MAX_VALUES];
+	int num[NUM_KEYS];
+}spec_t;
+
+/* A world that's running. There's one for each of the -jobs, which decides the CPU. */
+typedef struct {
+	HANDLE thread;						/* 0 if this one's free */
+	int run;							/* index of run */
+	sweep_world_t world;
+	char line[256];						/* its result */
+}job_t;
+
+/* Column headings, matching sweep_world's output */
+static const char heading[]=
+	"  run size          drops  neck   seed land       ticks   ticks/s  steady  bucket   band1   band2   band3   band4             hash";
+
+static double now(void) {
+	LARGE_INTEGER t,freq;
+
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return t.QuadPart/(double)freq.QuadPart;
+}
+
+/*
+	sweep_land
+
+	Returns the SWEEP_LAND_xxx with the given name, or -1 if there isn't one.
+*/
+int sweep_land(const char *name) {
+	int i;
+
+	for(i=0;i<NUM_SWEEP_LANDS;i++) {
+		if(strcmp(name,land_names[i])==0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+	sweep_vessels
+
+	Gets the insides of the arms of the U-tube that SWEEP_LAND_VESSELS draws, in landscape
+	coordinates: arms[0] is under the bucket, and the water falls into it; arms[1] is
+	beside it, and the water only gets there along the bottom, under the wall between.
+*/
+void sweep_vessels(int width,int height,RECT *arms) {
+	SetRect(&arms[0],width/8+2,height/8,width*5/8-1,height*15/16-1);
+	SetRect(&arms[1],width*5/8+2,height/8,width*7/8-1,height*15/16-1);
+}
+
+/*
+	sweep_draw_land
+
+	Draws one of the SWEEP_LAND_xxx landscapes, by posting commands to the engine.
+*/
+void sweep_draw_land(engine_t *e,int land) {
+	int w=e->area_width,ht=e->area_height,y,i;
+	RECT arms[2];
+	cmd_t c;
+
+	switch(land) {
+	case SWEEP_LAND_SHELVES:
+		c.type=CMD_STROKE;
+		c.u.stroke.size=3;
+		c.u.stroke.cell=CELL_YELLOW;
+		c.u.stroke.flood=0;
+		for(y=ht/8;y<ht*7/8;y+=ht/8) {
+			if((y/(ht/8))&1) {
+				c.u.stroke.x1=0;
+				c.u.stroke.x2=w*3/4;
+				c.u.stroke.y1=y;
+				c.u.stroke.y2=y+ht/32;
+			} else {
+				c.u.stroke.x1=w/4;
+				c.u.stroke.x2=w;
+				c.u.stroke.y1=y+ht/32;
+				c.u.stroke.y2=y;
+			}
+			engine_post(e,&c);
+		}
+		break;
+	case SWEEP_LAND_VESSELS:
+		sweep_vessels(w,ht,arms);
+		c.type=CMD_STROKE;
+		c.u.stroke.size=3;
+		c.u.stroke.cell=CELL_YELLOW;
+		c.u.stroke.flood=0;
+		for(i=0;i<3;i++) {
+			/* Left, middle and right walls; the middle one stops short of the bottom */
+			c.u.stroke.x1=c.u.stroke.x2=i<2?arms[i].left-2:arms[1].right+1;
+			c.u.stroke.y1=ht/8;
+			c.u.stroke.y2=i==1?ht*13/16:ht*15/16;
+			engine_post(e,&c);
+		}
+		c.u.stroke.x1=arms[0].left-2;
+		c.u.stroke.x2=arms[1].right+1;
+		c.u.stroke.y1=c.u.stroke.y2=ht*15/16;
+		engine_post(e,&c);
+		break;
+	}
+}
+
+/*
+	count_bands
+
+	Counts the droplets in the bucket (bands[0]), and in each band of the landscape
+	(bands[1] to bands[NUM_BANDS]).
+*/
+static void count_bands(const engine_t *e,unsigned *bands) {
+	unsigned i;
+	int x,y,bs=e->bucket_size;
+
+	memset(bands,0,(NUM_BANDS+1)*sizeof(unsigned));
+	for(i=0;i<e->num_drops;i++) {
+		engine_cell_xy(e,e->drops[i*2],&x,&y);
+		if(y<bs) {
+			bands[0]++;
+		} else {
+			bands[1+min((y-bs)*NUM_BANDS/e->area_height,NUM_BANDS-1)]++;
+		}
+	}
+}
+
+/*
+	sweep_world
+
+	Runs one world to the end, and writes one line (without newline) about it to line: its
+	settings, ticks/s, the tick it settled down at (-1 if it didn't), where the droplets
+	ended up, and the hash of the water at the end (see engine_t), which is the same for
+	the same settings on any machine. If the water stops altogether, the engine does too
+	(see IDLE_TICKS), so the run ends there, and it settled at the tick nothing moved in.
+	Returns non-0 if it couldn't be run; the line then says why.
+*/
+int sweep_world(const sweep_world_t *w,char *line,size_t size) {
+	unsigned bands[NUM_BANDS+1],last[NUM_BANDS+1],most;
+	int i,t,n,steady=-1,calm=0;
+	char dims[32];
+	double secs;
+	engine_t *e;
+	cmd_t c;
+
+	_snprintf(dims,sizeof(dims),"%dx%d",w->width,w->height);
+	dims[sizeof(dims)-1]=0;
+	if(w->land<0||w->land>=NUM_SWEEP_LANDS||w->neck<1||w->neck>=w->width/2||w->height<1||w->ticks<1) {
+		_snprintf(line,size,"%-12s bad settings",dims);
+		line[size-1]=0;
+		return 1;
+	}
+	e=engine_create(w->width,w->height,w->drops,w->seed);
+	if(!e) {
+		_snprintf(line,size,"%-12s couldn't create engine",dims);
+		line[size-1]=0;
+		return 1;
+	}
+	if(w->neck!=e->bucket_neck_size) {
+		/* Start again with the new neck */
+		e->bucket_neck_size=w->neck;
+		c.type=CMD_RESIZE;
+		c.u.size.width=w->width;
+		c.u.size.height=w->height;
+		c.u.size.contents=RESIZE_DISCARD;
+		engine_post(e,&c);
+	}
+	sweep_draw_land(e,w->land);
+	c.type=CMD_PAUSE;
+	c.u.paused=0;
+	engine_post(e,&c);
+	engine_update(e,0);
+	count_bands(e,last);
+	secs=now();
+	for(t=1;t<=w->ticks;t++) {
+		engine_update(e,1);
+		if(engine_settled(e)) {
+			steady=(int)engine_settled(e);
+			break;
+		}
+		if(t%STEADY_TICKS==0) {
+			count_bands(e,bands);
+			most=0;
+			for(i=0;i<=NUM_BANDS;i++) {
+				most=max(most,bands[i]>last[i]?bands[i]-last[i]:last[i]-bands[i]);
+			}
+			if(most*STEADY_FRACTION<=e->num_drops) {
+				/* Steady from the first of the looks in a row */
+				if(++calm==STEADY_LOOKS) {
+					steady=t-(STEADY_LOOKS-1)*STEADY_TICKS;
+				}
+			} else {
+				calm=0;
+				steady=-1;
+			}
+			memcpy(last,bands,sizeof(last));
+		}
+	}
+	secs=now()-secs;
+	count_bands(e,bands);
+	n=_snprintf(line,size,"%-12s %7u %5d %6u %-8s %7d %9.0f %7d",dims,w->drops,w->neck,w->seed,
+		land_names[w->land],w->ticks,min(t,w->ticks)/secs,steady);
+	for(i=0;i<=NUM_BANDS&&n>=0&&(size_t)n<size;i++) {
+		t=_snprintf(line+n,size-n," %7u",bands[i]);
+		n=t<0?-1:n+t;
+	}
+	if(n>=0&&(size_t)n<size) {
+		_snprintf(line+n,size-n," %08X%08X",(unsigned)(e->hash>>32),(unsigned)e->hash);
+	}
+	line[size-1]=0;
+	engine_destroy(e);
+	return 0;
+}
+
+/*
+	add_value
+
+	Adds a value for a setting to the spec. Returns 0 if there are too many.
+*/
+static int add_value(spec_t *s,int key,const char *value) {
+	if(s->num[key]==MAX_VALUES) {
+		return 0;
+	}
+	s->values[key][s->num[key]++]=_strdup(value);
+	return 1;
+}
+
+/*
+	read_spec
+
+	Reads a spec file. Returns 0, having said why, if it's no good.
+*/
+static int read_spec(spec_t *s,const char *name,FILE *out) {
+	char line[1024],*tok,*hash;
+	int key,n=0,ok=1;
+	unsigned a,b;
+	FILE *f;
+
+	memset(s,0,sizeof(*s));
+	f=fopen(name,"rt");
+	if(!f) {
+		fprintf(out,"sweep: couldn't open %s\n",name);
+		return 0;
+	}
+	while(ok&&fgets(line,sizeof(line),f)) {
+		n++;
+		hash=strchr(line,'#');
+		if(hash) {
+			*hash=0;
+		}
+		tok=strtok(line," \t\r\n");
+		if(!tok) {
+			continue;
+		}
+		for(key=0;key<NUM_KEYS&&strcmp(tok,key_names[key])!=0;key++) {
+		}
+		if(key==NUM_KEYS) {
+			fprintf(out,"sweep: %s(%d): unknown setting \"%s\"\n",name,n,tok);
+			ok=0;
+			break;
+		}
+		while(ok&&(tok=strtok(0," \t\r\n"))!=0) {
+			int end=0;
+
+			if(key!=KEY_SIZE&&key!=KEY_LAND&&sscanf(tok,"%u-%u%n",&a,&b,&end)==2&&!tok[end]&&a<=b) {
+				char num[16];
+
+				for(;ok&&a<=b;a++) {
+					_snprintf(num,sizeof(num),"%u",a);
+					ok=add_value(s,key,num);
+					if(a==b) {
+						break;
+					}
+				}
+			} else {
+				ok=add_value(s,key,tok);
+			}
+			if(!ok) {
+				fprintf(out,"sweep: %s(%d): more than %d values for %s\n",name,n,MAX_VALUES,key_names[key]);
+			}
+		}
+	}
+	fclose(f);
+	for(key=0;key<NUM_KEYS;key++) {
+		if(!s->num[key]) {
+			add_value(s,key,key_defaults[key]);
+		}
+	}
+	return ok;
+}
+
+static void free_spec(spec_t *s) {
+	int key,i;
+
+	for(key=0;key<NUM_KEYS;key++) {
+		for(i=0;i<s->num[key];i++) {
+			free(s->values[key][i]);
+		}
+	}
+}
+
+/*
+	world_of_run
+
+	Fills in the settings for one run of the sweep. The run number picks one value of
+	each; the last setting changes fastest. Values that don't make sense are left for
+	sweep_world to complain about.
+*/
+static void world_of_run(const spec_t *s,int run,sweep_world_t *w) {
+	const char *v[NUM_KEYS];
+	int key;
+
+	for(key=NUM_KEYS-1;key>=0;key--) {
+		v[key]=s->values[key][run%s->num[key]];
+		run/=s->num[key];
+	}
+	if(sscanf(v[KEY_SIZE],"%dx%d",&w->width,&w->height)!=2) {
+		w->width=w->height=0;
+	}
+	w->drops=strtoul(v[KEY_DROPS],0,0);
+	w->neck=atoi(v[KEY_NECK]);
+	w->seed=strtoul(v[KEY_SEED],0,0);
+	w->land=sweep_land(v[KEY_LAND]);
+	w->ticks=atoi(v[KEY_TICKS]);
+}
+
+static unsigned __stdcall job_thread(void *vj) {
+	job_t *j=vj;
+
+	sweep_world(&j->world,j->line,sizeof(j->line));
+	return 0;
+}
+
+/*
+	start_job
+
+	Starts a thread on one run of the sweep, tied to one CPU. It starts suspended, so it's
+	tied before it does anything. Returns 0 if it couldn't be started.
+*/
+static int start_job(job_t *j,const spec_t *s,int slot,int cpus) {
+	world_of_run(s,j->run,&j->world);
+	j->line[0]=0;
+	j->thread=(HANDLE)_beginthreadex(0,0,job_thread,j,CREATE_SUSPENDED,0);
+	if(!j->thread) {
+		return 0;
+	}
+	SetThreadAffinityMask(j->thread,(DWORD_PTR)1<<(slot%cpus));
+	ResumeThread(j->thread);
+	return 1;
+}
+
+/*
+	finish_job
+
+	Picks up the line a finished run wrote, and tidies up after it.
+
+	Return: the line, with the run number in front, to be freed by the caller.
+*/
+static char *finish_job(job_t *j) {
+	char *result;
+
+	result=malloc(strlen(j->line)+16);
+	if(result) {
+		sprintf(result,"%5d %s",j->run+1,j->line[0]?j->line:"failed");
+	}
+	CloseHandle(j->thread);
+	j->thread=0;
+	return result;
+}
+
+/*
+	sweep_main
+
+	Runs every combination of settings in a spec file, jobs at a time, and writes a line
+	for each to out, in order, once they've all finished.
+
+	jobs -> how many to run at once; 0 for one per CPU
+
+	Return: 0 if OK, or non-0 if the spec was no good or not every run could be started.
+*/
+int sweep_main(const char *spec,int jobs,FILE *out) {
+	spec_t s;
+	job_t *js;
+	HANDLE handles[MAX_JOBS];
+	int slots[MAX_JOBS];
+	char **results;
+	SYSTEM_INFO si;
+	int key,i,n,slot,total=1,next=0,active=0,cpus;
+	double secs;
+
+	if(!read_spec(&s,spec,out)) {
+		free_spec(&s);
+		return 1;
+	}
+	for(key=0;key<NUM_KEYS;key++) {
+		total*=s.num[key];
+	}
+	GetSystemInfo(&si);
+	cpus=max((int)si.dwNumberOfProcessors,1);
+	cpus=min(cpus,(int)sizeof(DWORD_PTR)*8);
+	if(jobs<=0) {
+		jobs=cpus;
+	}
+	jobs=min(jobs,MAX_JOBS);
+	results=calloc(total,sizeof(char *));
+	js=calloc(jobs,sizeof(job_t));
+	if(!results||!js) {
+		fprintf(out,"sweep: %d runs is too many\n",total);
+		free(results);
+		free(js);
+		free_spec(&s);
+		return 1;
+	}
+	fprintf(out,"# sweep: %s, %d runs, %d at a time on %d CPUs, using %s\n",spec,total,min(jobs,total),cpus,
+		cpu_name(cpu_best()));
+	fflush(out);
+	secs=now();
+	while(next<total||active) {
+		/* Fill any free slots. A slot's CPU is free when its slot is. */
+		for(slot=0;slot<jobs&&next<total;slot++) {
+			if(js[slot].thread) {
+				continue;
+			}
+			js[slot].run=next++;
+			if(!start_job(&js[slot],&s,slot,cpus)) {
+				results[js[slot].run]=malloc(64);
+				if(results[js[slot].run]) {
+					sprintf(results[js[slot].run],"%5d couldn't start",js[slot].run+1);
+				}
+				continue;
+			}
+			active++;
+		}
+		if(!active) {
+			continue;
+		}
+		n=0;
+		for(slot=0;slot<jobs;slot++) {
+			if(js[slot].thread) {
+				handles[n]=js[slot].thread;
+				slots[n++]=slot;
+			}
+		}
+		i=(int)(WaitForMultipleObjects(n,handles,FALSE,INFINITE)-WAIT_OBJECT_0);
+		if(i<0||i>=n) {
+			/* The runs still going are using js and s, so wait for each of them in turn
+			   before giving up. Nothing more is started. */
+			dprintf("sweep: WaitForMultipleObjects failed\n");
+			for(slot=0;slot<jobs;slot++) {
+				if(js[slot].thread) {
+					WaitForSingleObject(js[slot].thread,INFINITE);
+					results[js[slot].run]=finish_job(&js[slot]);
+				}
+			}
+			active=0;
+			break;
+		}
+		slot=slots[i];
+		results[js[slot].run]=finish_job(&js[slot]);
+		active--;
+	}
+	secs=now()-secs;
+	fprintf(out,"%s\n",heading);
+	for(i=0;i<total;i++) {
+		if(results[i]) {
+			fprintf(out,"%s\n",results[i]);
+		} else if(i>=next) {
+			fprintf(out,"%5d not run\n",i+1);
+		} else {
+			fprintf(out,"  out of memory\n");
+		}
+		free(results[i]);
+	}
+	fprintf(out,"# %d runs in %.1f s\n",total,secs);
+	free(results);
+	free(js);
+	free_spec(&s);
+	return next<total;
+}
@@ -0,0 +1,31 @@
+#ifndef TOM_SWEEP_H
+#define TOM_SWEEP_H
+
+#include <stdio.h>
+#include "engine.h"
+
+/* Landscapes a world can start with */
+enum {
+	SWEEP_LAND_EMPTY,					/* just the border */
+	SWEEP_LAND_SHELVES,					/* shelves from alternate sides, for the water to run down */
+	SWEEP_LAND_VESSELS,					/* a U-tube, filled down one arm; see sweep_vessels */
+	NUM_SWEEP_LANDS
+};
+
+/* Everything that makes one world of a sweep different from the next */
+typedef struct sweep_world_t {
+	int width,height;					/* area size */
+	unsigned drops;						/* number of droplets */
+	int neck;							/* bucket_neck_size */
+	unsigned seed;						/* for the engine's random numbers, which decide droplet types and directions */
+	int land;							/* SWEEP_LAND_xxx */
+	int ticks;							/* how long to run it for */
+}sweep_world_t;
+
+int sweep_land(const char *name);
+void sweep_draw_land(engine_t *e,int land);
+void sweep_vessels(int width,int height,RECT *arms);
+int sweep_world(const sweep_world_t *w,char *line,size_t size);
+int sweep_main(const char *spec,int jobs,FILE *out);
+
+#endif